@@ -0,0 +1,165 @@
+#ifndef VULKAN_RENDERER_BINDLESS_HPP
+#define VULKAN_RENDERER_BINDLESS_HPP
+
+#include <algorithm>
+#include <array>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "defaults.hpp"
+#include "vulkan/vulkan.hpp"
+
+namespace vulkan_renderer {
+
+enum class BindlessType : uint32_t { Image = 0, Buffer = 1 };
+
+// A single descriptor set shared by every pipeline on the device, holding an
+// array of combined image samplers at binding 0 and an array of storage
+// buffers at binding 1. Resources are registered once and addressed in shaders
+// by their index, given through push constants or per draw data, so the set is
+// bound once per command buffer instead of once per draw.
+//
+// Shaders declare the arrays in defaults::descriptor::BindlessSet, e.g.
+//   layout(set = 1, binding = 0) uniform sampler2D images[];
+//   layout(set = 1, binding = 1) buffer Buffers { ... } buffers[];
+//
+// The set is update after bind so resources can be registered while command
+// buffers using it are pending. A released index must not be used by any
+// pending draw
+class BindlessDescriptors {
+ public:
+  BindlessDescriptors(vk::PhysicalDevice const& physicalDevice,
+                      vk::Device const& device)
+      : device_(device) {
+    auto properties = physicalDevice.getProperties2<
+        vk::PhysicalDeviceProperties2,
+        vk::PhysicalDeviceDescriptorIndexingPropertiesEXT>();
+    auto const& limits =
+        properties.get<vk::PhysicalDeviceDescriptorIndexingPropertiesEXT>();
+    // Combined image samplers count against both the sampler and sampled
+    // image limits
+    capacities_[0] =
+        std::min({defaults::descriptor::BindlessImages,
+                  limits.maxPerStageDescriptorUpdateAfterBindSamplers,
+                  limits.maxPerStageDescriptorUpdateAfterBindSampledImages,
+                  limits.maxDescriptorSetUpdateAfterBindSamplers,
+                  limits.maxDescriptorSetUpdateAfterBindSampledImages});
+    capacities_[1] =
+        std::min({defaults::descriptor::BindlessBuffers,
+                  limits.maxPerStageDescriptorUpdateAfterBindStorageBuffers,
+                  limits.maxDescriptorSetUpdateAfterBindStorageBuffers});
+
+    std::array<vk::DescriptorSetLayoutBinding, 2> bindings{
+        vk::DescriptorSetLayoutBinding{
+            0, vk::DescriptorType::eCombinedImageSampler, capacities_[0],
+            vk::ShaderStageFlagBits::eAll},
+        vk::DescriptorSetLayoutBinding{1, vk::DescriptorType::eStorageBuffer,
+                                       capacities_[1],
+                                       vk::ShaderStageFlagBits::eAll}};
+    vk::DescriptorBindingFlagsEXT const bindingFlag =
+        vk::DescriptorBindingFlagBitsEXT::ePartiallyBound |
+        vk::DescriptorBindingFlagBitsEXT::eUpdateAfterBind |
+        vk::DescriptorBindingFlagBitsEXT::eUpdateUnusedWhilePending;
+    std::array<vk::DescriptorBindingFlagsEXT, 2> bindingFlags{bindingFlag,
+                                                              bindingFlag};
+
+    vk::StructureChain<vk::DescriptorSetLayoutCreateInfo,
+                       vk::DescriptorSetLayoutBindingFlagsCreateInfoEXT>
+        layoutInfo{
+            vk::DescriptorSetLayoutCreateInfo{
+                vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPoolEXT,
+                bindings},
+            vk::DescriptorSetLayoutBindingFlagsCreateInfoEXT{bindingFlags}};
+    layout_ = device_.createDescriptorSetLayoutUnique(
+        layoutInfo.get<vk::DescriptorSetLayoutCreateInfo>());
+
+    std::array<vk::DescriptorPoolSize, 2> poolSizes{
+        vk::DescriptorPoolSize{vk::DescriptorType::eCombinedImageSampler,
+                               capacities_[0]},
+        vk::DescriptorPoolSize{vk::DescriptorType::eStorageBuffer,
+                               capacities_[1]}};
+    pool_ = device_.createDescriptorPoolUnique(
+        {vk::DescriptorPoolCreateFlagBits::eUpdateAfterBindEXT, 1, poolSizes});
+
+    auto layout = layout_.get();
+    set_ = device_.allocateDescriptorSets({pool_.get(), layout}).front();
+  }
+
+  BindlessDescriptors(BindlessDescriptors const&) = delete;
+  BindlessDescriptors& operator=(BindlessDescriptors const&) = delete;
+
+  uint32_t Register(vk::DescriptorImageInfo const& imageInfo) {
+    auto index = TakeIndex(BindlessType::Image);
+    device_.updateDescriptorSets(
+        vk::WriteDescriptorSet{set_, 0, index, 1,
+                               vk::DescriptorType::eCombinedImageSampler,
+                               &imageInfo},
+        nullptr);
+    return index;
+  }
+
+  uint32_t Register(vk::DescriptorBufferInfo const& bufferInfo) {
+    auto index = TakeIndex(BindlessType::Buffer);
+    device_.updateDescriptorSets(
+        vk::WriteDescriptorSet{set_, 1, index, 1,
+                               vk::DescriptorType::eStorageBuffer, nullptr,
+                               &bufferInfo},
+        nullptr);
+    return index;
+  }
+
+  // The descriptor is left as it is since the binding is partially bound
+  void Release(BindlessType const type, uint32_t const index) {
+    std::scoped_lock lock(mutex_);
+    freeIndices_[static_cast<uint32_t>(type)].push_back(index);
+  }
+
+  vk::DescriptorSetLayout GetLayout() const { return layout_.get(); }
+  vk::DescriptorSet GetSet() const { return set_; }
+
+  uint32_t GetCapacity(BindlessType const type) const {
+    return capacities_[static_cast<uint32_t>(type)];
+  }
+
+  // Whether a shader binding in the bindless set can use the shared layout.
+  // Runtime arrays are reflected with a count of 0
+  bool IsCompatible(vk::DescriptorSetLayoutBinding const& binding) const {
+    std::array<vk::DescriptorType, 2> const types{
+        vk::DescriptorType::eCombinedImageSampler,
+        vk::DescriptorType::eStorageBuffer};
+    return binding.binding < types.size() &&
+           binding.descriptorType == types[binding.binding] &&
+           binding.descriptorCount <= capacities_[binding.binding];
+  }
+
+ protected:
+  uint32_t TakeIndex(BindlessType const type) {
+    auto i = static_cast<uint32_t>(type);
+    std::scoped_lock lock(mutex_);
+    if (!freeIndices_[i].empty()) {
+      auto index = freeIndices_[i].back();
+      freeIndices_[i].pop_back();
+      return index;
+    }
+    if (numIndices_[i] == capacities_[i]) {
+      throw std::runtime_error("Bindless descriptor array is full");
+    }
+    return numIndices_[i]++;
+  }
+
+ private:
+  vk::Device device_;
+  vk::UniqueDescriptorSetLayout layout_;
+  vk::UniqueDescriptorPool pool_;
+  vk::DescriptorSet set_;
+
+  std::array<uint32_t, 2> capacities_;
+  std::array<uint32_t, 2> numIndices_{};
+  std::array<std::vector<uint32_t>, 2> freeIndices_;
+  std::mutex mutex_;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
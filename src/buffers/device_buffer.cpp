@@ -2,11 +2,19 @@
 
 namespace vulkan_renderer {
 
-void DeviceBuffer::Upload(void const* data, Queues const&, DeviceApi& device) {
-  auto memoryLocation = device.MapMemory(allocation_);
-  memcpy(memoryLocation, data, size_);
-  device.UnmapMemory(allocation_);
-  isOutdated_ = false;
+UploadToken DeviceBuffer::Upload(void const* data, Queues const& queues,
+                                 DeviceApi& device) {
+  if (!data_) {
+    auto region = WriteStagingData(data, size_, queues, device);
+    uploadToken_ = CopyToBuffer(region, GetBuffer(), queues, device);
+    isOutdated_ = false;
+    return uploadToken_;
+  }
+
+  memcpy(GetData<char>().data(), data, size_);
+  Flush(device);
+  uploadToken_ = 0;
+  return uploadToken_;
 }
 
 void DeviceBuffer::AddDescriptorSetUpdate(
@@ -16,53 +24,154 @@ void DeviceBuffer::AddDescriptorSetUpdate(
   descriptorSets.AddUpdate(set, imageIndex, writeSet);
 }
 
-void TransferDeviceBuffer::CopyToBuffer(vk::Buffer const& targetBuffer,
-                                        Queues const& queues,
-                                        DeviceApi& device) {
-  auto cmdBuffer = device.AllocateCommandBuffer();
-  cmdBuffer->begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
-  vk::BufferCopy copyRegion{0, 0, GetSize()};
-  cmdBuffer->copyBuffer(GetBuffer(), targetBuffer, copyRegion);
-  cmdBuffer->end();
-
-  queues.SubmitToGraphics(cmdBuffer.get());
-  // TODO: remove if we can deallocate in response to completion in callback
-  queues.GraphicsWaitIdle();
+StagingRegion WriteStagingData(void const* data, vk::DeviceSize const size,
+                               Queues const& queues, DeviceApi& device) {
+  // Submit early so that the staging space can be reclaimed
+  if (device.IsStagingFull(size)) {
+    FlushUploads(queues, device);
+  }
+  return device.WriteStagingData(data, size);
 }
 
-void TransferDeviceBuffer::CopyToImage(vk::Image const& targetImage,
-                                       ImageProperties& properties,
-                                       Queues const& queues,
-                                       DeviceApi& device) {
-  auto cmdBuffer = device.AllocateCommandBuffer();
-  cmdBuffer->begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+UploadToken FlushUploads(Queues const& queues, DeviceApi& device) {
+  if (!device.HasPendingUpload()) return 0;
 
-  TransitionImageLayout(targetImage, 0, properties.MipLevels, properties.Format,
-                        vk::ImageLayout::eUndefined,
-                        vk::ImageLayout::eTransferDstOptimal, cmdBuffer.get());
+  auto commands = device.TakePendingUpload();
+  if (!commands.Graphics) {
+    // Later submissions on the queue must see the copied data. Ownership
+    // transfers carry this in their acquire barriers
+    vk::MemoryBarrier barrier{vk::AccessFlagBits::eTransferWrite,
+                              vk::AccessFlagBits::eVertexAttributeRead |
+                                  vk::AccessFlagBits::eIndexRead |
+                                  vk::AccessFlagBits::eUniformRead |
+                                  vk::AccessFlagBits::eShaderRead};
+    commands.Transfer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eVertexInput |
+            vk::PipelineStageFlagBits::eVertexShader |
+            vk::PipelineStageFlagBits::eFragmentShader,
+        {}, barrier, nullptr, nullptr);
+  }
+
+  commands.Transfer->end();
+  if (commands.Graphics) {
+    commands.Graphics->end();
+  }
+
+  vk::CommandBuffer const transfer = commands.Transfer.get();
+  vk::CommandBuffer const graphics =
+      commands.Graphics ? commands.Graphics.get() : vk::CommandBuffer{};
+  vk::Semaphore const released =
+      commands.Released ? commands.Released.get() : vk::Semaphore{};
+
+  auto submission = device.SubmitStagingData(std::move(commands));
+  queues.SubmitUpload(transfer, graphics, released, submission.Fence);
+  return submission.Token;
+}
 
-  vk::BufferImageCopy region{
-      0, 0, 0, {properties.Aspect, 0, 0, 1}, {0, 0, 0}, properties.Extent};
-  cmdBuffer->copyBufferToImage(GetBuffer(), targetImage,
-                               vk::ImageLayout::eTransferDstOptimal, 1,
-                               &region);
+UploadToken CopyToBuffer(StagingRegion const& staging,
+                         vk::Buffer const& targetBuffer, Queues const&,
+                         DeviceApi& device,
+                         vk::DeviceSize const targetOffset) {
+  auto& commands = device.GetPendingUpload();
+  vk::BufferCopy copyRegion{staging.Offset, targetOffset, staging.Size};
+  commands.Transfer->copyBuffer(staging.Buffer, targetBuffer, copyRegion);
 
-  GenerateMipMaps(targetImage, properties, cmdBuffer.get());
+  if (commands.Graphics) {
+    // Release from the transfer family and acquire on the graphics family
+    vk::BufferMemoryBarrier release{vk::AccessFlagBits::eTransferWrite,
+                                    {},
+                                    device.GetTransferFamily(),
+                                    device.GetGraphicsFamily(),
+                                    targetBuffer,
+                                    targetOffset,
+                                    staging.Size};
+    commands.Transfer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eBottomOfPipe, {}, nullptr, release,
+        nullptr);
 
-  cmdBuffer->end();
+    vk::BufferMemoryBarrier acquire{{},
+                                    vk::AccessFlagBits::eVertexAttributeRead |
+                                        vk::AccessFlagBits::eIndexRead |
+                                        vk::AccessFlagBits::eUniformRead |
+                                        vk::AccessFlagBits::eShaderRead,
+                                    device.GetTransferFamily(),
+                                    device.GetGraphicsFamily(),
+                                    targetBuffer,
+                                    targetOffset,
+                                    staging.Size};
+    commands.Graphics->pipelineBarrier(
+        vk::PipelineStageFlagBits::eTopOfPipe,
+        vk::PipelineStageFlagBits::eVertexInput |
+            vk::PipelineStageFlagBits::eVertexShader |
+            vk::PipelineStageFlagBits::eFragmentShader,
+        {}, nullptr, acquire, nullptr);
+  }
 
-  queues.SubmitToGraphics(cmdBuffer.get());
-  // TODO: remove if we can deallocate in response to completion in callback
-  queues.GraphicsWaitIdle();
+  device.CountUpload(staging.Size);
+  return device.GetPendingUploadToken();
 }
 
-void OptimisedDeviceBuffer::Upload(void const* data, Queues const& queues,
-                                   DeviceApi& device) {
-  TransferDeviceBuffer transferBuffer{GetSize(), device};
-  transferBuffer.Upload(data, queues, device);
-  transferBuffer.CopyToBuffer(GetBuffer(), queues, device);
+UploadToken CopyToImage(StagingRegion const& staging,
+                        vk::Image const& targetImage,
+                        ImageProperties const& properties, Queues const&,
+                        DeviceApi& device) {
+  auto& commands = device.GetPendingUpload();
+
+  TransitionImageLayout(targetImage, 0, properties.MipLevels, properties.Format,
+                        vk::ImageLayout::eUndefined,
+                        vk::ImageLayout::eTransferDstOptimal,
+                        commands.Transfer.get());
+
+  vk::BufferImageCopy region{staging.Offset,
+                             0,
+                             0,
+                             {properties.Aspect, 0, 0, 1},
+                             {0, 0, 0},
+                             properties.Extent};
+  commands.Transfer->copyBufferToImage(staging.Buffer, targetImage,
+                                       vk::ImageLayout::eTransferDstOptimal, 1,
+                                       &region);
+
+  if (commands.Graphics) {
+    // Blits need a graphics queue so mip generation happens after ownership
+    // of the image has been acquired by the graphics family
+    vk::ImageSubresourceRange range{properties.Aspect, 0, properties.MipLevels,
+                                    0, 1};
+    vk::ImageMemoryBarrier release{vk::AccessFlagBits::eTransferWrite,
+                                   {},
+                                   vk::ImageLayout::eTransferDstOptimal,
+                                   vk::ImageLayout::eTransferDstOptimal,
+                                   device.GetTransferFamily(),
+                                   device.GetGraphicsFamily(),
+                                   targetImage,
+                                   range};
+    commands.Transfer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eBottomOfPipe, {}, nullptr, nullptr,
+        release);
+
+    vk::ImageMemoryBarrier acquire{{},
+                                   vk::AccessFlagBits::eTransferRead |
+                                       vk::AccessFlagBits::eTransferWrite,
+                                   vk::ImageLayout::eTransferDstOptimal,
+                                   vk::ImageLayout::eTransferDstOptimal,
+                                   device.GetTransferFamily(),
+                                   device.GetGraphicsFamily(),
+                                   targetImage,
+                                   range};
+    commands.Graphics->pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
+                                       vk::PipelineStageFlagBits::eTransfer,
+                                       {}, nullptr, nullptr, acquire);
+
+    GenerateMipMaps(targetImage, properties, commands.Graphics.get());
+  } else {
+    GenerateMipMaps(targetImage, properties, commands.Transfer.get());
+  }
 
-  SetOutdated();
+  device.CountUpload(staging.Size);
+  return device.GetPendingUploadToken();
 }
 
 vk::AccessFlags GetSourceAccessMask(vk::ImageLayout const sourceLayout) {
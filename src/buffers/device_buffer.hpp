@@ -1,6 +1,9 @@
 #ifndef VULKAN_RENDERER_DEVICE_BUFFER_HPP
 #define VULKAN_RENDERER_DEVICE_BUFFER_HPP
 
+#include <span>
+
+#include "command_state.hpp"
 #include "descriptor_sets.hpp"
 #include "device_api.hpp"
 #include "image_properties.hpp"
@@ -16,74 +19,88 @@ class DeviceBuffer {
                vk::MemoryPropertyFlags const memoryFlags =
                    vk::MemoryPropertyFlagBits::eHostVisible |
                    vk::MemoryPropertyFlagBits::eHostCoherent)
-      : buffer_(device.CreateBuffer(size, bufferUsage)),
+      : device_(&device),
+        buffer_(device.CreateBuffer(size, bufferUsage)),
         isOutdated_(true),
         allocation_(device.AllocateMemory(buffer_.get(), memoryFlags)),
+        data_(memoryFlags & vk::MemoryPropertyFlagBits::eHostVisible
+                  ? device.GetMappedData(allocation_)
+                  : nullptr),
         size_(size),
-        offset_(device.GetMemoryOffset(allocation_)),
         bufferInfo_(GetBuffer(), 0, size_) {}
 
-  virtual ~DeviceBuffer() = default;
+  // Copies into the buffer may still be pending, so it is handed to the
+  // device until they have completed
+  virtual ~DeviceBuffer() {
+    if (buffer_) {
+      device_->Release(uploadToken_, std::move(buffer_),
+                       std::move(allocation_));
+    }
+  }
   DeviceBuffer(const DeviceBuffer&) = delete;
   DeviceBuffer(DeviceBuffer&&) = default;
 
-  virtual void Upload(void const* data, Queues const&, DeviceApi&);
+  // Returns a token that can be used to check when the data is available on
+  // the device. Host visible uploads are complete immediately, others are
+  // copied through the staging ring
+  virtual UploadToken Upload(void const* data, Queues const&, DeviceApi&);
 
   void AddDescriptorSetUpdate(uint32_t const set, ImageIndex const,
                               vk::WriteDescriptorSet&, DescriptorSets&) const;
 
-  void SetOutdated() { isOutdated_ = true; }
-  bool IsOutdated() const { return isOutdated_; }
+  // Host visible buffers can be written in place. Call Flush once the writes
+  // are finished so they are visible on non-coherent memory
+  template <typename T>
+  std::span<T> GetData() {
+    assert(data_);
+    return {static_cast<T*>(data_), size_ / sizeof(T)};
+  }
 
-  void BindVertex(vk::CommandBuffer const& cmdBuffer) const {
-    cmdBuffer.bindVertexBuffers(0, buffer_.get(), {offset_});
+  void Flush(DeviceApi& device) {
+    device.FlushMemory(allocation_);
+    isOutdated_ = false;
   }
 
-  void BindIndex(vk::CommandBuffer const& cmdBuffer) const {
-    cmdBuffer.bindIndexBuffer(buffer_.get(), offset_, vk::IndexType::eUint32);
+  // Makes device writes to a host visible buffer readable through GetData
+  void Invalidate(DeviceApi& device) const {
+    device.InvalidateMemory(allocation_);
   }
 
- protected:
-  vk::Buffer const& GetBuffer() { return buffer_.get(); }
-  uint32_t const& GetSize() { return size_; }
+  void SetOutdated() { isOutdated_ = true; }
+  bool IsOutdated() const { return isOutdated_; }
+
+  vk::Buffer const& GetBuffer() const { return buffer_.get(); }
+  vk::DescriptorBufferInfo const& GetBufferInfo() const { return bufferInfo_; }
+  uint32_t GetSize() const { return size_; }
 
  private:
+  DeviceApi* device_;
   vk::UniqueBuffer buffer_;
   bool isOutdated_;
   Allocation allocation_;
+  void* data_;
   uint32_t size_;
-  uint32_t offset_;
-  bool optimise_;
   vk::DescriptorBufferInfo bufferInfo_;
+  UploadToken uploadToken_ = 0;
 };
 
-class TransferDeviceBuffer : protected DeviceBuffer {
- public:
-  TransferDeviceBuffer(uint32_t const size, DeviceApi& device)
-      : DeviceBuffer(size, vk::BufferUsageFlagBits::eTransferSrc, device) {}
-
-  // Expose it publicly
-  virtual void Upload(void const* data, Queues const& queues,
-                      DeviceApi& device) override {
-    DeviceBuffer::Upload(data, queues, device);
-  }
+// Writes to the device staging ring, flushing pending uploads if it is full
+StagingRegion WriteStagingData(void const* data, vk::DeviceSize const size,
+                               Queues const&, DeviceApi&);
 
-  void CopyToBuffer(vk::Buffer const& targetBuffer, Queues const&, DeviceApi&);
+// Submits every copy recorded since the last flush in a single submission
+UploadToken FlushUploads(Queues const&, DeviceApi&);
 
-  void CopyToImage(vk::Image const& targetImage, ImageProperties&,
-                   Queues const&, DeviceApi&);
-};
+// Records copies of data that has been written to the device staging ring.
+// Nothing is submitted until FlushUploads so the returned token must be
+// checked before use. Only the copied range of the target is acquired by the
+// graphics family
+UploadToken CopyToBuffer(StagingRegion const&, vk::Buffer const& targetBuffer,
+                         Queues const&, DeviceApi&,
+                         vk::DeviceSize const targetOffset = 0);
 
-class OptimisedDeviceBuffer : public DeviceBuffer {
- public:
-  OptimisedDeviceBuffer(uint32_t const size,
-                        vk::BufferUsageFlags const bufferUsage,
-                        DeviceApi& device)
-      : DeviceBuffer(size, bufferUsage | vk::BufferUsageFlagBits::eTransferDst,
-                     device, vk::MemoryPropertyFlagBits::eDeviceLocal) {}
-
-  virtual void Upload(void const* data, Queues const&, DeviceApi&) override;
-};
+UploadToken CopyToImage(StagingRegion const&, vk::Image const& targetImage,
+                        ImageProperties const&, Queues const&, DeviceApi&);
 
 void TransitionImageLayout(vk::Image const&, uint32_t const mipLevel,
                            uint32_t const numMipLevels, vk::Format const,
@@ -14,7 +14,8 @@ class ImageBuffer {
  public:
   ImageBuffer(ImageProperties const& properties, Queues const& queues,
               DeviceApi& device)
-      : properties_(ValidateImageProperties(properties, device)),
+      : device_(&device),
+        properties_(ValidateImageProperties(properties, device)),
         image_(device.CreateImage(
             {
                 {},
@@ -30,38 +31,54 @@ class ImageBuffer {
             },
             queues.GetQueueFamilies().UniqueIndices())),
         allocation_(device.AllocateMemory(
-            image_.get(), vk::MemoryPropertyFlagBits::eDeviceLocal)),
+            image_.get(), vk::MemoryPropertyFlagBits::eDeviceLocal,
+            properties_.Tiling)),
         imageView_(device.CreateImageView(
             image_.get(), vk::ImageViewType::e2D, properties_.Format, {},
             {properties_.Aspect, 0, properties_.MipLevels, 0, 1})) {}
 
-  void Upload(std::vector<unsigned char> data, Queues const& queues,
-              DeviceApi& device) {
-    TransferDeviceBuffer transferBuffer{properties_.Extent.width *
-                                            properties_.Extent.height *
-                                            properties_.Extent.depth * 4,
-                                        device};
-    transferBuffer.Upload(data.data(), queues, device);
-    transferBuffer.CopyToImage(image_.get(), properties_, queues, device);
+  // Copies into the image may still be pending, so it is handed to the
+  // device until they have completed
+  ~ImageBuffer() {
+    if (image_) {
+      device_->Release(uploadToken_, std::move(imageView_), std::move(image_),
+                       std::move(allocation_));
+    }
+  }
+  ImageBuffer(ImageBuffer const&) = delete;
+  ImageBuffer(ImageBuffer&&) = default;
+
+  UploadToken Upload(std::vector<unsigned char> data, Queues const& queues,
+                     DeviceApi& device) {
+    auto staging = WriteStagingData(
+        data.data(),
+        properties_.Extent.width * properties_.Extent.height *
+            properties_.Extent.depth * 4,
+        queues, device);
+    uploadToken_ =
+        CopyToImage(staging, image_.get(), properties_, queues, device);
 
     isOutdated_ = false;
+    return uploadToken_;
   }
 
   void SetOutdated() { isOutdated_ = true; }
   bool IsOutdated() const { return isOutdated_; }
 
-  vk::ImageView const& GetImageView() const { return imageView_.get(); }
+  UploadToken GetUploadToken() const { return uploadToken_; }
 
- protected:
+  vk::ImageView const& GetImageView() const { return imageView_.get(); }
   vk::Image const& GetImage() const { return image_.get(); }
   ImageProperties const& GetProperties() const { return properties_; }
 
  private:
+  DeviceApi* device_;
   ImageProperties properties_;
   vk::UniqueImage image_;
   Allocation allocation_;
   vk::UniqueImageView imageView_;
   bool isOutdated_ = true;
+  UploadToken uploadToken_ = 0;
 };
 
 class SamplerImageBuffer : public ImageBuffer {
@@ -102,6 +119,8 @@ class SamplerImageBuffer : public ImageBuffer {
     descriptorSets.AddUpdate(set, writeSet);
   }
 
+  vk::DescriptorImageInfo const& GetImageInfo() const { return imageInfo_; }
+
  private:
   vk::UniqueSampler sampler_;
   vk::DescriptorImageInfo imageInfo_;
@@ -113,25 +132,31 @@ class DepthBuffer : public ImageBuffer {
               vk::SampleCountFlagBits const multiSampleCount,
               Queues const& queues, DeviceApi& device)
       : ImageBuffer({.Extent = {windowExtent.width, windowExtent.height, 1},
-                     .Usage = vk::ImageUsageFlagBits::eDepthStencilAttachment,
+                     .Usage = GetUsage(multiSampleCount, device),
                      .Format = device.GetDepthBufferFormat(),
                      .Aspect = vk::ImageAspectFlagBits::eDepth,
                      .SampleCount = multiSampleCount},
                     queues, device) {
-    auto cmdBuffer = device.AllocateCommandBuffer();
-    cmdBuffer->begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
-    auto properties = GetProperties();
-    TransitionImageLayout(GetImage(), 0, properties.MipLevels,
-                          properties.Format, vk::ImageLayout::eUndefined,
-                          vk::ImageLayout::eDepthStencilAttachmentOptimal,
-                          cmdBuffer.get());
-    cmdBuffer->end();
-
-    queues.SubmitToGraphics(cmdBuffer.get());
-    queues.GraphicsWaitIdle();
+    // No transition needed as the render pass depth attachment starts from an
+    // undefined layout and moves it into eDepthStencilAttachmentOptimal
   }
 
   vk::Format GetFormat() { return GetProperties().Format; }
+
+ protected:
+  // Single sampled depth is read to build the culling depth pyramid when the
+  // format can be sampled, see CullingPass
+  static vk::ImageUsageFlags GetUsage(
+      vk::SampleCountFlagBits const multiSampleCount,
+      DeviceApi const& device) {
+    vk::ImageUsageFlags usage =
+        vk::ImageUsageFlagBits::eDepthStencilAttachment;
+    if (multiSampleCount == vk::SampleCountFlagBits::e1 &&
+        device.IsSampledImageSupported(device.GetDepthBufferFormat())) {
+      usage |= vk::ImageUsageFlagBits::eSampled;
+    }
+    return usage;
+  }
 };
 
 }  // namespace vulkan_renderer
@@ -1,6 +1,10 @@
 #ifndef VULKAN_RENDERER_UNIFORM_BUFFER_HPP
 #define VULKAN_RENDERER_UNIFORM_BUFFER_HPP
 
+#include <algorithm>
+#include <cstring>
+
+#include "command_state.hpp"
 #include "descriptor_sets.hpp"
 #include "device_api.hpp"
 #include "queues.hpp"
@@ -17,9 +21,15 @@ class Uniform {
   virtual bool IsOutdated(ImageIndex const) const = 0;
   virtual void Upload(ImageIndex const, Queues const&, DeviceApi&) = 0;
 
+  // Whether the uniform data has finished uploading and can be drawn with
+  virtual bool IsReady(DeviceApi const&) const { return true; }
+
   virtual void AddDescriptorSetUpdate(DescriptorSets&) const = 0;
 };
 
+// Uniform data lives in the device's uniform arena at the same offset in every
+// swapchain image's buffer. Its descriptor is dynamic so the offset is given
+// when binding and updating the data never needs a descriptor update
 template <typename T>
 class UniformBuffer : public Uniform {
  public:
@@ -29,17 +39,117 @@ class UniformBuffer : public Uniform {
   void Update(T const& data) {
     if (data_ != data) {
       data_ = data;
-      for (auto& buffer : deviceBuffers_) {
-        buffer.SetOutdated();
-      }
+      std::fill(outdated_.begin(), outdated_.end(), true);
     }
   }
 
  protected:
-  void Allocate(Queues const& queues, DeviceApi& device) override {
+  void Allocate(Queues const&, DeviceApi& device) override {
+    if (!allocation_) {
+      allocation_ = std::make_unique<Allocation>(
+          device.AllocateUniform(sizeof(T)));
+      offset_ = device.GetUniformOffset(*allocation_);
+    }
+
+    // The number of swapchain images may change when it is recreated
+    outdated_.assign(device.GetNumSwapchainImages(), true);
+    bufferInfos_.clear();
+    for (uint32_t i = 0; i < device.GetNumSwapchainImages(); ++i) {
+      bufferInfos_.push_back(
+          {device.GetUniformBuffer(i, *allocation_), 0, sizeof(T)});
+    }
+  }
+
+  void Deallocate() override {
+    allocation_.reset();
+    outdated_.clear();
+    bufferInfos_.clear();
+  }
+
+  bool IsOutdated(ImageIndex const imageIndex) const override {
+    assert(imageIndex < outdated_.size());
+    return outdated_[imageIndex];
+  }
+
+  void Upload(ImageIndex const imageIndex, Queues const& queues,
+              DeviceApi& device) override {
+    if (!allocation_) {
+      Allocate(queues, device);
+    }
+
+    assert(imageIndex < outdated_.size());
+    memcpy(device.GetUniformData(imageIndex, *allocation_), &data_,
+           sizeof(T));
+    outdated_[imageIndex] = false;
+  }
+
+  void AddDescriptorSetUpdate(DescriptorSets& descriptorSets) const override {
+    for (uint32_t i = 0; i < bufferInfos_.size(); ++i) {
+      vk::WriteDescriptorSet writeSet{{},
+                                      binding_,
+                                      0,
+                                      1,
+                                      vk::DescriptorType::eUniformBufferDynamic,
+                                      nullptr,
+                                      &bufferInfos_[i],
+                                      nullptr};
+      descriptorSets.AddUpdate(set_, i, writeSet);
+    }
+    descriptorSets.SetDynamicOffset(set_, binding_, offset_);
+  }
+
+ private:
+  T data_;
+  uint32_t binding_;
+  uint32_t set_;
+  std::unique_ptr<Allocation> allocation_;
+  uint32_t offset_ = 0;
+  std::vector<bool> outdated_;
+  std::vector<vk::DescriptorBufferInfo> bufferInfos_;
+};
+
+// Per draw data, such as transforms, that changes every frame. Draws are given
+// a fixed index into a storage buffer per swapchain image and draw with it as
+// their first instance so shaders read their data with gl_InstanceIndex.
+// Unlike push constants, updating the data never needs command buffers to be
+// re-recorded. A single buffer is shared by all the draws using it
+template <typename T>
+class DrawDataBuffer : public Uniform {
+ public:
+  DrawDataBuffer(uint32_t const capacity, uint32_t const binding,
+                 uint32_t const set = 0)
+      : data_(capacity), binding_(binding), set_(set) {}
+
+  // Returns the index to give to Buffer::SetDrawIndex
+  uint32_t AddDraw(T const& data) {
+    assert(numDraws_ < data_.size());
+    data_[numDraws_] = data;
+    SetOutdated();
+    return numDraws_++;
+  }
+
+  void Update(uint32_t const index, T const& data) {
+    assert(index < numDraws_);
+    if (data_[index] != data) {
+      data_[index] = data;
+      SetOutdated();
+    }
+  }
+
+ protected:
+  void SetOutdated() {
+    for (auto& buffer : deviceBuffers_) {
+      buffer.SetOutdated();
+    }
+  }
+
+  // Every buffer drawing with the data allocates it
+  void Allocate(Queues const&, DeviceApi& device) override {
+    if (!deviceBuffers_.empty()) return;
     for (uint32_t i = 0; i < device.GetNumSwapchainImages(); ++i) {
-      deviceBuffers_.emplace_back(
-          sizeof(T), vk::BufferUsageFlagBits::eUniformBuffer, device);
+      deviceBuffers_.emplace_back(data_.size() * sizeof(T),
+                                  vk::BufferUsageFlagBits::eStorageBuffer,
+                                  device);
     }
   }
 
@@ -57,13 +167,13 @@ class UniformBuffer : public Uniform {
     }
 
     assert(imageIndex < deviceBuffers_.size());
-    deviceBuffers_[imageIndex].Upload(&data_, queues, device);
+    deviceBuffers_[imageIndex].Upload(data_.data(), queues, device);
   }
 
   void AddDescriptorSetUpdate(DescriptorSets& descriptorSets) const override {
     for (uint32_t i = 0; i < deviceBuffers_.size(); ++i) {
       vk::WriteDescriptorSet writeSet{
-          {},      binding_, 0,      1, vk::DescriptorType::eUniformBuffer,
+          {},      binding_, 0,      1, vk::DescriptorType::eStorageBuffer,
           nullptr, nullptr,  nullptr};
       deviceBuffers_[i].AddDescriptorSetUpdate(set_, i, writeSet,
                                                descriptorSets);
@@ -71,7 +181,8 @@ class UniformBuffer : public Uniform {
   }
 
  private:
-  T data_;
+  std::vector<T> data_;
+  uint32_t numDraws_ = 0;
   uint32_t binding_;
   uint32_t set_;
   std::vector<DeviceBuffer> deviceBuffers_;
@@ -109,6 +220,11 @@ class UniformImage : public Uniform {
     imageBuffer_->Upload(data_, queues, device);
   }
 
+  bool IsReady(DeviceApi const& device) const override {
+    return imageBuffer_ && !imageBuffer_->IsOutdated() &&
+           device.IsUploadComplete(imageBuffer_->GetUploadToken());
+  }
+
   void AddDescriptorSetUpdate(DescriptorSets& descriptorSets) const override {
     assert(imageBuffer_);
     vk::WriteDescriptorSet writeSet{
@@ -125,12 +241,19 @@ class UniformImage : public Uniform {
   std::unique_ptr<SamplerImageBuffer> imageBuffer_;
 };
 
+// Push constants are written into the command buffer when it is recorded, so
+// each update records the commands that draw it again. Data that changes every
+// frame belongs in a DrawDataBuffer instead
 class PushConstant {
  public:
   virtual ~PushConstant() = default;
-  virtual void SubscribeUpdates(std::function<void()> const& callback) = 0;
-  virtual void Upload(vk::PipelineLayout const&,
-                      vk::CommandBuffer const&) const = 0;
+  virtual void Upload(vk::PipelineLayout const&, CommandState&) const = 0;
+
+  // Buffers compare this against the version they were last recorded with
+  uint64_t GetVersion() const { return version_; }
+
+ protected:
+  uint64_t version_ = 0;
 };
 
 template <class T>
@@ -142,25 +265,18 @@ class PushConstantData : public PushConstant {
 
   void Update(T const& data) {
     data_ = data;
-    if (callback_) {
-      callback_();
-    }
-  }
-
-  void SubscribeUpdates(std::function<void()> const& callback) override {
-    callback_ = callback;
+    ++version_;
   }
 
   void Upload(vk::PipelineLayout const& layout,
-              vk::CommandBuffer const& cmdBuffer) const override {
-    cmdBuffer.pushConstants<T>(layout, stages_, offset_, {data_});
+              CommandState& state) const override {
+    state.PushConstants(layout, stages_, offset_, sizeof(T), &data_);
   }
 
  private:
   T data_;
   vk::ShaderStageFlags stages_;
   uint32_t offset_;
-  std::function<void()> callback_;
 };
 
 }  // namespace vulkan_renderer
@@ -1,6 +1,11 @@
 #ifndef VULKAN_RENDERER_VERTEX_BUFFER_HPP
 #define VULKAN_RENDERER_VERTEX_BUFFER_HPP
 
+#include <cstddef>
+#include <map>
+#include <span>
+
+#include "culling.hpp"
 #include "device_api.hpp"
 #include "device_buffer.hpp"
 #include "queues.hpp"
@@ -10,28 +15,61 @@
 
 namespace vulkan_renderer {
 
+// The state a draw uses, for ordering draws by their sort key
+struct DrawState {
+  vk::DescriptorSet DescriptorSet;
+  vk::Buffer VertexBuffer;
+  float Depth = 0.0f;
+};
+
 class Buffer {
  public:
   virtual ~Buffer() = default;
   virtual void AddUniform(std::shared_ptr<Uniform> const&) = 0;
   virtual void AddPushConstant(std::shared_ptr<PushConstant>) = 0;
+  // Index of the draw's data in a DrawDataBuffer
+  virtual void SetDrawIndex(uint32_t const) = 0;
+  // Distance from the camera, used to draw opaque geometry front to back
+  virtual void SetDepth(float const) = 0;
+  // World space bounds that indirect draws are culled with. Buffers without
+  // bounds are always drawn. They are read every frame, so moving a draw does
+  // not record the command again. See DrawCulling
+  virtual void SetBounds(DrawBounds const&) = 0;
+  virtual DrawBounds GetBounds() const = 0;
 
   virtual void Allocate(Queues const&, DeviceApi&, bool force = false) = 0;
-  virtual void UpdateDescriptorSets(Pipeline const&, DeviceApi const&) = 0;
+  // Descriptor sets are shared by every pipeline with the same layout and are
+  // only created the first time one of them draws the buffer
+  virtual void CreateDescriptorSets(Pipeline const&, DeviceApi&) = 0;
   virtual void ClearDescriptorSets() = 0;
 
   virtual bool IsOutdated() const = 0;
+  // Called on the recording thread once every chunk that draws the buffer has
+  // been recorded, as chunks are recorded in parallel. See Command::Record
+  virtual void SetRecorded() = 0;
+  // Drawing is deferred until all uploads for the buffer have completed
+  virtual bool IsReady(DeviceApi const&) const = 0;
 
   virtual void Upload(Queues const&, DeviceApi&) = 0;
   virtual void UploadUniforms(ImageIndex const, Queues const&, DeviceApi&) = 0;
-  virtual void UploadPushConstants(Pipeline const&,
-                                   vk::CommandBuffer const&) = 0;
-
-  virtual void Bind(ImageIndex const, Pipeline const&,
-                    vk::CommandBuffer const&) const = 0;
-  virtual void Draw(vk::CommandBuffer const&) const = 0;
+  virtual void UploadPushConstants(Pipeline const&, CommandState&) const = 0;
+
+  virtual DrawState GetDrawState(ImageIndex const, Pipeline const&) const = 0;
+  // Draws with instance data that share a mesh are merged into one instanced
+  // draw. Buffers without instance data are drawn on their own
+  virtual Buffer const* GetMesh() const = 0;
+  virtual std::span<std::byte const> GetInstanceData() const = 0;
+
+  virtual void Bind(ImageIndex const, Pipeline const&, CommandState&) const = 0;
+  // A single instance of the buffer. Non-indexed buffers give their vertex
+  // count as the index count, see CommandState::Draw
+  virtual vk::DrawIndexedIndirectCommand GetDrawCommand() const = 0;
+  virtual bool IsIndexed() const = 0;
 };
 
+// Vertices are sub-allocated from the device's pool for the vertex stride, so
+// meshes of the same vertex type in the same block of the pool bind the same
+// buffer. See GeometryPool
 template <class T>
 class VertexBuffer : public Buffer {
  public:
@@ -44,15 +82,36 @@ class VertexBuffer : public Buffer {
 
   void AddPushConstant(std::shared_ptr<PushConstant> pushConstant) override {
     // TODO: Check to see if set/binding already exists
-    pushConstant->SubscribeUpdates([&]() { isOutdated_ = true; });
     pushConstants_.push_back(pushConstant);
+    recordedVersions_.push_back(pushConstant->GetVersion());
+    isOutdated_ = true;
+  }
+
+  void SetDrawIndex(uint32_t const drawIndex) override {
+    drawIndex_ = drawIndex;
+    isOutdated_ = true;
   }
 
+  uint32_t GetDrawIndex() const { return drawIndex_; }
+
+  void SetDepth(float const depth) override {
+    depth_ = depth;
+    isOutdated_ = true;
+  }
+
+  void SetBounds(DrawBounds const& bounds) override { bounds_ = bounds; }
+
+  DrawBounds GetBounds() const override { return bounds_; }
+
   void Allocate(Queues const& queues, DeviceApi& device, bool force) {
-    if (force || deviceBuffer_ == nullptr) {
-      deviceBuffer_ = std::make_unique<OptimisedDeviceBuffer>(
-          data_.size() * sizeof(T), vk::BufferUsageFlagBits::eVertexBuffer,
-          device);
+    if (force || vertices_ == nullptr) {
+      // The old range is only reused once the frames drawing from it complete
+      vertices_.reset();
+      pool_ = &device.GetVertexPool(sizeof(T));
+      vertices_ = std::make_unique<Allocation>(pool_->Allocate(data_.size()));
+      poolBuffer_ = pool_->GetBuffer(*vertices_);
+      vertexOffset_ = pool_->GetOffset(*vertices_);
+      isUploaded_ = false;
       Upload(queues, device);
 
       for (auto& uniform : uniforms_) {
@@ -61,8 +120,9 @@ class VertexBuffer : public Buffer {
     }
   }
 
-  void UpdateDescriptorSets(Pipeline const& pipeline, DeviceApi const& device) {
-    descriptorSets_.erase(pipeline.GetId());
+  void CreateDescriptorSets(Pipeline const& pipeline,
+                            DeviceApi& device) override {
+    if (descriptorSets_.contains(pipeline.GetLayout())) return;
 
     auto descriptorSet = pipeline.CreateDescriptorSets(device);
     for (auto& uniform : uniforms_) {
@@ -70,17 +130,50 @@ class VertexBuffer : public Buffer {
     }
     descriptorSet.SubmitUpdates(device);
 
-    descriptorSets_.insert({pipeline.GetId(), std::move(descriptorSet)});
+    descriptorSets_.insert({pipeline.GetLayout(), std::move(descriptorSet)});
   }
 
   void ClearDescriptorSets() { descriptorSets_.clear(); }
 
-  bool IsOutdated() const override { return isOutdated_; };
+  bool IsOutdated() const override {
+    if (isOutdated_) {
+      return true;
+    }
+    for (size_t i = 0; i < pushConstants_.size(); ++i) {
+      if (pushConstants_[i]->GetVersion() != recordedVersions_[i]) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  void SetRecorded() override {
+    isOutdated_ = false;
+    for (size_t i = 0; i < pushConstants_.size(); ++i) {
+      recordedVersions_[i] = pushConstants_[i]->GetVersion();
+    }
+  }
+
+  bool IsReady(DeviceApi const& device) const override {
+    if (!vertices_ || !device.IsUploadComplete(uploadToken_)) {
+      return false;
+    }
+    for (auto const& uniform : uniforms_) {
+      if (uniform && !uniform->IsReady(device)) {
+        return false;
+      }
+    }
+    return true;
+  }
 
   void Upload(Queues const& queues, DeviceApi& device) override {
-    // TODO: maybe check to see if already created and right size
-    if (deviceBuffer_->IsOutdated()) {
-      deviceBuffer_->Upload(data_.data(), queues, device);
+    if (!isUploaded_) {
+      auto staging = WriteStagingData(data_.data(), data_.size() * sizeof(T),
+                                      queues, device);
+      uploadToken_ = CopyToBuffer(staging, poolBuffer_, queues, device,
+                                  vk::DeviceSize(vertexOffset_) * sizeof(T));
+      pool_->SetUploadToken(*vertices_, uploadToken_);
+      isUploaded_ = true;
     }
   }
 
@@ -94,40 +187,70 @@ class VertexBuffer : public Buffer {
   }
 
   void UploadPushConstants(Pipeline const& pipeline,
-                           vk::CommandBuffer const& cmdBuffer) override {
-    for (auto& pushConstant : pushConstants_) {
-      pipeline.UploadPushConstants(pushConstant, cmdBuffer);
+                           CommandState& state) const override {
+    for (auto const& pushConstant : pushConstants_) {
+      pipeline.UploadPushConstants(pushConstant, state);
     }
-    isOutdated_ = false;
   }
 
+  DrawState GetDrawState(ImageIndex const imageIndex,
+                         Pipeline const& pipeline) const override {
+    DrawState drawState{{}, poolBuffer_, depth_};
+    auto descriptorSets = descriptorSets_.find(pipeline.GetLayout());
+    if (descriptorSets != descriptorSets_.end()) {
+      drawState.DescriptorSet = descriptorSets->second.GetFirstSet(imageIndex);
+    }
+    return drawState;
+  }
+
+  Buffer const* GetMesh() const override { return this; }
+  std::span<std::byte const> GetInstanceData() const override { return {}; }
+
   void Bind(ImageIndex const imageIndex, Pipeline const& pipeline,
-            vk::CommandBuffer const& cmdBuffer) const override {
-    if (deviceBuffer_ && descriptorSets_.contains(pipeline.GetId())) {
-      deviceBuffer_->BindVertex(cmdBuffer);
+            CommandState& state) const override {
+    if (vertices_ && descriptorSets_.contains(pipeline.GetLayout())) {
+      state.BindVertexBuffer(poolBuffer_);
       pipeline.BindDescriptorSet(
-          imageIndex, descriptorSets_.at(pipeline.GetId()), cmdBuffer);
+          imageIndex, descriptorSets_.at(pipeline.GetLayout()), state);
     }
   }
 
-  virtual void Draw(vk::CommandBuffer const& cmdBuffer) const override {
-    cmdBuffer.draw(data_.size(), 1, 0, 0);
+  // The first vertex is given as firstIndex, see CommandState::Draw
+  vk::DrawIndexedIndirectCommand GetDrawCommand() const override {
+    return {static_cast<uint32_t>(data_.size()), 1, vertexOffset_, 0,
+            drawIndex_};
   }
 
+  bool IsIndexed() const override { return false; }
+
+  uint32_t GetVertexOffset() const { return vertexOffset_; }
+
  private:
   std::vector<T> const data_;
-  std::unique_ptr<OptimisedDeviceBuffer> deviceBuffer_;
+  GeometryPool* pool_ = nullptr;
+  std::unique_ptr<Allocation> vertices_;
+  vk::Buffer poolBuffer_;
+  uint32_t vertexOffset_ = 0;
+  bool isUploaded_ = false;
   std::vector<std::shared_ptr<Uniform>> uniforms_;
   std::vector<std::shared_ptr<PushConstant>> pushConstants_;
-  std::unordered_map<PipelineId, DescriptorSets> descriptorSets_;
+  // Versions of pushConstants_ as of the last recording
+  std::vector<uint64_t> recordedVersions_;
+  std::map<vk::PipelineLayout, DescriptorSets> descriptorSets_;
   bool isOutdated_ = true;
+  UploadToken uploadToken_ = 0;
+  uint32_t drawIndex_ = 0;
+  float depth_ = 0.0f;
+  DrawBounds bounds_;
 };
 
+// Indices are sub-allocated from the device's index pool, which is shared by
+// every mesh
 template <class T>
 class IndexBuffer : public Buffer {
  public:
   IndexBuffer(std::vector<T> const& data, std::vector<uint32_t> const& indices)
-      : vertexBuffer_(data), indices_(indices) {}
+      : vertexBuffer_(data), indexData_(indices) {}
 
   virtual void AddUniform(std::shared_ptr<Uniform> const& uniform) override {
     vertexBuffer_.AddUniform(uniform);
@@ -137,28 +260,58 @@ class IndexBuffer : public Buffer {
     vertexBuffer_.AddPushConstant(pushConstant);
   }
 
+  void SetDrawIndex(uint32_t const drawIndex) override {
+    vertexBuffer_.SetDrawIndex(drawIndex);
+  }
+
+  void SetDepth(float const depth) override { vertexBuffer_.SetDepth(depth); }
+
+  void SetBounds(DrawBounds const& bounds) override {
+    vertexBuffer_.SetBounds(bounds);
+  }
+
+  DrawBounds GetBounds() const override { return vertexBuffer_.GetBounds(); }
+
   void Allocate(Queues const& queues, DeviceApi& device, bool force) {
     vertexBuffer_.Allocate(queues, device, force);
-    if (force || deviceBuffer_ == nullptr) {
-      deviceBuffer_ = std::make_unique<OptimisedDeviceBuffer>(
-          indices_.size() * sizeof(uint32_t),
-          vk::BufferUsageFlagBits::eIndexBuffer, device);
+    if (force || indices_ == nullptr) {
+      indices_.reset();
+      pool_ = &device.GetIndexPool();
+      indices_ =
+          std::make_unique<Allocation>(pool_->Allocate(indexData_.size()));
+      poolBuffer_ = pool_->GetBuffer(*indices_);
+      firstIndex_ = pool_->GetOffset(*indices_);
+      isUploaded_ = false;
       Upload(queues, device);
     }
   }
 
-  void UpdateDescriptorSets(Pipeline const& pipeline, DeviceApi const& device) {
-    vertexBuffer_.UpdateDescriptorSets(pipeline, device);
+  void CreateDescriptorSets(Pipeline const& pipeline,
+                            DeviceApi& device) override {
+    vertexBuffer_.CreateDescriptorSets(pipeline, device);
   }
 
   void ClearDescriptorSets() { vertexBuffer_.ClearDescriptorSets(); }
 
   bool IsOutdated() const override { return vertexBuffer_.IsOutdated(); };
+  void SetRecorded() override { vertexBuffer_.SetRecorded(); }
+
+  bool IsReady(DeviceApi const& device) const override {
+    return indices_ && device.IsUploadComplete(uploadToken_) &&
+           vertexBuffer_.IsReady(device);
+  }
 
   virtual void Upload(Queues const& queues, DeviceApi& device) override {
     vertexBuffer_.Upload(queues, device);
-    if (deviceBuffer_->IsOutdated()) {
-      deviceBuffer_->Upload(indices_.data(), queues, device);
+    if (!isUploaded_) {
+      auto staging = WriteStagingData(indexData_.data(),
+                                      indexData_.size() * sizeof(uint32_t),
+                                      queues, device);
+      uploadToken_ =
+          CopyToBuffer(staging, poolBuffer_, queues, device,
+                       vk::DeviceSize(firstIndex_) * sizeof(uint32_t));
+      pool_->SetUploadToken(*indices_, uploadToken_);
+      isUploaded_ = true;
     }
   }
 
@@ -168,26 +321,152 @@ class IndexBuffer : public Buffer {
   }
 
   void UploadPushConstants(Pipeline const& pipeline,
-                           vk::CommandBuffer const& cmdBuffer) override {
-    vertexBuffer_.UploadPushConstants(pipeline, cmdBuffer);
+                           CommandState& state) const override {
+    vertexBuffer_.UploadPushConstants(pipeline, state);
+  }
+
+  DrawState GetDrawState(ImageIndex const imageIndex,
+                         Pipeline const& pipeline) const override {
+    return vertexBuffer_.GetDrawState(imageIndex, pipeline);
   }
 
+  Buffer const* GetMesh() const override { return this; }
+  std::span<std::byte const> GetInstanceData() const override { return {}; }
+
   virtual void Bind(ImageIndex const imageIndex, Pipeline const& pipeline,
-                    vk::CommandBuffer const& cmdBuffer) const override {
-    vertexBuffer_.Bind(imageIndex, pipeline, cmdBuffer);
-    if (deviceBuffer_) {
-      deviceBuffer_->BindIndex(cmdBuffer);
+                    CommandState& state) const override {
+    vertexBuffer_.Bind(imageIndex, pipeline, state);
+    if (indices_) {
+      state.BindIndexBuffer(poolBuffer_, 0, vk::IndexType::eUint32);
     }
   }
 
-  virtual void Draw(vk::CommandBuffer const& cmdBuffer) const override {
-    cmdBuffer.drawIndexed(indices_.size(), 1, 0, 0, 0);
+  vk::DrawIndexedIndirectCommand GetDrawCommand() const override {
+    return {static_cast<uint32_t>(indexData_.size()), 1, firstIndex_,
+            static_cast<int32_t>(vertexBuffer_.GetVertexOffset()),
+            vertexBuffer_.GetDrawIndex()};
   }
 
+  bool IsIndexed() const override { return true; }
+
  private:
   VertexBuffer<T> vertexBuffer_;
-  std::vector<uint32_t> indices_;
-  std::unique_ptr<OptimisedDeviceBuffer> deviceBuffer_;
+  std::vector<uint32_t> indexData_;
+  GeometryPool* pool_ = nullptr;
+  std::unique_ptr<Allocation> indices_;
+  vk::Buffer poolBuffer_;
+  uint32_t firstIndex_ = 0;
+  bool isUploaded_ = false;
+  UploadToken uploadToken_ = 0;
+};
+
+// A draw of a shared mesh with its own instance data. Commands merge the
+// instances of each mesh into a single instanced draw, with the instance data
+// in a vertex buffer at defaults::command::InstanceBinding. The pipeline needs
+// Instance added as an instance rate vertex layout after the mesh's.
+//
+// Uniforms and push constants are added to the mesh and are shared by all of
+// its instances. Every instance of a mesh must use the same Instance type
+template <class Instance>
+class MeshInstance : public Buffer {
+ public:
+  MeshInstance(std::shared_ptr<Buffer> const& mesh, Instance const& data)
+      : mesh_(mesh), data_(data) {}
+
+  void Update(Instance const& data) {
+    data_ = data;
+    isOutdated_ = true;
+  }
+
+  void AddUniform(std::shared_ptr<Uniform> const& uniform) override {
+    mesh_->AddUniform(uniform);
+  }
+
+  void AddPushConstant(std::shared_ptr<PushConstant> pushConstant) override {
+    mesh_->AddPushConstant(pushConstant);
+  }
+
+  // Instances are identified by their instance index rather than a draw index
+  void SetDrawIndex(uint32_t const) override {}
+
+  void SetDepth(float const depth) override {
+    depth_ = depth;
+    isOutdated_ = true;
+  }
+
+  // Instanced draws cover every instance of the mesh so are never culled
+  void SetBounds(DrawBounds const&) override {}
+  DrawBounds GetBounds() const override { return {}; }
+
+  void Allocate(Queues const& queues, DeviceApi& device, bool force) override {
+    mesh_->Allocate(queues, device, force);
+  }
+
+  void CreateDescriptorSets(Pipeline const& pipeline,
+                            DeviceApi& device) override {
+    mesh_->CreateDescriptorSets(pipeline, device);
+  }
+
+  void ClearDescriptorSets() override { mesh_->ClearDescriptorSets(); }
+
+  bool IsOutdated() const override {
+    return isOutdated_ || mesh_->IsOutdated();
+  }
+
+  void SetRecorded() override {
+    isOutdated_ = false;
+    mesh_->SetRecorded();
+  }
+
+  bool IsReady(DeviceApi const& device) const override {
+    return mesh_->IsReady(device);
+  }
+
+  void Upload(Queues const& queues, DeviceApi& device) override {
+    mesh_->Upload(queues, device);
+  }
+
+  void UploadUniforms(ImageIndex const imageIndex, Queues const& queues,
+                      DeviceApi& device) override {
+    mesh_->UploadUniforms(imageIndex, queues, device);
+  }
+
+  void UploadPushConstants(Pipeline const& pipeline,
+                           CommandState& state) const override {
+    mesh_->UploadPushConstants(pipeline, state);
+  }
+
+  DrawState GetDrawState(ImageIndex const imageIndex,
+                         Pipeline const& pipeline) const override {
+    auto drawState = mesh_->GetDrawState(imageIndex, pipeline);
+    drawState.Depth = depth_;
+    return drawState;
+  }
+
+  Buffer const* GetMesh() const override { return mesh_->GetMesh(); }
+
+  std::span<std::byte const> GetInstanceData() const override {
+    return std::as_bytes(std::span(&data_, 1));
+  }
+
+  void Bind(ImageIndex const imageIndex, Pipeline const& pipeline,
+            CommandState& state) const override {
+    mesh_->Bind(imageIndex, pipeline, state);
+  }
+
+  vk::DrawIndexedIndirectCommand GetDrawCommand() const override {
+    auto command = mesh_->GetDrawCommand();
+    command.firstInstance = 0;
+    return command;
+  }
+
+  bool IsIndexed() const override { return mesh_->IsIndexed(); }
+
+ private:
+  std::shared_ptr<Buffer> mesh_;
+  Instance data_;
+  float depth_ = 0.0f;
+  bool isOutdated_ = true;
 };
 
 }  // namespace vulkan_renderer
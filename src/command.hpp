@@ -1,17 +1,27 @@
 #ifndef VULKAN_RENDERER_COMMAND_HPP
 #define VULKAN_RENDERER_COMMAND_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
 #include <memory>
+#include <span>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "buffers/image_buffer.hpp"
 #include "buffers/vertex_buffer.hpp"
+#include "command_state.hpp"
+#include "culling.hpp"
+#include "culling_pass.hpp"
 #include "device_api.hpp"
+#include "draw_list.hpp"
 #include "pipeline.hpp"
 #include "queues.hpp"
 #include "render_pass.hpp"
+#include "thread_pool.hpp"
 #include "vulkan/vulkan.hpp"
 
 namespace vulkan_renderer {
@@ -27,6 +37,18 @@ class Command {
     cmdBuffers_ = device.AllocateCommandBuffers(
         vk::CommandBufferLevel::ePrimary, device.GetNumSwapchainImages(), pool);
     isOutdated_.resize(cmdBuffers_.size(), true);
+    numRecordedReady_.assign(cmdBuffers_.size(), 0);
+    secondaries_.clear();
+    secondaries_.resize(cmdBuffers_.size());
+    instanceBuffers_.clear();
+    instanceBuffers_.resize(cmdBuffers_.size());
+    indirectBuffers_.clear();
+    indirectBuffers_.resize(cmdBuffers_.size());
+
+    // The number of swapchain images may have changed
+    cullingPass_ = culling_
+                       ? std::make_unique<CullingPass>(culling_, pool, device)
+                       : nullptr;
 
     // Hopefully should only ever allocate once
     for (auto& vertBuffer : vertBuffers_) {
@@ -35,15 +57,35 @@ class Command {
     }
   }
 
-  void UpdateDescriptorSets(Pipeline const& pipeline, DeviceApi const& device) {
-    for (auto& vertBuffer : vertBuffers_) {
-      vertBuffer->UpdateDescriptorSets(pipeline, device);
-    }
+  bool IsInitialised() const { return !cmdBuffers_.empty(); }
+
+  // Draws are sorted by their key by default. Turning it off records them in
+  // the order they were added, e.g. to compare the state changes recorded
+  void SetDrawSorting(bool const sortDraws) {
+    sortDraws_ = sortDraws;
+    SetOutdated();
   }
 
-  bool IsInitialised() const { return !cmdBuffers_.empty(); }
+  // Draws are written to an indirect buffer and every run of draws with the
+  // same state is recorded with one indirect call. See CommandState
+  void SetIndirectDraws(bool const indirectDraws) {
+    indirectDraws_ = indirectDraws;
+    SetOutdated();
+  }
+
+  // Indirect draws are culled on the device before the render pass. Only
+  // draws with bounds are culled and instanced draws never are. See
+  // DrawCulling and CullingPass
+  void SetCulling(std::shared_ptr<DrawCulling> const& culling) {
+    culling_ = culling;
+    SetOutdated();
+  }
+
+  void SetOutdated() {
+    std::fill(isOutdated_.begin(), isOutdated_.end(), true);
+  }
 
-  bool IsOutdated(ImageIndex const imageIndex) {
+  bool IsOutdated(ImageIndex const imageIndex, DeviceApi const& device) {
     assert(imageIndex < isOutdated_.size());
     // TODO: Check any reasons to rerecord
     for (auto const& vertBuffer : vertBuffers_) {
@@ -51,61 +93,411 @@ class Command {
         std::fill(isOutdated_.begin(), isOutdated_.end(), true);
       }
     }
+
+    if (cullingPass_ && cullingPass_->IsOutdated(imageIndex)) {
+      isOutdated_[imageIndex] = true;
+    }
+
+    // Buffers that were still uploading when last recorded need adding
+    if (numRecordedReady_[imageIndex] < vertBuffers_.size() &&
+        GetNumReady(device) != numRecordedReady_[imageIndex]) {
+      isOutdated_[imageIndex] = true;
+    }
     return isOutdated_[imageIndex];
   }
 
+  // Records what runs before the image's commands each frame, which is the
+  // culling depth pyramid build. Called after Record and before Draw
+  void RecordFrame(ImageIndex const imageIndex, RenderPass const& renderPass,
+                   DeviceApi& device) {
+    if (cullingPass_) {
+      cullingPass_->RecordPyramid(imageIndex, renderPass.GetDepthAttachment(),
+                                  device);
+    }
+  }
+
   void UploadUniforms(ImageIndex const imageIndex, Queues const& queues,
                       DeviceApi& device) {
     for (auto& vertBuffer : vertBuffers_) {
       vertBuffer->UploadUniforms(imageIndex, queues, device);
     }
+    if (cullingPass_) {
+      cullingPass_->Upload(imageIndex, device);
+    }
   }
 
-  void Record(ImageIndex const imageIndex, RenderPass const& renderPass,
-              PipelineId const pipeline, vk::Extent2D const& extent) {
+  // Large commands are split into chunks that are recorded in parallel into
+  // secondary command buffers and executed from the primary. Returns the
+  // state changes that were recorded and skipped
+  RecordStatistics Record(ImageIndex const imageIndex,
+                          RenderPass const& renderPass,
+                          PipelineId const pipeline, vk::Extent2D const& extent,
+                          DeviceApi& device, ThreadPool& threadPool) {
     assert(imageIndex < cmdBuffers_.size());
 
+    // Nothing is drawn until the pipeline has finished compiling. Descriptor
+    // sets are created here as the draws may be recorded on other threads
+    std::vector<Buffer*> readyBuffers;
+    if (renderPass.HasPipeline(pipeline)) {
+      for (auto& vertBuffer : vertBuffers_) {
+        if (vertBuffer->IsReady(device)) {
+          vertBuffer->CreateDescriptorSets(renderPass.GetPipeline(pipeline),
+                                           device);
+          readyBuffers.push_back(vertBuffer.get());
+        }
+      }
+    }
+
+    // Buffers are only ready once the pipeline is
+    if (sortDraws_ && !readyBuffers.empty()) {
+      SortDraws(imageIndex, renderPass.GetPipeline(pipeline), pipeline,
+                readyBuffers);
+    }
+    auto batches = BatchDraws(imageIndex, readyBuffers, device);
+
+    uint32_t const numChunks = std::min<uint32_t>(
+        threadPool.GetNumThreads() + 1,
+        (batches.size() + defaults::command::MinDrawsPerChunk - 1) /
+            defaults::command::MinDrawsPerChunk);
+
     auto& cmdBuffer = cmdBuffers_[imageIndex];
     cmdBuffer.reset();
     cmdBuffer.begin(vk::CommandBufferBeginInfo{});
 
-    renderPass.Bind(imageIndex, extent, pipeline, cmdBuffer);
-
-    // TODO: this should probably be set per vertBuffer
-    cmdBuffer.setViewport(
-        0, vk::Viewport(0.0f, 0.0f, static_cast<float>(extent.width),
-                        static_cast<float>(extent.height), 0.0f, 1.0f));
-    cmdBuffer.setScissor(0, vk::Rect2D(vk::Offset2D(0, 0), extent));
+    // Culling is dispatched before the render pass begins
+    IndirectCulling culling;
+    if (indirectDraws_ && !batches.empty()) {
+      PrepareIndirectBuffer(imageIndex, batches.size(), device);
+      if (cullingPass_) {
+        // Instanced draws cover every instance of the mesh so are never culled
+        std::vector<Buffer const*> draws;
+        for (auto const& batch : batches) {
+          draws.push_back(batch.Instanced ? nullptr : batch.Buffers.front());
+        }
+        culling = cullingPass_->Record(
+            imageIndex, draws, *indirectBuffers_[imageIndex],
+            renderPass.GetDepthAttachment(), cmdBuffer, device);
+      }
+    } else if (cullingPass_) {
+      cullingPass_->Skip(imageIndex, device);
+    }
 
-    for (auto& vertBuffer : vertBuffers_) {
-      vertBuffer->UploadPushConstants(renderPass.GetPipeline(pipeline),
-                                      cmdBuffer);
-      vertBuffer->Bind(imageIndex, renderPass.GetPipeline(pipeline), cmdBuffer);
-      vertBuffer->Draw(cmdBuffer);
+    RecordStatistics statistics;
+    if (numChunks <= 1) {
+      CommandState state(cmdBuffer);
+      SetIndirect(imageIndex, 0, batches.size(), culling, device, state);
+      renderPass.Bind(imageIndex, extent, pipeline, state);
+      RecordDraws(imageIndex, renderPass, pipeline, extent, batches, state);
+      statistics = state.GetStatistics();
+    } else {
+      renderPass.Begin(imageIndex, extent, cmdBuffer,
+                       vk::SubpassContents::eSecondaryCommandBuffers);
+      statistics =
+          RecordSecondaries(imageIndex, renderPass, pipeline, extent, batches,
+                            numChunks, culling, device, threadPool);
+      std::vector<vk::CommandBuffer> secondaryBuffers;
+      for (uint32_t i = 0; i < numChunks; ++i) {
+        secondaryBuffers.push_back(secondaries_[imageIndex][i].Buffer);
+      }
+      cmdBuffer.executeCommands(secondaryBuffers);
     }
 
     cmdBuffer.endRenderPass();
     cmdBuffer.end();
+    if (indirectDraws_ && !batches.empty()) {
+      indirectBuffers_[imageIndex]->Flush(device);
+    }
+    if (culling.Output) {
+      cullingPass_->Flush(imageIndex, device);
+    }
 
+    // Workers only read the buffers, so they are marked as recorded once
+    // every chunk has finished
+    for (auto buffer : readyBuffers) {
+      buffer->SetRecorded();
+    }
     isOutdated_[imageIndex] = false;
+    // A compiling pipeline re-records through SetOutdated instead of when
+    // buffers become ready
+    numRecordedReady_[imageIndex] = renderPass.HasPipeline(pipeline)
+                                        ? readyBuffers.size()
+                                        : GetNumReady(device);
+    return statistics;
   }
 
   void Draw(uint32_t const imageIndex, Semaphores const& renderSemaphores,
             Queues const& queues) const {
+    // The depth pyramid is built before the draws are culled
+    std::vector<vk::CommandBuffer> cmdBuffers;
+    if (cullingPass_ && cullingPass_->GetPyramidCommands(imageIndex)) {
+      cmdBuffers.push_back(cullingPass_->GetPyramidCommands(imageIndex));
+    }
+    cmdBuffers.push_back(cmdBuffers_[imageIndex]);
+
     vk::PipelineStageFlags flags{
         vk::PipelineStageFlagBits::eColorAttachmentOutput};
     vk::SubmitInfo submitInfo{renderSemaphores.WaitSemaphore.get(), flags,
-                              cmdBuffers_[imageIndex],
+                              cmdBuffers,
                               renderSemaphores.CompleteSemaphore.get()};
     queues.SubmitToGraphics(submitInfo, renderSemaphores.CompleteFence.get());
   }
 
   void Clear() { cmdBuffers_.clear(); }
 
+ protected:
+  // Buffers drawn together in one draw call. Instanced batches hold every
+  // instance of a mesh, with their instance data at InstanceOffset in the
+  // image's instance buffer
+  struct DrawBatch {
+    std::vector<Buffer*> Buffers;
+    bool Instanced = false;
+    vk::DeviceSize InstanceOffset = 0;
+  };
+
+  void RecordDraws(ImageIndex const imageIndex, RenderPass const& renderPass,
+                   PipelineId const pipeline, vk::Extent2D const& extent,
+                   std::span<DrawBatch const> const batches,
+                   CommandState& state) const {
+    // TODO: this should probably be set per vertBuffer
+    state.SetViewport(vk::Viewport(0.0f, 0.0f, static_cast<float>(extent.width),
+                                   static_cast<float>(extent.height), 0.0f,
+                                   1.0f));
+    state.SetScissor(vk::Rect2D(vk::Offset2D(0, 0), extent));
+
+    for (auto const& batch : batches) {
+      // Instances push the mesh's constants so only the first is recorded
+      for (auto vertBuffer : batch.Buffers) {
+        vertBuffer->UploadPushConstants(renderPass.GetPipeline(pipeline),
+                                        state);
+      }
+
+      auto vertBuffer = batch.Buffers.front();
+      vertBuffer->Bind(imageIndex, renderPass.GetPipeline(pipeline), state);
+      auto command = vertBuffer->GetDrawCommand();
+      if (batch.Instanced) {
+        state.BindVertexBuffer(instanceBuffers_[imageIndex]->GetBuffer(),
+                               batch.InstanceOffset,
+                               defaults::command::InstanceBinding);
+        command.instanceCount = batch.Buffers.size();
+      }
+      state.Draw(command, vertBuffer->IsIndexed());
+    }
+    state.FlushDraws();
+  }
+
+  // Every batch gets a command in the image's indirect buffer, in the order
+  // they are recorded. The culling pass reads the commands as storage
+  void PrepareIndirectBuffer(ImageIndex const imageIndex,
+                             uint32_t const numDraws, DeviceApi& device) {
+    auto const size = numDraws * sizeof(vk::DrawIndexedIndirectCommand);
+    auto& indirectBuffer = indirectBuffers_[imageIndex];
+    if (!indirectBuffer || indirectBuffer->GetSize() < size) {
+      indirectBuffer = std::make_unique<DeviceBuffer>(
+          std::bit_ceil(size),
+          vk::BufferUsageFlagBits::eIndirectBuffer |
+              vk::BufferUsageFlagBits::eStorageBuffer,
+          device);
+    }
+  }
+
+  // Draws are only written to the indirect buffer when indirect draws are on
+  void SetIndirect(ImageIndex const imageIndex, uint32_t const firstDraw,
+                   uint32_t const numDraws, IndirectCulling const& culling,
+                   DeviceApi const& device, CommandState& state) const {
+    if (!indirectDraws_ || numDraws == 0) {
+      state.SetIndirect(device.GetIndirectDrawSupport());
+      return;
+    }
+    auto& indirectBuffer = indirectBuffers_[imageIndex];
+    IndirectCulling chunkCulling;
+    if (culling.Output) {
+      chunkCulling = {culling.Objects.subspan(firstDraw, numDraws),
+                      culling.Output, culling.Counts};
+    }
+    state.SetIndirect(
+        device.GetIndirectDrawSupport(), indirectBuffer->GetBuffer(),
+        indirectBuffer->GetData<vk::DrawIndexedIndirectCommand>().subspan(
+            firstDraw, numDraws),
+        firstDraw, chunkCulling);
+  }
+
+  // Instances of the same mesh are merged into the batch of the first one.
+  // Their data is written to the image's instance buffer, which is not in
+  // use as the image is no longer in flight
+  std::vector<DrawBatch> BatchDraws(ImageIndex const imageIndex,
+                                    std::vector<Buffer*> const& buffers,
+                                    DeviceApi& device) {
+    std::vector<DrawBatch> batches;
+    std::unordered_map<Buffer const*, size_t> meshBatches;
+    for (auto buffer : buffers) {
+      if (buffer->GetInstanceData().empty()) {
+        batches.push_back({{buffer}});
+        continue;
+      }
+      auto [meshBatch, isNew] =
+          meshBatches.try_emplace(buffer->GetMesh(), batches.size());
+      if (isNew) {
+        batches.push_back({{}, true});
+      }
+      batches[meshBatch->second].Buffers.push_back(buffer);
+    }
+    if (meshBatches.empty()) return batches;
+
+    vk::DeviceSize instanceSize = 0;
+    for (auto& batch : batches) {
+      if (!batch.Instanced) continue;
+      batch.InstanceOffset =
+          AlignUp(instanceSize, defaults::command::InstanceAlignment);
+      instanceSize = batch.InstanceOffset +
+                     batch.Buffers.size() *
+                         batch.Buffers.front()->GetInstanceData().size();
+    }
+
+    auto& instanceBuffer = instanceBuffers_[imageIndex];
+    if (!instanceBuffer || instanceBuffer->GetSize() < instanceSize) {
+      instanceBuffer = std::make_unique<DeviceBuffer>(
+          std::bit_ceil(instanceSize), vk::BufferUsageFlagBits::eVertexBuffer,
+          device);
+    }
+
+    auto data = instanceBuffer->GetData<std::byte>();
+    for (auto const& batch : batches) {
+      if (!batch.Instanced) continue;
+      auto offset = batch.InstanceOffset;
+      for (auto buffer : batch.Buffers) {
+        auto instance = buffer->GetInstanceData();
+        std::memcpy(data.data() + offset, instance.data(), instance.size());
+        offset += instance.size();
+      }
+    }
+    instanceBuffer->Flush(device);
+    return batches;
+  }
+
+  // The calling thread records chunks as well so that recording never waits
+  // behind other work queued on the pool, such as pipeline compiles. Tasks
+  // that start after every chunk has been taken do nothing
+  RecordStatistics RecordSecondaries(ImageIndex const imageIndex,
+                                     RenderPass const& renderPass,
+                                     PipelineId const pipeline,
+                                     vk::Extent2D const& extent,
+                                     std::vector<DrawBatch> const& batches,
+                                     uint32_t const numChunks,
+                                     IndirectCulling const& culling,
+                                     DeviceApi const& device,
+                                     ThreadPool& threadPool) {
+    // Each chunk records into its own pool so they can be reset in parallel
+    auto& secondaries = secondaries_[imageIndex];
+    while (secondaries.size() < numChunks) {
+      auto pool = device.CreateCommandPool({}, device.GetGraphicsFamily());
+      auto buffer = device.AllocateCommandBuffers(
+          vk::CommandBufferLevel::eSecondary, 1, pool.get());
+      secondaries.push_back({std::move(pool), buffer.front()});
+    }
+
+    struct ChunkCounter {
+      std::atomic<uint32_t> Next = 0;
+      std::atomic<uint32_t> Done = 0;
+    };
+    auto counter = std::make_shared<ChunkCounter>();
+    // Each chunk only writes its own statistics
+    std::vector<RecordStatistics> chunkStatistics(numChunks);
+    auto inheritance = renderPass.GetInheritanceInfo(imageIndex);
+
+    auto recordChunks = [=, this, &renderPass, &batches, &culling, &device,
+                         &inheritance, &chunkStatistics]() {
+      for (auto chunk = counter->Next++; chunk < numChunks;
+           chunk = counter->Next++) {
+        auto& secondary = secondaries_[imageIndex][chunk];
+        device.ResetCommandPool(secondary.Pool);
+        secondary.Buffer.begin(
+            {vk::CommandBufferUsageFlagBits::eRenderPassContinue,
+             &inheritance});
+        auto chunkSize = (batches.size() + numChunks - 1) / numChunks;
+        auto begin = std::min(chunk * chunkSize, batches.size());
+        auto end = std::min(begin + chunkSize, batches.size());
+
+        CommandState state(secondary.Buffer);
+        SetIndirect(imageIndex, begin, end - begin, culling, device, state);
+        renderPass.GetPipeline(pipeline).Bind(state);
+        RecordDraws(imageIndex, renderPass, pipeline, extent,
+                    std::span(batches).subspan(begin, end - begin), state);
+        secondary.Buffer.end();
+        chunkStatistics[chunk] = state.GetStatistics();
+
+        ++counter->Done;
+        counter->Done.notify_all();
+      }
+    };
+
+    for (uint32_t i = 1; i < numChunks; ++i) {
+      threadPool.Submit(recordChunks);
+    }
+    recordChunks();
+
+    for (auto done = counter->Done.load(); done < numChunks;
+         done = counter->Done.load()) {
+      counter->Done.wait(done);
+    }
+
+    RecordStatistics statistics;
+    for (auto const& chunk : chunkStatistics) {
+      statistics += chunk;
+    }
+    return statistics;
+  }
+
+  // Chunks are contiguous so sorted draws stay grouped within each secondary
+  void SortDraws(ImageIndex const imageIndex, Pipeline const& pipeline,
+                 PipelineId const pipelineId,
+                 std::vector<Buffer*>& buffers) const {
+    KeyIds<VkDescriptorSet> descriptorSetIds;
+    KeyIds<VkBuffer> vertexBufferIds;
+    DrawList<Buffer*> drawList;
+    for (auto buffer : buffers) {
+      auto drawState = buffer->GetDrawState(imageIndex, pipeline);
+      // Commands are recorded within a single render pass
+      drawList.Add(
+          draw_key::Create(
+              0, pipelineId,
+              descriptorSetIds.Get(
+                  static_cast<VkDescriptorSet>(drawState.DescriptorSet)),
+              vertexBufferIds.Get(
+                  static_cast<VkBuffer>(drawState.VertexBuffer)),
+              drawState.Depth),
+          buffer);
+    }
+    drawList.Sort();
+    buffers = drawList.GetDraws();
+  }
+
+  uint32_t GetNumReady(DeviceApi const& device) const {
+    return std::count_if(vertBuffers_.begin(), vertBuffers_.end(),
+                         [&](std::shared_ptr<Buffer> const& vertBuffer) {
+                           return vertBuffer->IsReady(device);
+                         });
+  }
+
  private:
+  struct SecondaryBuffer {
+    vk::UniqueCommandPool Pool;
+    vk::CommandBuffer Buffer;
+  };
+
   std::vector<vk::CommandBuffer> cmdBuffers_;
+  // Per swapchain image and chunk
+  std::vector<std::vector<SecondaryBuffer>> secondaries_;
+  // Per swapchain image, created when instances are first drawn
+  std::vector<std::unique_ptr<DeviceBuffer>> instanceBuffers_;
+  std::vector<std::unique_ptr<DeviceBuffer>> indirectBuffers_;
+  std::shared_ptr<DrawCulling> culling_;
+  // Created from culling_ when the command is allocated
+  std::unique_ptr<CullingPass> cullingPass_;
   std::vector<bool> isOutdated_;
+  std::vector<uint32_t> numRecordedReady_;
   std::vector<std::shared_ptr<Buffer>> vertBuffers_;
+  bool sortDraws_ = true;
+  bool indirectDraws_ = defaults::command::IndirectDraws;
 };
 
 }  // namespace vulkan_renderer
@@ -0,0 +1,433 @@
+#ifndef VULKAN_RENDERER_COMMAND_STATE_HPP
+#define VULKAN_RENDERER_COMMAND_STATE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "culling.hpp"
+#include "vulkan/vulkan.hpp"
+
+namespace vulkan_renderer {
+
+struct StateCounts {
+  uint32_t Pipelines = 0;
+  uint32_t VertexBuffers = 0;
+  uint32_t IndexBuffers = 0;
+  // Counted per set rather than per call
+  uint32_t DescriptorSets = 0;
+  uint32_t PushConstants = 0;
+  // Viewports and scissors
+  uint32_t DynamicStates = 0;
+
+  uint32_t Total() const {
+    return Pipelines + VertexBuffers + IndexBuffers + DescriptorSets +
+           PushConstants + DynamicStates;
+  }
+
+  StateCounts& operator+=(StateCounts const& other) {
+    Pipelines += other.Pipelines;
+    VertexBuffers += other.VertexBuffers;
+    IndexBuffers += other.IndexBuffers;
+    DescriptorSets += other.DescriptorSets;
+    PushConstants += other.PushConstants;
+    DynamicStates += other.DynamicStates;
+    return *this;
+  }
+};
+
+struct RecordStatistics {
+  // State changes that were recorded into command buffers
+  StateCounts Recorded;
+  // State changes that were skipped as the state was already set
+  StateCounts Skipped;
+  uint32_t Draws = 0;
+  // Direct and indirect draw calls that the draws were recorded with
+  uint32_t DrawCalls = 0;
+
+  RecordStatistics& operator+=(RecordStatistics const& other) {
+    Recorded += other.Recorded;
+    Skipped += other.Skipped;
+    Draws += other.Draws;
+    DrawCalls += other.DrawCalls;
+    return *this;
+  }
+};
+
+// What the device supports for indirect draws. Without multi draw indirect
+// every indirect draw is a separate call, and without first instance draws
+// with a first instance are recorded directly
+struct IndirectDrawSupport {
+  bool MultiDraw = false;
+  bool FirstInstance = false;
+  // VK_KHR_draw_indirect_count
+  bool DrawCount = false;
+  uint32_t MaxDrawCount = 1;
+};
+
+// Where the culling pass reads the runs of the draws in the indirect slots,
+// one object per slot, and writes the draws that are visible. See CullingPass
+struct IndirectCulling {
+  std::span<CullObject> Objects;
+  vk::Buffer Output;
+  vk::Buffer Counts;
+};
+
+// A descriptor set and the dynamic offsets of its dynamic descriptors in
+// binding order
+struct DescriptorSetBinding {
+  uint32_t Index;
+  vk::DescriptorSet Set;
+  std::span<uint32_t const> DynamicOffsets;
+};
+
+// Tracks the state bound in a command buffer while it is being recorded and
+// skips binds and pushes that would not change it. The command buffer must
+// only be recorded through the tracker from when it is begun.
+//
+// Given an indirect buffer, draws are written to it and held until the state
+// next changes, so every run of draws with the same state is recorded with one
+// indirect call. FlushDraws must be called before the command buffer ends.
+// With culling each run is drawn from the culling pass's output instead,
+// with the number of draws it found visible
+class CommandState {
+ public:
+  explicit CommandState(vk::CommandBuffer const& cmdBuffer)
+      : cmdBuffer_(cmdBuffer) {}
+
+  vk::CommandBuffer const& GetCommandBuffer() const { return cmdBuffer_; }
+
+  RecordStatistics const& GetStatistics() const { return statistics_; }
+
+  // The draws are written to consecutive commands from the start of slots,
+  // which begins at firstSlot in the buffer. Culling objects start at the
+  // same slot
+  void SetIndirect(IndirectDrawSupport const& support,
+                   vk::Buffer const& buffer = {},
+                   std::span<vk::DrawIndexedIndirectCommand> const slots = {},
+                   uint32_t const firstSlot = 0,
+                   IndirectCulling const& culling = {}) {
+    FlushDraws();
+    indirectSupport_ = support;
+    indirectBuffer_ = buffer;
+    indirectSlots_ = slots;
+    firstSlot_ = firstSlot;
+    nextSlot_ = 0;
+    culling_ = culling;
+    assert(!culling_.Output || culling_.Objects.size() >= slots.size());
+  }
+
+  // Non-indexed draws use indexCount as the vertex count and firstIndex as
+  // the first vertex. Only draws written to the indirect buffer are culled
+  void Draw(vk::DrawIndexedIndirectCommand const& command, bool const indexed) {
+    ++statistics_.Draws;
+    if (!indirectBuffer_ || nextSlot_ == indirectSlots_.size() ||
+        (command.firstInstance != 0 && !indirectSupport_.FirstInstance)) {
+      FlushDraws();
+      DrawDirect(command, indexed);
+      return;
+    }
+
+    if (pending_.Count && (pending_.Indexed != indexed ||
+                           pending_.Count == indirectSupport_.MaxDrawCount)) {
+      FlushDraws();
+    }
+    if (indexed) {
+      indirectSlots_[nextSlot_] = command;
+    } else {
+      vk::DrawIndirectCommand const drawCommand{
+          command.indexCount, command.instanceCount, command.firstIndex,
+          command.firstInstance};
+      std::memcpy(&indirectSlots_[nextSlot_], &drawCommand,
+                  sizeof(drawCommand));
+    }
+    if (!pending_.Count) {
+      pending_ = {firstSlot_ + nextSlot_, 0, indexed};
+    }
+    ++pending_.Count;
+    ++nextSlot_;
+  }
+
+  // Draws a number of commands that is read from countBuffer, up to maxDraws.
+  // Without VK_KHR_draw_indirect_count all maxDraws are drawn, so commands
+  // past the count must have an instance count of 0
+  void DrawIndirectCount(vk::Buffer const& buffer, vk::DeviceSize const offset,
+                         vk::Buffer const& countBuffer,
+                         vk::DeviceSize const countOffset,
+                         uint32_t const maxDraws, bool const indexed) {
+    FlushDraws();
+    uint32_t const stride = sizeof(vk::DrawIndexedIndirectCommand);
+    if (indirectSupport_.DrawCount) {
+      if (indexed) {
+        cmdBuffer_.drawIndexedIndirectCountKHR(buffer, offset, countBuffer,
+                                               countOffset, maxDraws, stride);
+      } else {
+        cmdBuffer_.drawIndirectCountKHR(buffer, offset, countBuffer,
+                                        countOffset, maxDraws, stride);
+      }
+      ++statistics_.DrawCalls;
+    } else {
+      DrawIndirect(buffer, offset, maxDraws, indexed);
+    }
+  }
+
+  // Records the draws that are waiting for the state to change
+  void FlushDraws() {
+    if (!pending_.Count) return;
+    auto const run = std::exchange(pending_, {});
+    auto const offset = run.First * sizeof(vk::DrawIndexedIndirectCommand);
+    if (!culling_.Output) {
+      DrawIndirect(indirectBuffer_, offset, run.Count, run.Indexed);
+      return;
+    }
+
+    // The visible draws of the run are written from its first slot and
+    // counted at its first count
+    for (auto& object :
+         culling_.Objects.subspan(run.First - firstSlot_, run.Count)) {
+      object.Run = run.First;
+    }
+    DrawIndirectCount(culling_.Output, offset, culling_.Counts,
+                      run.First * sizeof(uint32_t), run.Count, run.Indexed);
+  }
+
+  void BindPipeline(vk::Pipeline const& pipeline) {
+    if (pipeline == pipeline_) {
+      ++statistics_.Skipped.Pipelines;
+      return;
+    }
+    FlushDraws();
+    cmdBuffer_.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
+    pipeline_ = pipeline;
+    ++statistics_.Recorded.Pipelines;
+  }
+
+  void SetViewport(vk::Viewport const& viewport) {
+    if (viewport_ == viewport) {
+      ++statistics_.Skipped.DynamicStates;
+      return;
+    }
+    FlushDraws();
+    cmdBuffer_.setViewport(0, viewport);
+    viewport_ = viewport;
+    ++statistics_.Recorded.DynamicStates;
+  }
+
+  void SetScissor(vk::Rect2D const& scissor) {
+    if (scissor_ == scissor) {
+      ++statistics_.Skipped.DynamicStates;
+      return;
+    }
+    FlushDraws();
+    cmdBuffer_.setScissor(0, scissor);
+    scissor_ = scissor;
+    ++statistics_.Recorded.DynamicStates;
+  }
+
+  void BindVertexBuffer(vk::Buffer const& buffer,
+                        vk::DeviceSize const offset = 0,
+                        uint32_t const binding = 0) {
+    if (vertexBuffers_.size() <= binding) {
+      vertexBuffers_.resize(binding + 1);
+    }
+    auto& bound = vertexBuffers_[binding];
+    if (buffer == bound.Buffer && offset == bound.Offset) {
+      ++statistics_.Skipped.VertexBuffers;
+      return;
+    }
+    FlushDraws();
+    cmdBuffer_.bindVertexBuffers(binding, buffer, offset);
+    bound = {buffer, offset};
+    ++statistics_.Recorded.VertexBuffers;
+  }
+
+  void BindIndexBuffer(vk::Buffer const& buffer, vk::DeviceSize const offset,
+                       vk::IndexType const indexType) {
+    if (buffer == indexBuffer_ && offset == indexOffset_ &&
+        indexType == indexType_) {
+      ++statistics_.Skipped.IndexBuffers;
+      return;
+    }
+    FlushDraws();
+    cmdBuffer_.bindIndexBuffer(buffer, offset, indexType);
+    indexBuffer_ = buffer;
+    indexOffset_ = offset;
+    indexType_ = indexType;
+    ++statistics_.Recorded.IndexBuffers;
+  }
+
+  // The sets must be ordered by index. Sets that are already bound with the
+  // same layout and dynamic offsets are skipped and each run of consecutive
+  // indices that remains is bound in a single call
+  void BindDescriptorSets(vk::PipelineLayout const& layout,
+                          std::span<DescriptorSetBinding const> const sets) {
+    UseLayout(layout);
+
+    uint32_t firstSet = 0;
+    std::vector<vk::DescriptorSet> run;
+    std::vector<uint32_t> dynamicOffsets;
+    auto bindRun = [&]() {
+      if (run.empty()) return;
+      FlushDraws();
+      cmdBuffer_.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, layout,
+                                    firstSet, run, dynamicOffsets);
+      run.clear();
+      dynamicOffsets.clear();
+    };
+
+    for (auto const& set : sets) {
+      if (descriptorSets_.size() <= set.Index) {
+        descriptorSets_.resize(set.Index + 1);
+      }
+      auto& bound = descriptorSets_[set.Index];
+
+      bool const isBound =
+          bound.Set == set.Set &&
+          std::equal(bound.DynamicOffsets.begin(), bound.DynamicOffsets.end(),
+                     set.DynamicOffsets.begin(), set.DynamicOffsets.end());
+      if (isBound || set.Index != firstSet + run.size()) {
+        bindRun();
+      }
+      if (isBound) {
+        ++statistics_.Skipped.DescriptorSets;
+        continue;
+      }
+
+      if (run.empty()) {
+        firstSet = set.Index;
+      }
+      run.push_back(set.Set);
+      dynamicOffsets.insert(dynamicOffsets.end(), set.DynamicOffsets.begin(),
+                            set.DynamicOffsets.end());
+      bound.Set = set.Set;
+      bound.DynamicOffsets.assign(set.DynamicOffsets.begin(),
+                                  set.DynamicOffsets.end());
+      ++statistics_.Recorded.DescriptorSets;
+    }
+    bindRun();
+  }
+
+  // Skipped if every byte was last pushed with the same stages and value
+  void PushConstants(vk::PipelineLayout const& layout,
+                     vk::ShaderStageFlags const stages, uint32_t const offset,
+                     uint32_t const size, void const* data) {
+    UseLayout(layout);
+
+    if (pushConstants_.size() < offset + size) {
+      pushConstants_.resize(offset + size);
+      pushConstantStages_.resize(offset + size);
+    }
+    bool const isPushed =
+        std::all_of(pushConstantStages_.begin() + offset,
+                    pushConstantStages_.begin() + offset + size,
+                    [&](vk::ShaderStageFlags const pushedStages) {
+                      return pushedStages == stages;
+                    }) &&
+        std::memcmp(pushConstants_.data() + offset, data, size) == 0;
+    if (isPushed) {
+      ++statistics_.Skipped.PushConstants;
+      return;
+    }
+
+    FlushDraws();
+    cmdBuffer_.pushConstants(layout, stages, offset, size, data);
+    std::memcpy(pushConstants_.data() + offset, data, size);
+    std::fill(pushConstantStages_.begin() + offset,
+              pushConstantStages_.begin() + offset + size, stages);
+    ++statistics_.Recorded.PushConstants;
+  }
+
+ protected:
+  void DrawDirect(vk::DrawIndexedIndirectCommand const& command,
+                  bool const indexed) {
+    if (indexed) {
+      cmdBuffer_.drawIndexed(command.indexCount, command.instanceCount,
+                             command.firstIndex, command.vertexOffset,
+                             command.firstInstance);
+    } else {
+      cmdBuffer_.draw(command.indexCount, command.instanceCount,
+                      command.firstIndex, command.firstInstance);
+    }
+    ++statistics_.DrawCalls;
+  }
+
+  // Commands are sizeof(vk::DrawIndexedIndirectCommand) apart, which is also
+  // a valid stride for non-indexed commands
+  void DrawIndirect(vk::Buffer const& buffer, vk::DeviceSize const offset,
+                    uint32_t const numDraws, bool const indexed) {
+    uint32_t const stride = sizeof(vk::DrawIndexedIndirectCommand);
+    uint32_t const drawsPerCall =
+        indirectSupport_.MultiDraw ? indirectSupport_.MaxDrawCount : 1;
+    for (uint32_t draw = 0; draw < numDraws; draw += drawsPerCall) {
+      auto const drawOffset = offset + vk::DeviceSize(draw) * stride;
+      auto const drawCount = std::min(drawsPerCall, numDraws - draw);
+      if (indexed) {
+        cmdBuffer_.drawIndexedIndirect(buffer, drawOffset, drawCount, stride);
+      } else {
+        cmdBuffer_.drawIndirect(buffer, drawOffset, drawCount, stride);
+      }
+      ++statistics_.DrawCalls;
+    }
+  }
+
+  // Pipeline layouts are shared through the layout cache, so a different
+  // layout is treated as incompatible and forgets the bound sets and pushes
+  void UseLayout(vk::PipelineLayout const& layout) {
+    if (layout == layout_) return;
+    layout_ = layout;
+    descriptorSets_.clear();
+    pushConstants_.clear();
+    pushConstantStages_.clear();
+  }
+
+ private:
+  struct BoundVertexBuffer {
+    vk::Buffer Buffer;
+    vk::DeviceSize Offset = 0;
+  };
+
+  struct BoundSet {
+    vk::DescriptorSet Set;
+    std::vector<uint32_t> DynamicOffsets;
+  };
+
+  struct PendingDraws {
+    uint32_t First = 0;
+    uint32_t Count = 0;
+    bool Indexed = false;
+  };
+
+  vk::CommandBuffer cmdBuffer_;
+  RecordStatistics statistics_;
+
+  IndirectDrawSupport indirectSupport_;
+  vk::Buffer indirectBuffer_;
+  std::span<vk::DrawIndexedIndirectCommand> indirectSlots_;
+  uint32_t firstSlot_ = 0;
+  uint32_t nextSlot_ = 0;
+  PendingDraws pending_;
+  IndirectCulling culling_;
+
+  vk::Pipeline pipeline_;
+  std::optional<vk::Viewport> viewport_;
+  std::optional<vk::Rect2D> scissor_;
+  // Indexed by binding
+  std::vector<BoundVertexBuffer> vertexBuffers_;
+  vk::Buffer indexBuffer_;
+  vk::DeviceSize indexOffset_ = 0;
+  vk::IndexType indexType_ = vk::IndexType::eUint32;
+
+  vk::PipelineLayout layout_;
+  // Indexed by set
+  std::vector<BoundSet> descriptorSets_;
+  std::vector<std::byte> pushConstants_;
+  std::vector<vk::ShaderStageFlags> pushConstantStages_;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
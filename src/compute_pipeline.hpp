@@ -0,0 +1,98 @@
+#ifndef VULKAN_RENDERER_COMPUTE_PIPELINE_HPP
+#define VULKAN_RENDERER_COMPUTE_PIPELINE_HPP
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "descriptor_sets.hpp"
+#include "device_api.hpp"
+#include "shader.hpp"
+
+namespace vulkan_renderer {
+
+// A compute shader and its layouts, which come from the device layout cache
+// like those of graphics pipelines. Dispatches are recorded outside of render
+// passes so they are bound directly rather than through a CommandState
+class ComputePipeline {
+ public:
+  ComputePipeline(std::vector<char> const& shaderFile, DeviceApi& device)
+      : shader_(vk::ShaderStageFlagBits::eCompute, shaderFile, device),
+        descriptorSetLayouts_(CreateDescriptorSetLayouts(shader_, device)),
+        layout_(device.GetPipelineLayout(GetLayouts(device),
+                                         shader_.GetPushConstants())),
+        pipeline_(device.CreatePipeline(
+            vk::ComputePipelineCreateInfo{{}, shader_.GetStage(), layout_})) {}
+
+  vk::PipelineLayout GetLayout() const { return layout_; }
+
+  DescriptorSets CreateDescriptorSets(DeviceApi& device) const {
+    return {descriptorSetLayouts_, device};
+  }
+
+  void Bind(ImageIndex const imageIndex, DescriptorSets const& descriptorSets,
+            vk::CommandBuffer const& cmdBuffer) const {
+    cmdBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline_.get());
+    descriptorSets.Bind(imageIndex, layout_, vk::PipelineBindPoint::eCompute,
+                        cmdBuffer);
+  }
+
+  // For sets written while recording, which are only valid for the current
+  // frame of the image. See DeviceApi::AllocateFrameDescriptorSet
+  vk::DescriptorSet AllocateFrameDescriptorSet(ImageIndex const imageIndex,
+                                               uint32_t const set,
+                                               DeviceApi& device) const {
+    auto const& setLayout = descriptorSetLayouts_.at(set);
+    return device.AllocateFrameDescriptorSet(imageIndex, setLayout.Layout,
+                                             setLayout.Bindings);
+  }
+
+  void Bind(vk::DescriptorSet const& descriptorSet,
+            vk::CommandBuffer const& cmdBuffer) const {
+    cmdBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline_.get());
+    cmdBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, layout_, 0,
+                                 descriptorSet, nullptr);
+  }
+
+ protected:
+  static std::map<uint32_t, DescriptorSetLayout> CreateDescriptorSetLayouts(
+      Shader const& shader, DeviceApi& device) {
+    std::map<uint32_t, DescriptorSetLayout> setLayouts;
+    for (auto bindings : shader.GetBindings()) {
+      // Sorted so that identical sets produce identical layouts
+      std::sort(bindings.second.begin(), bindings.second.end(),
+                [](vk::DescriptorSetLayoutBinding const& a,
+                   vk::DescriptorSetLayoutBinding const& b) {
+                  return a.binding < b.binding;
+                });
+      setLayouts.emplace(bindings.first,
+                         DescriptorSetLayout{bindings.second, device});
+    }
+    return setLayouts;
+  }
+
+  // Sets that the shader skips get empty layouts
+  std::vector<vk::DescriptorSetLayout> GetLayouts(DeviceApi& device) const {
+    uint32_t const numSets = descriptorSetLayouts_.empty()
+                                 ? 0
+                                 : descriptorSetLayouts_.rbegin()->first + 1;
+    std::vector<vk::DescriptorSetLayout> layouts;
+    for (uint32_t set = 0; set < numSets; ++set) {
+      auto it = descriptorSetLayouts_.find(set);
+      layouts.push_back(it != descriptorSetLayouts_.end()
+                            ? it->second.Layout
+                            : device.GetDescriptorSetLayout({}));
+    }
+    return layouts;
+  }
+
+ private:
+  Shader shader_;
+  std::map<uint32_t, DescriptorSetLayout> descriptorSetLayouts_;
+  vk::PipelineLayout layout_;
+  vk::UniquePipeline pipeline_;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef VULKAN_RENDERER_CULLING_HPP
+#define VULKAN_RENDERER_CULLING_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "vulkan/vulkan.hpp"
+
+namespace vulkan_renderer {
+
+// Matrices are column major, as glm stores them
+using Matrix = std::array<float, 16>;
+using Plane = std::array<float, 4>;
+
+// A bounding sphere with an optional box around the same centre, in world
+// space. Draws without bounds have a negative radius and are never culled
+struct DrawBounds {
+  std::array<float, 3> Center{};
+  float Radius = -1.0f;
+  // Half the size of the box, or zero to only test the sphere
+  std::array<float, 3> Extents{};
+};
+
+// The layout of an object in the culling shader's object buffer. Run is the
+// slot of the first draw in the run of draws it is drawn with
+struct CullObject {
+  static inline uint32_t const NoRun = std::numeric_limits<uint32_t>::max();
+
+  DrawBounds Bounds;
+  uint32_t Run = NoRun;
+};
+
+// The layout of the culling shader's uniform buffer
+struct CullParams {
+  std::array<Plane, 6> Planes{};
+  Matrix PyramidViewProjection{};
+  // Width, height, number of levels and whether to test occlusion
+  std::array<uint32_t, 4> Pyramid{};
+  // Number of slots and whether visible draws are compacted
+  std::array<uint32_t, 4> Draws{};
+};
+
+// Planes of the view volume facing inwards, for clip space depth from 0 to 1
+inline std::array<Plane, 6> GetFrustumPlanes(Matrix const& viewProjection) {
+  auto row = [&](uint32_t const i) {
+    return Plane{viewProjection[i], viewProjection[4 + i],
+                 viewProjection[8 + i], viewProjection[12 + i]};
+  };
+  auto combine = [](Plane const& a, Plane const& b, float const sign) {
+    return Plane{a[0] + sign * b[0], a[1] + sign * b[1], a[2] + sign * b[2],
+                 a[3] + sign * b[3]};
+  };
+
+  auto const w = row(3);
+  std::array<Plane, 6> planes{combine(w, row(0), 1.0f),
+                              combine(w, row(0), -1.0f),
+                              combine(w, row(1), 1.0f),
+                              combine(w, row(1), -1.0f),
+                              row(2),
+                              combine(w, row(2), -1.0f)};
+  for (auto& plane : planes) {
+    auto length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] +
+                            plane[2] * plane[2]);
+    if (length > 0.0f) {
+      for (auto& value : plane) {
+        value /= length;
+      }
+    }
+  }
+  return planes;
+}
+
+// CPU reference of the depth pyramid that CullingPass builds on the device.
+// The first level is the largest power of two that fits in the depth and each
+// level after it is half the size of the one before. Each texel holds the
+// farthest depth of the texels it covers in the level before, or in the depth
+// for the first level, so a single read gives the farthest depth of a region.
+// Depth increases away from the camera
+class DepthPyramid {
+ public:
+  DepthPyramid() = default;
+
+  // The depth is row major with one value per texel
+  DepthPyramid(std::span<float const> const depth, uint32_t const width,
+               uint32_t const height) {
+    assert(depth.size() == size_t(width) * height);
+    AddLevel(depth, {width, height},
+             {std::bit_floor(width), std::bit_floor(height)});
+    while (extents_.back().width > 1 || extents_.back().height > 1) {
+      auto const below = extents_.back();
+      std::vector<float> const belowData(data_.begin() + offsets_.back(),
+                                         data_.end());
+      AddLevel(belowData, below,
+               {std::max(below.width / 2, 1u), std::max(below.height / 2, 1u)});
+    }
+  }
+
+  // Every level one after the other, row by row, from a first level of the
+  // extent, as read back from the device
+  DepthPyramid(std::vector<float> data, vk::Extent2D const extent)
+      : data_(std::move(data)) {
+    size_t offset = 0;
+    for (auto level = extent;;
+         level = {std::max(level.width / 2, 1u),
+                  std::max(level.height / 2, 1u)}) {
+      extents_.push_back(level);
+      offsets_.push_back(offset);
+      offset += size_t(level.width) * level.height;
+      if (level.width == 1 && level.height == 1) break;
+    }
+    assert(offset <= data_.size());
+  }
+
+  bool IsEmpty() const { return data_.empty(); }
+
+  uint32_t GetNumLevels() const { return extents_.size(); }
+  vk::Extent2D GetExtent(uint32_t const level = 0) const {
+    return extents_.at(level);
+  }
+
+  // Texels past the edge of the level read the edge
+  float Get(uint32_t const level, uint32_t const x, uint32_t const y) const {
+    auto const& extent = extents_.at(level);
+    return data_[offsets_[level] + std::min(y, extent.height - 1) *
+                                       extent.width +
+                 std::min(x, extent.width - 1)];
+  }
+
+  std::span<float const> GetData() const { return data_; }
+
+ private:
+  // Matches shaders/depth_pyramid.comp
+  void AddLevel(std::span<float const> const source,
+                vk::Extent2D const sourceExtent, vk::Extent2D const extent) {
+    extents_.push_back(extent);
+    offsets_.push_back(data_.size());
+    auto footprint = [](uint32_t const i, uint32_t const sourceSize,
+                        uint32_t const size) {
+      return std::pair{i * sourceSize / size,
+                       std::min(((i + 1) * sourceSize + size - 1) / size,
+                                sourceSize) -
+                           1};
+    };
+    for (uint32_t y = 0; y < extent.height; ++y) {
+      auto const [firstY, lastY] = footprint(y, sourceExtent.height,
+                                             extent.height);
+      for (uint32_t x = 0; x < extent.width; ++x) {
+        auto const [firstX, lastX] = footprint(x, sourceExtent.width,
+                                               extent.width);
+        float farthest = 0.0f;
+        for (auto sourceY = firstY; sourceY <= lastY; ++sourceY) {
+          for (auto sourceX = firstX; sourceX <= lastX; ++sourceX) {
+            farthest = std::max(
+                farthest, source[sourceY * sourceExtent.width + sourceX]);
+          }
+        }
+        data_.push_back(farthest);
+      }
+    }
+  }
+
+  std::vector<float> data_;
+  std::vector<vk::Extent2D> extents_;
+  std::vector<size_t> offsets_;
+};
+
+// Frames whose culling was read back from the device and compared with
+// CullDraws, and how many of them differed
+struct CullVerification {
+  uint32_t Frames = 0;
+  uint32_t Mismatches = 0;
+};
+
+// What the culling shader culls draws with. The view is tested against the
+// frustum and, with occlusion, against the depth pyramid that CullingPass
+// builds from the depth rendered in the previous frame
+class DrawCulling {
+ public:
+  void SetView(Matrix const& viewProjection) {
+    viewProjection_ = viewProjection;
+    planes_ = GetFrustumPlanes(viewProjection);
+  }
+
+  Matrix const& GetView() const { return viewProjection_; }
+
+  // Render passes without depth, or with multisampled depth, are only culled
+  // against the frustum
+  void SetOcclusion(bool const occlusion) { occlusion_ = occlusion; }
+  bool IsOcclusionEnabled() const { return occlusion_; }
+
+  // Reads back every frame's culling and depth pyramid and checks them
+  // against CullDraws once the frame has completed. This is slow and meant
+  // for checking devices such as software implementations
+  void SetVerification(bool const verify) { verify_ = verify; }
+  bool IsVerificationEnabled() const { return verify_; }
+
+  void AddVerifiedFrame(bool const matches) {
+    ++verification_.Frames;
+    if (!matches) ++verification_.Mismatches;
+  }
+  CullVerification const& GetVerification() const { return verification_; }
+
+  // The pyramid is filled in by CullingPass
+  CullParams GetParams(uint32_t const numSlots, bool const compact) const {
+    CullParams params;
+    params.Planes = planes_;
+    params.Draws = {numSlots, compact, 0, 0};
+    return params;
+  }
+
+ private:
+  // Nothing is outside the frustum until a view is set
+  std::array<Plane, 6> planes_{};
+  Matrix viewProjection_{};
+  bool occlusion_ = true;
+  bool verify_ = false;
+  CullVerification verification_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// CPU reference of shaders/cull.comp, for checking the culling on devices
+// such as software implementations. Results can only differ by rounding at
+// the edges of the tests
+//////////////////////////////////////////////////////////////////////////////
+
+inline bool IsInFrustum(DrawBounds const& bounds, CullParams const& params) {
+  bool const hasExtents =
+      std::any_of(bounds.Extents.begin(), bounds.Extents.end(),
+                  [](float const extent) { return extent > 0.0f; });
+  for (auto const& plane : params.Planes) {
+    float distance = plane[3];
+    float radius = 0.0f;
+    for (uint32_t i = 0; i < 3; ++i) {
+      distance += plane[i] * bounds.Center[i];
+      radius += std::abs(plane[i]) * bounds.Extents[i];
+    }
+    if (distance + bounds.Radius < 0.0f) return false;
+    if (hasExtents && distance + radius < 0.0f) return false;
+  }
+  return true;
+}
+
+inline bool IsOccluded(DrawBounds const& bounds, CullParams const& params,
+                       DepthPyramid const& pyramid) {
+  if (!params.Pyramid[3]) return false;
+
+  auto const& m = params.PyramidViewProjection;
+  std::array<float, 2> minimum{3.4e38f, 3.4e38f};
+  std::array<float, 2> maximum{-3.4e38f, -3.4e38f};
+  float nearest = 3.4e38f;
+  for (uint32_t i = 0; i < 8; ++i) {
+    std::array<float, 4> corner{
+        bounds.Center[0] + bounds.Radius * ((i & 1) ? 1.0f : -1.0f),
+        bounds.Center[1] + bounds.Radius * ((i & 2) ? 1.0f : -1.0f),
+        bounds.Center[2] + bounds.Radius * ((i & 4) ? 1.0f : -1.0f), 1.0f};
+    std::array<float, 4> clip{};
+    for (uint32_t row = 0; row < 4; ++row) {
+      for (uint32_t column = 0; column < 4; ++column) {
+        clip[row] += m[column * 4 + row] * corner[column];
+      }
+    }
+    if (clip[3] <= 0.0f) return false;
+    for (uint32_t axis = 0; axis < 2; ++axis) {
+      minimum[axis] = std::min(minimum[axis], clip[axis] / clip[3]);
+      maximum[axis] = std::max(maximum[axis], clip[axis] / clip[3]);
+    }
+    nearest = std::min(nearest, clip[2] / clip[3]);
+  }
+  if (nearest < 0.0f || minimum[0] < -1.0f || minimum[1] < -1.0f ||
+      maximum[0] > 1.0f || maximum[1] > 1.0f) {
+    return false;
+  }
+
+  std::array<float, 2> lower{};
+  std::array<float, 2> upper{};
+  for (uint32_t axis = 0; axis < 2; ++axis) {
+    auto const size = static_cast<float>(params.Pyramid[axis]);
+    lower[axis] = (minimum[axis] * 0.5f + 0.5f) * size;
+    upper[axis] = (maximum[axis] * 0.5f + 0.5f) * size;
+  }
+  float const extent = std::max(upper[0] - lower[0], upper[1] - lower[1]);
+  uint32_t const level =
+      extent <= 1.0f
+          ? 0
+          : std::min(static_cast<uint32_t>(std::ceil(std::log2(extent))),
+                     params.Pyramid[2] - 1);
+
+  auto const firstX = static_cast<uint32_t>(lower[0]) >> level;
+  auto const firstY = static_cast<uint32_t>(lower[1]) >> level;
+  auto const lastX =
+      std::min(static_cast<uint32_t>(upper[0]) >> level, firstX + 1);
+  auto const lastY =
+      std::min(static_cast<uint32_t>(upper[1]) >> level, firstY + 1);
+  float farthest = 0.0f;
+  for (auto y = firstY; y <= lastY; ++y) {
+    for (auto x = firstX; x <= lastX; ++x) {
+      farthest = std::max(farthest, pyramid.Get(level, x, y));
+    }
+  }
+  return nearest > farthest;
+}
+
+// The output and counts of the culling shader for the objects and commands
+// of every slot. Compacted draws keep their order here but are in no
+// particular order within their run on the device
+struct CullResult {
+  std::vector<vk::DrawIndexedIndirectCommand> Commands;
+  // The number of visible draws in each run, at the run's first slot
+  std::vector<uint32_t> Counts;
+};
+
+inline CullResult CullDraws(
+    std::span<CullObject const> const objects,
+    std::span<vk::DrawIndexedIndirectCommand const> const commands,
+    CullParams const& params, DepthPyramid const& pyramid) {
+  assert(objects.size() == commands.size());
+  CullResult result;
+  result.Commands.resize(commands.size());
+  result.Counts.resize(commands.size());
+
+  auto const numSlots = std::min<size_t>(params.Draws[0], objects.size());
+  bool const compact = params.Draws[1];
+  for (size_t slot = 0; slot < numSlots; ++slot) {
+    auto const& object = objects[slot];
+    if (object.Run == CullObject::NoRun) continue;
+
+    auto command = commands[slot];
+    bool const visible = object.Bounds.Radius < 0.0f ||
+                         (IsInFrustum(object.Bounds, params) &&
+                          !IsOccluded(object.Bounds, params, pyramid));
+    if (!compact) {
+      if (!visible) {
+        command.instanceCount = 0;
+      } else {
+        ++result.Counts[object.Run];
+      }
+      result.Commands[slot] = command;
+    } else if (visible) {
+      result.Commands[object.Run + result.Counts[object.Run]++] = command;
+    }
+  }
+  return result;
+}
+
+// Whether the culling shader's results match those of CullDraws for the same
+// objects. Slots without a run are never written by the shader, and
+// compacted runs are compared regardless of order
+inline bool IsCullResultEqual(CullResult const& expected,
+                              CullResult const& actual,
+                              std::span<CullObject const> const objects,
+                              bool const compact) {
+  auto const numSlots = objects.size();
+  if (expected.Commands.size() < numSlots ||
+      actual.Commands.size() < numSlots || expected.Counts.size() < numSlots ||
+      actual.Counts.size() < numSlots) {
+    return false;
+  }
+
+  auto isLess = [](vk::DrawIndexedIndirectCommand const& a,
+                   vk::DrawIndexedIndirectCommand const& b) {
+    return std::tie(a.firstIndex, a.vertexOffset, a.firstInstance,
+                    a.indexCount, a.instanceCount) <
+           std::tie(b.firstIndex, b.vertexOffset, b.firstInstance,
+                    b.indexCount, b.instanceCount);
+  };
+  for (size_t slot = 0; slot < numSlots; ++slot) {
+    auto const run = objects[slot].Run;
+    if (run == CullObject::NoRun) continue;
+    if (!compact) {
+      if (expected.Commands[slot] != actual.Commands[slot]) return false;
+      continue;
+    }
+
+    // Each run is compared from its first slot
+    if (run != slot) continue;
+    auto const count = expected.Counts[slot];
+    if (actual.Counts[slot] != count || slot + count > numSlots) return false;
+    std::vector<vk::DrawIndexedIndirectCommand> expectedRun(
+        expected.Commands.begin() + slot,
+        expected.Commands.begin() + slot + count);
+    std::vector<vk::DrawIndexedIndirectCommand> actualRun(
+        actual.Commands.begin() + slot, actual.Commands.begin() + slot + count);
+    std::sort(expectedRun.begin(), expectedRun.end(), isLess);
+    std::sort(actualRun.begin(), actualRun.end(), isLess);
+    if (expectedRun != actualRun) return false;
+  }
+
+  // Counts are only kept at the first slot of each run
+  for (size_t slot = 0; slot < numSlots; ++slot) {
+    if (objects[slot].Run == slot &&
+        expected.Counts[slot] != actual.Counts[slot]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace vulkan_renderer
+
+#endif
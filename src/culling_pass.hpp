@@ -0,0 +1,630 @@
+#ifndef VULKAN_RENDERER_CULLING_PASS_HPP
+#define VULKAN_RENDERER_CULLING_PASS_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "buffers/device_buffer.hpp"
+#include "buffers/image_buffer.hpp"
+#include "buffers/vertex_buffer.hpp"
+#include "command_state.hpp"
+#include "compute_pipeline.hpp"
+#include "culling.hpp"
+#include "defaults.hpp"
+#include "descriptor_sets.hpp"
+#include "device_api.hpp"
+#include "memory.hpp"
+#include "shader.hpp"
+
+namespace vulkan_renderer {
+
+// Culls a command's indirect draws on the device before its render pass.
+// CommandState writes the run of each draw in the indirect buffer to the
+// object at the same slot, and Upload writes the draw's bounds every frame so
+// that moving a draw does not record the command again. The shader
+// writes each run's visible draws to the output buffer from the run's first
+// slot and counts them at the run's first count, which the run is then drawn
+// with. Without VK_KHR_draw_indirect_count every draw stays in its slot and
+// culled draws draw no instances.
+//
+// Occlusion is tested against a depth pyramid built from the depth attachment
+// at the start of each frame, before the image's commands, so it holds the
+// depth of the previous frame and is read with the previous frame's view.
+// Each level is built from the one before it by shaders/depth_pyramid.comp.
+// The pyramid is recreated when the depth attachment changes, and render
+// passes whose depth cannot be sampled get a pyramid of one texel that is
+// never built, which leaves only the frustum test.
+//
+// With verification on, the results and the pyramid are copied to the host
+// and checked against CullDraws once the frame has completed, see
+// DrawCulling::SetVerification.
+//
+// Buffers are per swapchain image and are only written while the image is not
+// in flight
+class CullingPass {
+ public:
+  // The pyramid's command buffers are allocated from the pool
+  CullingPass(std::shared_ptr<DrawCulling> const& culling,
+              vk::CommandPool const& pool, DeviceApi& device)
+      : device_(&device),
+        culling_(culling),
+        pipeline_(LoadShader(defaults::command::CullShader), device),
+        pyramidPipeline_(LoadShader(defaults::command::PyramidShader), device),
+        descriptorSets_(pipeline_.CreateDescriptorSets(device)),
+        sampler_(device.CreateSampler(
+            {{},
+             vk::Filter::eNearest,
+             vk::Filter::eNearest,
+             vk::SamplerMipmapMode::eNearest,
+             vk::SamplerAddressMode::eClampToEdge,
+             vk::SamplerAddressMode::eClampToEdge,
+             vk::SamplerAddressMode::eClampToEdge})),
+        frames_(device.GetNumSwapchainImages()) {
+    auto cmdBuffers = device.AllocateCommandBuffers(
+        vk::CommandBufferLevel::ePrimary, frames_.size(), pool);
+    for (uint32_t i = 0; i < frames_.size(); ++i) {
+      frames_[i].PyramidCmdBuffer = cmdBuffers[i];
+    }
+  }
+
+  // Dispatches that are still in flight may read the pyramid
+  ~CullingPass() {
+    if (pyramid_) device_->Release(0, std::move(pyramid_));
+  }
+
+  CullingPass(CullingPass const&) = delete;
+  CullingPass& operator=(CullingPass const&) = delete;
+
+  // A new pyramid can only be bound, and the readback copies only added or
+  // removed, by recording again
+  bool IsOutdated(ImageIndex const imageIndex) const {
+    assert(imageIndex < frames_.size());
+    auto const& frame = frames_[imageIndex];
+    return frame.NumSlots > 0 &&
+           (pyramidOutdated_ || frame.PyramidGeneration != pyramidGeneration_ ||
+            frame.Verified != culling_->IsVerificationEnabled());
+  }
+
+  // Records the dispatch that culls the draws in the first commands of the
+  // indirect buffer, one for each of draws. Draws that are null are never
+  // culled. The depth is the render pass's depth attachment, which may be
+  // null. The runs of the objects returned must be written before the
+  // command buffer is submitted, which CommandState does once it is given them
+  IndirectCulling Record(ImageIndex const imageIndex,
+                         std::span<Buffer const* const> const draws,
+                         DeviceBuffer& commands, ImageBuffer const* depth,
+                         vk::CommandBuffer const& cmdBuffer,
+                         DeviceApi& device) {
+    assert(imageIndex < frames_.size());
+    auto& frame = frames_[imageIndex];
+    Verify(frame, device);
+    uint32_t const numSlots = draws.size();
+    frame.Draws.assign(draws.begin(), draws.end());
+    if (!pyramid_ || pyramidOutdated_) {
+      CreatePyramid(depth, device);
+    }
+    if (frame.PyramidGeneration != pyramidGeneration_) {
+      frame.PyramidGeneration = pyramidGeneration_;
+      frame.DescriptorsOutdated = true;
+    }
+    Allocate(frame, numSlots, device);
+    frame.CommandData = &commands;
+    if (frame.Commands != commands.GetBuffer()) {
+      frame.Commands = commands.GetBuffer();
+      frame.DescriptorsOutdated = true;
+    }
+    if (frame.DescriptorsOutdated) {
+      WriteDescriptors(imageIndex, frame, device);
+    }
+    frame.NumSlots = numSlots;
+
+    // Slots that are drawn directly are skipped as they get no run
+    auto objects = frame.Objects->GetData<CullObject>().subspan(0, numSlots);
+    std::fill(objects.begin(), objects.end(), CullObject{});
+
+    cmdBuffer.fillBuffer(frame.Counts->GetBuffer(), 0,
+                         numSlots * sizeof(uint32_t), 0);
+    vk::MemoryBarrier cleared{vk::AccessFlagBits::eTransferWrite,
+                              vk::AccessFlagBits::eShaderRead |
+                                  vk::AccessFlagBits::eShaderWrite};
+    cmdBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                              vk::PipelineStageFlagBits::eComputeShader, {},
+                              cleared, nullptr, nullptr);
+
+    pipeline_.Bind(imageIndex, descriptorSets_, cmdBuffer);
+    auto const workGroupSize = defaults::command::CullWorkGroupSize;
+    cmdBuffer.dispatch((numSlots + workGroupSize - 1) / workGroupSize, 1, 1);
+
+    vk::MemoryBarrier culled{vk::AccessFlagBits::eShaderWrite,
+                             vk::AccessFlagBits::eIndirectCommandRead};
+    cmdBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                              vk::PipelineStageFlagBits::eDrawIndirect, {},
+                              culled, nullptr, nullptr);
+
+    frame.Verified = culling_->IsVerificationEnabled();
+    if (frame.Verified) {
+      RecordReadback(frame, numSlots, cmdBuffer, device);
+    }
+
+    return {objects, frame.Output->GetBuffer(), frame.Counts->GetBuffer()};
+  }
+
+  // Called when the image is recorded without culling, such as when it has
+  // no indirect draws
+  void Skip(ImageIndex const imageIndex, DeviceApi& device) {
+    assert(imageIndex < frames_.size());
+    auto& frame = frames_[imageIndex];
+    Verify(frame, device);
+    frame.NumSlots = 0;
+    frame.Verified = false;
+  }
+
+  // Called once the objects have been written
+  void Flush(ImageIndex const imageIndex, DeviceApi& device) {
+    assert(imageIndex < frames_.size());
+    frames_[imageIndex].Objects->Flush(device);
+  }
+
+  // Records the build of the depth pyramid from the depth that the render
+  // pass stored in the previous frame. Must be called every frame, after the
+  // image is recorded and before Upload. See GetPyramidCommands
+  void RecordPyramid(ImageIndex const imageIndex, ImageBuffer const* depth,
+                     DeviceApi& device) {
+    assert(imageIndex < frames_.size());
+    auto& frame = frames_[imageIndex];
+    frame.PyramidBuilt = false;
+    frame.PyramidRecorded = false;
+    if (!pyramid_) return;
+
+    // The render pass was recreated, so the next frame records again
+    if ((depth ? depth->GetImage() : vk::Image{}) != pyramid_->Depth) {
+      pyramidOutdated_ = true;
+      return;
+    }
+
+    bool const build = pyramid_->IsInitialised && pyramid_->Buildable &&
+                       depthRendered_ && culling_->IsOcclusionEnabled();
+    depthRendered_ = true;
+    if (pyramid_->IsInitialised && !build) return;
+
+    auto const& cmdBuffer = frame.PyramidCmdBuffer;
+    cmdBuffer.reset();
+    cmdBuffer.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    if (!pyramid_->IsInitialised) {
+      // Until it is first built the pyramid is only bound
+      vk::ImageMemoryBarrier initialise{
+          {},
+          vk::AccessFlagBits::eShaderRead,
+          vk::ImageLayout::eUndefined,
+          vk::ImageLayout::eGeneral,
+          VK_QUEUE_FAMILY_IGNORED,
+          VK_QUEUE_FAMILY_IGNORED,
+          pyramid_->Image.get(),
+          {vk::ImageAspectFlagBits::eColor, 0, pyramid_->NumLevels, 0, 1}};
+      cmdBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
+                                vk::PipelineStageFlagBits::eComputeShader, {},
+                                nullptr, nullptr, initialise);
+      pyramid_->IsInitialised = true;
+    } else {
+      BuildPyramid(imageIndex, *pyramid_, cmdBuffer, device);
+      frame.PyramidBuilt = true;
+    }
+    cmdBuffer.end();
+    frame.PyramidRecorded = true;
+  }
+
+  // Submitted before the image's commands, or null when there is nothing to
+  // build this frame
+  vk::CommandBuffer GetPyramidCommands(ImageIndex const imageIndex) const {
+    assert(imageIndex < frames_.size());
+    auto const& frame = frames_[imageIndex];
+    return frame.PyramidRecorded ? frame.PyramidCmdBuffer
+                                 : vk::CommandBuffer{};
+  }
+
+  // Writes the view, the bounds of the draws and the pyramid the image's
+  // draws are tested against. Must be called every frame, after the image is
+  // recorded
+  void Upload(ImageIndex const imageIndex, DeviceApi& device) {
+    assert(imageIndex < frames_.size());
+    auto& frame = frames_[imageIndex];
+    if (!frame.Params) return;
+    Verify(frame, device);
+
+    auto objects = frame.Objects->GetData<CullObject>();
+    for (uint32_t slot = 0; slot < frame.NumSlots; ++slot) {
+      auto const draw = frame.Draws[slot];
+      objects[slot].Bounds = draw ? draw->GetBounds() : DrawBounds{};
+    }
+    frame.Objects->Flush(device);
+
+    auto params = culling_->GetParams(
+        frame.NumSlots, device.GetIndirectDrawSupport().DrawCount);
+    // The pyramid holds the depth rendered with the previous frame's view
+    params.PyramidViewProjection = pyramidViewProjection_;
+    params.Pyramid = {pyramid_->Extent.width, pyramid_->Extent.height,
+                      pyramid_->NumLevels, frame.PyramidBuilt};
+    pyramidViewProjection_ = culling_->GetView();
+    std::memcpy(frame.Params->GetData<std::byte>().data(), &params,
+                sizeof(params));
+    frame.Params->Flush(device);
+
+    frame.CheckPending = frame.Verified;
+    if (frame.Verified) {
+      auto const commands =
+          frame.CommandData->GetData<vk::DrawIndexedIndirectCommand>();
+      frame.CheckParams = params;
+      frame.CheckObjects.assign(objects.begin(),
+                                objects.begin() + frame.NumSlots);
+      frame.CheckCommands.assign(commands.begin(),
+                                 commands.begin() + frame.NumSlots);
+    }
+  }
+
+ protected:
+  struct Frame {
+    std::unique_ptr<DeviceBuffer> Params;
+    std::unique_ptr<DeviceBuffer> Objects;
+    std::unique_ptr<DeviceBuffer> Output;
+    std::unique_ptr<DeviceBuffer> Counts;
+    // The buffer drawn at each slot when the image was last recorded
+    std::vector<Buffer const*> Draws;
+    vk::Buffer Commands;
+    DeviceBuffer* CommandData = nullptr;
+    vk::CommandBuffer PyramidCmdBuffer;
+    uint32_t NumSlots = 0;
+    // Of the pyramid the descriptors were written with
+    uint32_t PyramidGeneration = 0;
+    bool PyramidRecorded = false;
+    bool PyramidBuilt = false;
+    bool DescriptorsOutdated = true;
+
+    // Whether the image was recorded with the readback copies
+    bool Verified = false;
+    std::unique_ptr<DeviceBuffer> Readback;
+    // What the last submitted frame was culled with, see Verify
+    bool CheckPending = false;
+    CullParams CheckParams;
+    std::vector<CullObject> CheckObjects;
+    std::vector<vk::DrawIndexedIndirectCommand> CheckCommands;
+  };
+
+  // Levels are powers of two so that level n is the first level's size
+  // shifted by n, which the culling shader relies on
+  struct Pyramid {
+    Pyramid(vk::Extent2D const extent, DeviceApi& device)
+        : Extent(extent),
+          NumLevels(std::bit_width(std::max(extent.width, extent.height))),
+          Image(device.CreateImage(
+              {
+                  {},
+                  vk::ImageType::e2D,
+                  vk::Format::eR32Sfloat,
+                  {extent.width, extent.height, 1},
+                  NumLevels,
+                  1,
+                  vk::SampleCountFlagBits::e1,
+                  vk::ImageTiling::eOptimal,
+                  vk::ImageUsageFlagBits::eStorage |
+                      vk::ImageUsageFlagBits::eSampled |
+                      vk::ImageUsageFlagBits::eTransferSrc,
+                  vk::SharingMode::eExclusive,
+              },
+              {})),
+          Memory(device.AllocateMemory(
+              Image.get(), vk::MemoryPropertyFlagBits::eDeviceLocal)),
+          View(device.CreateImageView(
+              Image.get(), vk::ImageViewType::e2D, vk::Format::eR32Sfloat, {},
+              {vk::ImageAspectFlagBits::eColor, 0, NumLevels, 0, 1})) {
+      for (uint32_t level = 0; level < NumLevels; ++level) {
+        LevelViews.push_back(device.CreateImageView(
+            Image.get(), vk::ImageViewType::e2D, vk::Format::eR32Sfloat, {},
+            {vk::ImageAspectFlagBits::eColor, level, 1, 0, 1}));
+      }
+    }
+
+    vk::Extent2D GetExtent(uint32_t const level) const {
+      return {std::max(Extent.width >> level, 1u),
+              std::max(Extent.height >> level, 1u)};
+    }
+
+    vk::Extent2D Extent;
+    uint32_t NumLevels;
+    vk::UniqueImage Image;
+    Allocation Memory;
+    // Every level, for the culling shader
+    vk::UniqueImageView View;
+    // One for each level, for building the pyramid
+    std::vector<vk::UniqueImageView> LevelViews;
+    // The depth attachment the pyramid is built from
+    vk::Image Depth;
+    vk::ImageView DepthView;
+    vk::ImageAspectFlags DepthAspect;
+    bool Buildable = false;
+    // Whether the pyramid's layout has been set
+    bool IsInitialised = false;
+  };
+
+  // The old pyramid is released once the frames in flight that read it have
+  // completed
+  void CreatePyramid(ImageBuffer const* depth, DeviceApi& device) {
+    if (pyramid_) device.Release(0, std::move(pyramid_));
+
+    bool const buildable =
+        depth &&
+        (depth->GetProperties().Usage & vk::ImageUsageFlagBits::eSampled);
+    vk::Extent2D extent{1, 1};
+    if (buildable) {
+      auto const& depthExtent = depth->GetProperties().Extent;
+      extent = {std::bit_floor(depthExtent.width),
+                std::bit_floor(depthExtent.height)};
+    }
+    pyramid_ = std::make_unique<Pyramid>(extent, device);
+    if (depth) {
+      pyramid_->Depth = depth->GetImage();
+      pyramid_->DepthView = depth->GetImageView();
+      pyramid_->DepthAspect = GetDepthAspect(depth->GetProperties().Format);
+    }
+    pyramid_->Buildable = buildable;
+
+    pyramidOutdated_ = false;
+    // The depth has not been rendered to by this pass yet
+    depthRendered_ = false;
+    ++pyramidGeneration_;
+  }
+
+  // Layouts of depth formats with stencil are set for both aspects
+  static vk::ImageAspectFlags GetDepthAspect(vk::Format const format) {
+    if (format == vk::Format::eD32SfloatS8Uint ||
+        format == vk::Format::eD24UnormS8Uint ||
+        format == vk::Format::eD16UnormS8Uint) {
+      return vk::ImageAspectFlagBits::eDepth |
+             vk::ImageAspectFlagBits::eStencil;
+    }
+    return vk::ImageAspectFlagBits::eDepth;
+  }
+
+  void BuildPyramid(ImageIndex const imageIndex, Pyramid const& pyramid,
+                    vk::CommandBuffer const& cmdBuffer, DeviceApi& device) {
+    vk::ImageSubresourceRange const depthRange{pyramid.DepthAspect, 0, 1, 0,
+                                               1};
+    // The previous frame's render pass wrote the depth, and its build wrote
+    // the pyramid that its cull dispatch read
+    vk::MemoryBarrier pyramidWritten{vk::AccessFlagBits::eShaderWrite,
+                                     vk::AccessFlagBits::eShaderWrite};
+    vk::ImageMemoryBarrier toRead{
+        vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+        vk::AccessFlagBits::eShaderRead,
+        vk::ImageLayout::eDepthStencilAttachmentOptimal,
+        vk::ImageLayout::eDepthStencilReadOnlyOptimal,
+        VK_QUEUE_FAMILY_IGNORED,
+        VK_QUEUE_FAMILY_IGNORED,
+        pyramid.Depth,
+        depthRange};
+    cmdBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eLateFragmentTests |
+                                  vk::PipelineStageFlagBits::eComputeShader,
+                              vk::PipelineStageFlagBits::eComputeShader, {},
+                              pyramidWritten, nullptr, toRead);
+
+    auto const workGroupSize = defaults::command::PyramidWorkGroupSize;
+    vk::MemoryBarrier levelWritten{vk::AccessFlagBits::eShaderWrite,
+                                   vk::AccessFlagBits::eShaderRead};
+    for (uint32_t level = 0; level < pyramid.NumLevels; ++level) {
+      auto descriptorSet =
+          pyramidPipeline_.AllocateFrameDescriptorSet(imageIndex, 0, device);
+      vk::DescriptorImageInfo source =
+          level == 0
+              ? vk::DescriptorImageInfo{sampler_.get(), pyramid.DepthView,
+                                        vk::ImageLayout::
+                                            eDepthStencilReadOnlyOptimal}
+              : vk::DescriptorImageInfo{sampler_.get(),
+                                        pyramid.LevelViews[level - 1].get(),
+                                        vk::ImageLayout::eGeneral};
+      vk::DescriptorImageInfo destination{{}, pyramid.LevelViews[level].get(),
+                                          vk::ImageLayout::eGeneral};
+      device.UpdateDescriptorSet(
+          {vk::WriteDescriptorSet{descriptorSet, 0, 0, 1,
+                                  vk::DescriptorType::eCombinedImageSampler,
+                                  &source},
+           vk::WriteDescriptorSet{descriptorSet, 1, 0, 1,
+                                  vk::DescriptorType::eStorageImage,
+                                  &destination}});
+
+      pyramidPipeline_.Bind(descriptorSet, cmdBuffer);
+      auto const extent = pyramid.GetExtent(level);
+      cmdBuffer.dispatch((extent.width + workGroupSize - 1) / workGroupSize,
+                         (extent.height + workGroupSize - 1) / workGroupSize,
+                         1);
+      // The last level is read by the cull dispatch
+      cmdBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                vk::PipelineStageFlagBits::eComputeShader, {},
+                                levelWritten, nullptr, nullptr);
+    }
+
+    // The render pass clears the depth once the pyramid has read it
+    vk::ImageMemoryBarrier toAttachment{
+        {},
+        vk::AccessFlagBits::eDepthStencilAttachmentRead |
+            vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+        vk::ImageLayout::eDepthStencilReadOnlyOptimal,
+        vk::ImageLayout::eDepthStencilAttachmentOptimal,
+        VK_QUEUE_FAMILY_IGNORED,
+        VK_QUEUE_FAMILY_IGNORED,
+        pyramid.Depth,
+        depthRange};
+    cmdBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                              vk::PipelineStageFlagBits::eEarlyFragmentTests |
+                                  vk::PipelineStageFlagBits::eLateFragmentTests,
+                              {}, nullptr, nullptr, toAttachment);
+  }
+
+  // Buffers only grow so that they are rarely bound again
+  void Allocate(Frame& frame, uint32_t const numSlots, DeviceApi& device) {
+    if (!frame.Params) {
+      frame.Params = std::make_unique<DeviceBuffer>(
+          sizeof(CullParams), vk::BufferUsageFlagBits::eUniformBuffer, device);
+    }
+
+    if (!frame.Objects ||
+        frame.Objects->GetSize() < numSlots * sizeof(CullObject)) {
+      auto const capacity = std::bit_ceil(std::max(numSlots, 1u));
+      frame.Objects = std::make_unique<DeviceBuffer>(
+          capacity * sizeof(CullObject),
+          vk::BufferUsageFlagBits::eStorageBuffer, device);
+      frame.Output = std::make_unique<DeviceBuffer>(
+          capacity * sizeof(vk::DrawIndexedIndirectCommand),
+          vk::BufferUsageFlagBits::eStorageBuffer |
+              vk::BufferUsageFlagBits::eIndirectBuffer,
+          device, vk::MemoryPropertyFlagBits::eDeviceLocal);
+      frame.Counts = std::make_unique<DeviceBuffer>(
+          capacity * sizeof(uint32_t),
+          vk::BufferUsageFlagBits::eStorageBuffer |
+              vk::BufferUsageFlagBits::eIndirectBuffer |
+              vk::BufferUsageFlagBits::eTransferDst,
+          device, vk::MemoryPropertyFlagBits::eDeviceLocal);
+      frame.DescriptorsOutdated = true;
+    }
+  }
+
+  // Copies the output, the counts and every level of the pyramid one after
+  // the other
+  void RecordReadback(Frame& frame, uint32_t const numSlots,
+                      vk::CommandBuffer const& cmdBuffer, DeviceApi& device) {
+    uint32_t const commandsSize =
+        numSlots * sizeof(vk::DrawIndexedIndirectCommand);
+    uint32_t const countsSize = numSlots * sizeof(uint32_t);
+    std::vector<vk::BufferImageCopy> levels;
+    uint32_t size = commandsSize + countsSize;
+    for (uint32_t level = 0; level < pyramid_->NumLevels; ++level) {
+      auto const extent = pyramid_->GetExtent(level);
+      levels.push_back({size,
+                        0,
+                        0,
+                        {vk::ImageAspectFlagBits::eColor, level, 0, 1},
+                        {0, 0, 0},
+                        {extent.width, extent.height, 1}});
+      size += extent.width * extent.height * sizeof(float);
+    }
+    if (!frame.Readback || frame.Readback->GetSize() < size) {
+      frame.Readback = std::make_unique<DeviceBuffer>(
+          std::bit_ceil(size), vk::BufferUsageFlagBits::eTransferDst, device);
+    }
+
+    vk::MemoryBarrier culled{vk::AccessFlagBits::eShaderWrite,
+                             vk::AccessFlagBits::eTransferRead};
+    cmdBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                              vk::PipelineStageFlagBits::eTransfer, {}, culled,
+                              nullptr, nullptr);
+    auto const& readback = frame.Readback->GetBuffer();
+    cmdBuffer.copyBuffer(frame.Output->GetBuffer(), readback,
+                         vk::BufferCopy{0, 0, commandsSize});
+    cmdBuffer.copyBuffer(frame.Counts->GetBuffer(), readback,
+                         vk::BufferCopy{0, commandsSize, countsSize});
+    cmdBuffer.copyImageToBuffer(pyramid_->Image.get(),
+                                vk::ImageLayout::eGeneral, readback, levels);
+    vk::MemoryBarrier copied{vk::AccessFlagBits::eTransferWrite,
+                             vk::AccessFlagBits::eHostRead};
+    cmdBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                              vk::PipelineStageFlagBits::eHost, {}, copied,
+                              nullptr, nullptr);
+  }
+
+  // Compares what the image's last frame culled on the device with
+  // CullDraws. The frame has completed by the time the image is recorded or
+  // uploaded again
+  void Verify(Frame& frame, DeviceApi& device) {
+    if (!frame.CheckPending) return;
+    frame.CheckPending = false;
+
+    frame.Readback->Invalidate(device);
+    auto const data = frame.Readback->GetData<std::byte>();
+    auto const numSlots = frame.CheckObjects.size();
+    auto const commandsSize = numSlots * sizeof(vk::DrawIndexedIndirectCommand);
+    auto const countsSize = numSlots * sizeof(uint32_t);
+    CullResult actual;
+    actual.Commands.resize(numSlots);
+    actual.Counts.resize(numSlots);
+    std::memcpy(actual.Commands.data(), data.data(), commandsSize);
+    std::memcpy(actual.Counts.data(), data.data() + commandsSize, countsSize);
+
+    auto const& params = frame.CheckParams;
+    vk::Extent2D const extent{params.Pyramid[0], params.Pyramid[1]};
+    size_t numTexels = 0;
+    for (uint32_t level = 0; level < params.Pyramid[2]; ++level) {
+      numTexels += size_t(std::max(extent.width >> level, 1u)) *
+                   std::max(extent.height >> level, 1u);
+    }
+    auto const levels = reinterpret_cast<float const*>(
+        data.data() + commandsSize + countsSize);
+    DepthPyramid const pyramid(std::vector<float>(levels, levels + numTexels),
+                               extent);
+
+    auto const expected = CullDraws(frame.CheckObjects, frame.CheckCommands,
+                                    params, pyramid);
+    culling_->AddVerifiedFrame(IsCullResultEqual(
+        expected, actual, frame.CheckObjects, params.Draws[1]));
+  }
+
+  // Bindings are in the order of shaders/cull.comp
+  void WriteDescriptors(ImageIndex const imageIndex, Frame& frame,
+                        DeviceApi& device) {
+    std::array<vk::DescriptorBufferInfo, 5> bufferInfos{
+        vk::DescriptorBufferInfo{frame.Params->GetBuffer(), 0,
+                                 sizeof(CullParams)},
+        vk::DescriptorBufferInfo{frame.Objects->GetBuffer(), 0, VK_WHOLE_SIZE},
+        vk::DescriptorBufferInfo{frame.Commands, 0, VK_WHOLE_SIZE},
+        vk::DescriptorBufferInfo{frame.Output->GetBuffer(), 0, VK_WHOLE_SIZE},
+        vk::DescriptorBufferInfo{frame.Counts->GetBuffer(), 0,
+                                 VK_WHOLE_SIZE}};
+    for (uint32_t binding = 0; binding < bufferInfos.size(); ++binding) {
+      // Uniform buffers are reflected as dynamic, see GetBindingsFromShader
+      vk::WriteDescriptorSet writeSet{
+          {},
+          binding,
+          0,
+          1,
+          binding == 0 ? vk::DescriptorType::eUniformBufferDynamic
+                       : vk::DescriptorType::eStorageBuffer,
+          nullptr,
+          &bufferInfos[binding]};
+      descriptorSets_.AddUpdate(0, imageIndex, writeSet);
+    }
+    vk::DescriptorImageInfo pyramidInfo{sampler_.get(), pyramid_->View.get(),
+                                        vk::ImageLayout::eGeneral};
+    vk::WriteDescriptorSet pyramidWrite{
+        {},
+        static_cast<uint32_t>(bufferInfos.size()),
+        0,
+        1,
+        vk::DescriptorType::eCombinedImageSampler,
+        &pyramidInfo};
+    descriptorSets_.AddUpdate(0, imageIndex, pyramidWrite);
+    descriptorSets_.SubmitUpdates(device);
+    frame.DescriptorsOutdated = false;
+  }
+
+ private:
+  DeviceApi* device_;
+  std::shared_ptr<DrawCulling> culling_;
+  ComputePipeline pipeline_;
+  ComputePipeline pyramidPipeline_;
+  DescriptorSets descriptorSets_;
+  vk::UniqueSampler sampler_;
+  std::vector<Frame> frames_;
+  std::unique_ptr<Pyramid> pyramid_;
+  uint32_t pyramidGeneration_ = 0;
+  bool pyramidOutdated_ = false;
+  // Whether a previous frame rendered into the pyramid's depth
+  bool depthRendered_ = false;
+  Matrix pyramidViewProjection_{};
+};
+
+}  // namespace vulkan_renderer
+
+#endif
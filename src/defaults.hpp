@@ -1,12 +1,66 @@
 #ifndef VULKAN_RENDERER_DEFAULTS_HPP
 #define VULKAN_RENDERER_DEFAULTS_HPP
 
+#include <array>
+#include <utility>
+
 #include "vulkan/vulkan.hpp"
 
+// Where the build puts the compiled shaders of the renderer, see
+// src/CMakeLists.txt
+#ifndef VULKAN_RENDERER_SHADER_DIR
+#define VULKAN_RENDERER_SHADER_DIR "shaders"
+#endif
+
 namespace vulkan_renderer::defaults {
 
 static inline uint32_t const MaxFramesInFlight = 10;
 
+// Number of rendered frames that can be waiting to be read back to the host
+static inline uint32_t const ReadbackDepth = 3;
+
+namespace memory {
+
+// Size of the device memory blocks that buffers and images are sub-allocated
+// from. Anything larger than half a block gets its own allocation
+static inline uint64_t const BlockSize = 64 * 1024 * 1024;
+
+// Initial size of the persistently mapped staging ring used for uploads. It
+// grows if a single upload does not fit
+static inline uint64_t const StagingRingSize = 32 * 1024 * 1024;
+
+// Size of the blocks that the uniform arena grows by. All uniform buffers are
+// sub-allocated from the arena, see UniformArena
+static inline uint64_t const UniformArenaSize = 4 * 1024 * 1024;
+
+// Vertices in each block of a vertex stride's geometry pool and indices in
+// each block of the index pool that all meshes are sub-allocated from. See
+// GeometryPool
+static inline uint32_t const PoolVertices = 1024 * 1024;
+static inline uint32_t const PoolIndices = 4 * 1024 * 1024;
+
+}  // namespace memory
+
+namespace descriptor {
+
+// Maximum number of sets allocated from each descriptor pool
+static inline uint32_t const SetsPerPool = 256;
+
+// Descriptors of each type per set that new pools make room for before any
+// have been allocated. Allocated types are sized from what has been seen
+static inline std::array<std::pair<vk::DescriptorType, double>, 3> const
+    PoolRatios{{{vk::DescriptorType::eUniformBufferDynamic, 1.0},
+                {vk::DescriptorType::eCombinedImageSampler, 1.0},
+                {vk::DescriptorType::eStorageBuffer, 0.5}}};
+
+// Set index and array sizes of the bindless descriptors. The sizes are limited
+// further by the device
+static inline uint32_t const BindlessSet = 1;
+static inline uint32_t const BindlessImages = 16384;
+static inline uint32_t const BindlessBuffers = 16384;
+
+}  // namespace descriptor
+
 namespace pipeline {  // Graphics Pipeline
 
 static inline vk::PipelineInputAssemblyStateCreateInfo const InputAssembly{
@@ -72,8 +126,38 @@ static inline vk::PipelineDynamicStateCreateInfo const DynamicState{
 // Layout
 static inline vk::PipelineLayoutCreateInfo const LayoutCreateInfo{{}, {}};
 
+// The device pipeline cache is loaded from and saved to this file
+static inline char const* const CacheFile = "pipeline_cache.bin";
+
 }  // namespace pipeline
 
+namespace command {
+
+// Commands with fewer ready draws than this are recorded on the calling thread
+// into the primary command buffer
+static inline uint32_t const MinDrawsPerChunk = 128;
+
+// Whether commands record their draws through an indirect buffer
+static inline bool const IndirectDraws = true;
+
+// Vertex binding of instance data, after the mesh's vertices
+static inline uint32_t const InstanceBinding = 1;
+// Offset alignment of each mesh's instances in the instance buffer
+static inline vk::DeviceSize const InstanceAlignment = 16;
+
+// Must match local_size_x in shaders/cull.comp
+static inline uint32_t const CullWorkGroupSize = 64;
+// The SPIR-V of shaders/cull.comp that the culling pass loads
+static inline char const* const CullShader =
+    VULKAN_RENDERER_SHADER_DIR "/cull.comp.spv";
+// Must match local_size_x and local_size_y in shaders/depth_pyramid.comp
+static inline uint32_t const PyramidWorkGroupSize = 8;
+// The SPIR-V of shaders/depth_pyramid.comp that builds the occlusion pyramid
+static inline char const* const PyramidShader =
+    VULKAN_RENDERER_SHADER_DIR "/depth_pyramid.comp.spv";
+
+}  // namespace command
+
 namespace render_pass {
 
 static inline vk::AttachmentDescription const ColourAttachment{
@@ -104,12 +188,13 @@ static inline vk::AttachmentDescription const ColourResolveAttachment{
 static inline vk::AttachmentReference const ColourResolveAttachmentRef{
     2, vk::ImageLayout::eColorAttachmentOptimal};
 
+// Depth is stored so the next frame can build the culling depth pyramid
 static inline vk::AttachmentDescription const DepthAttachment{
     {},
     vk::Format::eUndefined,
     vk::SampleCountFlagBits::e1,
     vk::AttachmentLoadOp::eClear,
-    vk::AttachmentStoreOp::eDontCare,
+    vk::AttachmentStoreOp::eStore,
     vk::AttachmentLoadOp::eDontCare,
     vk::AttachmentStoreOp::eDontCare,
     vk::ImageLayout::eUndefined,
@@ -145,6 +230,10 @@ static inline vk::ComponentMapping ComponentMapping(vk::ComponentSwizzle::eR,
 static inline vk::ImageSubresourceRange SubResourceRange(
     vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
 
+// Number of colour images rendered into in place of a swapchain when there is
+// no surface
+static inline uint32_t const NumOffscreenImages = 3;
+
 }  // namespace framebuffer
 
 }  // namespace vulkan_renderer::defaults
@@ -0,0 +1,184 @@
+#ifndef VULKAN_RENDERER_DESCRIPTOR_ALLOCATOR_HPP
+#define VULKAN_RENDERER_DESCRIPTOR_ALLOCATOR_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+
+#include "defaults.hpp"
+#include "vulkan/vulkan.hpp"
+
+namespace vulkan_renderer {
+
+struct DescriptorPoolStatistics {
+  uint32_t Pools = 0;
+  uint32_t FramePools = 0;
+  // Sets allocated over the lifetime of the allocator, including ones that
+  // have since been freed
+  uint64_t Sets = 0;
+  // Sets currently allocated from the frame pools
+  uint32_t FrameSets = 0;
+  // Number of times a pool ran out and another one was used
+  uint32_t Exhaustions = 0;
+};
+
+// Allocates descriptor sets from a growing list of pools. A new pool is
+// created whenever none of the existing ones have room and is sized from the
+// ratio of descriptor types that have been allocated so far.
+//
+// Frame pools are kept per swapchain image and are reset as a whole once the
+// image is no longer in flight, so sets allocated from them must only be used
+// by commands that are recorded for that frame
+class DescriptorAllocator {
+ public:
+  explicit DescriptorAllocator(
+      vk::Device const& device,
+      uint32_t const setsPerPool = defaults::descriptor::SetsPerPool)
+      : device_(device), setsPerPool_(setsPerPool) {}
+
+  DescriptorAllocator(DescriptorAllocator const&) = delete;
+  DescriptorAllocator& operator=(DescriptorAllocator const&) = delete;
+
+  // The sets are freed back to their pool when destroyed
+  std::vector<vk::UniqueDescriptorSet> Allocate(
+      std::vector<vk::DescriptorSetLayout> const& layouts,
+      std::vector<vk::DescriptorSetLayoutBinding> const& bindings) {
+    Observe(layouts.size(), bindings);
+
+    // Sets freed in older pools are reused before another pool is created.
+    // The newest pool is the most likely to have room, so it is tried first
+    for (auto pool = pools_.rbegin(); pool != pools_.rend(); ++pool) {
+      try {
+        auto sets =
+            device_.allocateDescriptorSetsUnique({pool->get(), layouts});
+        statistics_.Sets += layouts.size();
+        return sets;
+      } catch (vk::OutOfPoolMemoryError const&) {
+      } catch (vk::FragmentedPoolError const&) {
+      }
+    }
+    if (!pools_.empty()) {
+      ++statistics_.Exhaustions;
+    }
+
+    // Pools are kept for the lifetime of the allocator
+    pools_.push_back(
+        CreatePool(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet));
+    auto sets =
+        device_.allocateDescriptorSetsUnique({pools_.back().get(), layouts});
+    statistics_.Sets += layouts.size();
+    return sets;
+  }
+
+  // The sets are valid until the frame pools of the image are next reset
+  std::vector<vk::DescriptorSet> AllocateFrame(
+      uint32_t const imageIndex,
+      std::vector<vk::DescriptorSetLayout> const& layouts,
+      std::vector<vk::DescriptorSetLayoutBinding> const& bindings) {
+    Observe(layouts.size(), bindings);
+
+    if (framePools_.size() <= imageIndex) {
+      framePools_.resize(imageIndex + 1);
+    }
+    auto& frame = framePools_[imageIndex];
+
+    // Pools that ran out earlier in the frame are skipped
+    while (frame.Current < frame.Pools.size()) {
+      try {
+        auto sets = device_.allocateDescriptorSets(
+            {frame.Pools[frame.Current].get(), layouts});
+        statistics_.Sets += layouts.size();
+        frame.Sets += layouts.size();
+        return sets;
+      } catch (vk::OutOfPoolMemoryError const&) {
+      } catch (vk::FragmentedPoolError const&) {
+      }
+      ++statistics_.Exhaustions;
+      ++frame.Current;
+    }
+
+    frame.Pools.push_back(CreatePool({}));
+    auto sets = device_.allocateDescriptorSets(
+        {frame.Pools[frame.Current].get(), layouts});
+    statistics_.Sets += layouts.size();
+    frame.Sets += layouts.size();
+    return sets;
+  }
+
+  // Frees every set allocated from the image's frame pools. The pools are
+  // kept for the next frame
+  void ResetFrame(uint32_t const imageIndex) {
+    if (imageIndex >= framePools_.size()) return;
+
+    auto& frame = framePools_[imageIndex];
+    for (auto& pool : frame.Pools) {
+      device_.resetDescriptorPool(pool.get());
+    }
+    frame.Current = 0;
+    frame.Sets = 0;
+  }
+
+  DescriptorPoolStatistics GetStatistics() const {
+    auto statistics = statistics_;
+    statistics.Pools = pools_.size();
+    for (auto const& frame : framePools_) {
+      statistics.FramePools += frame.Pools.size();
+      statistics.FrameSets += frame.Sets;
+    }
+    return statistics;
+  }
+
+ protected:
+  void Observe(uint32_t const numSets,
+               std::vector<vk::DescriptorSetLayoutBinding> const& bindings) {
+    observedSets_ += numSets;
+    for (auto const& binding : bindings) {
+      observedDescriptors_[binding.descriptorType] +=
+          uint64_t(binding.descriptorCount) * numSets;
+    }
+  }
+
+  // Every type that has been allocated gets its share of the pool, and types
+  // that have not been seen yet get a small default share
+  vk::UniqueDescriptorPool CreatePool(
+      vk::DescriptorPoolCreateFlags const flags) const {
+    std::map<vk::DescriptorType, uint32_t> counts;
+    for (auto [type, perSet] : defaults::descriptor::PoolRatios) {
+      counts[type] = std::ceil(perSet * setsPerPool_);
+    }
+    for (auto [type, count] : observedDescriptors_) {
+      auto perSet = double(count) / observedSets_;
+      counts[type] =
+          std::max<uint32_t>(counts[type], std::ceil(perSet * setsPerPool_));
+    }
+
+    std::vector<vk::DescriptorPoolSize> poolSizes;
+    for (auto [type, count] : counts) {
+      poolSizes.push_back({type, count});
+    }
+    return device_.createDescriptorPoolUnique(
+        {flags, setsPerPool_, poolSizes});
+  }
+
+ private:
+  struct FramePools {
+    std::vector<vk::UniqueDescriptorPool> Pools;
+    uint32_t Current = 0;
+    uint32_t Sets = 0;
+  };
+
+  vk::Device device_;
+  uint32_t setsPerPool_;
+
+  std::vector<vk::UniqueDescriptorPool> pools_;
+  std::vector<FramePools> framePools_;
+
+  uint64_t observedSets_ = 0;
+  std::map<vk::DescriptorType, uint64_t> observedDescriptors_;
+  DescriptorPoolStatistics statistics_;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
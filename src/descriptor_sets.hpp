@@ -1,105 +1,236 @@
 #ifndef VULKAN_RENDERER_DESCRIPTOR_SETS_HPP
 #define VULKAN_RENDERER_DESCRIPTOR_SETS_HPP
 
+#include <algorithm>
+#include <map>
+
+#include "command_state.hpp"
 #include "device_api.hpp"
 #include "queues.hpp"
 #include "shader.hpp"
 
 namespace vulkan_renderer {
 
+// Bindings used by several stages are merged and every set's bindings are
+// sorted so that identical sets produce identical layouts
 inline SetBindingsMap GetCombinedBindingsFromShaders(
     std::vector<Shader> const& shaders) {
   SetBindingsMap combinedSetBindings;
   for (auto& shader : shaders) {
-    auto setBindings = shader.GetBindings();
-    for (auto& [set, bindings] : setBindings) {
-      if (combinedSetBindings.contains(set)) {
-        combinedSetBindings[set].insert(combinedSetBindings[set].end(),
-                                        bindings.begin(), bindings.end());
-      } else {
-        combinedSetBindings.insert({set, bindings});
+    for (auto& [set, bindings] : shader.GetBindings()) {
+      auto& combined = combinedSetBindings[set];
+      for (auto const& binding : bindings) {
+        auto it = std::find_if(combined.begin(), combined.end(),
+                               [&](vk::DescriptorSetLayoutBinding const& b) {
+                                 return b.binding == binding.binding;
+                               });
+        if (it == combined.end()) {
+          combined.push_back(binding);
+        } else {
+          assert(it->descriptorType == binding.descriptorType);
+          it->stageFlags |= binding.stageFlags;
+        }
       }
     }
   }
+
+  for (auto& [_, bindings] : combinedSetBindings) {
+    std::sort(bindings.begin(), bindings.end(),
+              [](vk::DescriptorSetLayoutBinding const& a,
+                 vk::DescriptorSetLayoutBinding const& b) {
+                return a.binding < b.binding;
+              });
+  }
   return combinedSetBindings;
 }
 
+// The layout and update template are owned by the device layout cache
 struct DescriptorSetLayout {
   DescriptorSetLayout(
       std::vector<vk::DescriptorSetLayoutBinding> const& bindings,
-      DeviceApi const& device)
+      DeviceApi& device)
       : Bindings(bindings),
-        Layout(device.CreateDescriptorSetLayout({{}, bindings})) {}
+        Layout(device.GetDescriptorSetLayout(bindings)),
+        UpdateTemplate(device.GetDescriptorUpdateTemplate(bindings)) {}
 
   std::vector<vk::DescriptorSetLayoutBinding> Bindings;
-  vk::UniqueDescriptorSetLayout Layout;
+  vk::DescriptorSetLayout Layout;
+  vk::DescriptorUpdateTemplate UpdateTemplate;
 };
 
+// Updates are gathered per swapchain image. Once every descriptor of an
+// image's set has been given, the set is written in one call with its update
+// template, otherwise the individual writes are submitted
 class DescriptorSets {
  public:
-  DescriptorSets(
-      std::unordered_map<uint32_t, DescriptorSetLayout> const& layouts,
-      DeviceApi const& device) {
+  DescriptorSets(std::map<uint32_t, DescriptorSetLayout> const& layouts,
+                 DeviceApi& device) {
     for (auto& [setIndex, layout] : layouts) {
-      descriptorSets_.emplace(
-          setIndex,
-          DescriptorSet{layout.Bindings, layout.Layout.get(), device});
+      descriptorSets_.push_back(DescriptorSet{setIndex, layout, device});
     }
   }
 
+  // The write's descriptor infos only need to stay valid until SubmitUpdates
   void AddUpdate(uint32_t const set, ImageIndex const imageIndex,
                  vk::WriteDescriptorSet& writeSet) {
-    assert(descriptorSets_.contains(set) &&
-           imageIndex < descriptorSets_.at(set).DescriptorSets.size());
-    writeSet.setDstSet(
-        descriptorSets_.at(set).DescriptorSets[imageIndex].get());
-    updates_.push_back(writeSet);
+    auto& descriptorSet = GetSet(set);
+    assert(imageIndex < descriptorSet.DescriptorSets.size());
+    writeSet.setDstSet(descriptorSet.DescriptorSets[imageIndex].get());
+    descriptorSet.Writes[imageIndex].push_back(writeSet);
+
+    if (descriptorSet.UpdateTemplate) {
+      auto slot = descriptorSet.BindingSlots.at(writeSet.dstBinding) +
+                  writeSet.dstArrayElement;
+      auto& data = descriptorSet.Data[imageIndex];
+      auto& written = descriptorSet.Written[imageIndex];
+      for (uint32_t i = 0; i < writeSet.descriptorCount; ++i, ++slot) {
+        assert(slot < data.size());
+        if (writeSet.pBufferInfo) {
+          data[slot].Buffer = writeSet.pBufferInfo[i];
+        } else if (writeSet.pImageInfo) {
+          data[slot].Image = writeSet.pImageInfo[i];
+        } else {
+          data[slot].TexelBufferView = writeSet.pTexelBufferView[i];
+        }
+        written[slot] = true;
+      }
+    }
+  }
+
+  // Offsets of dynamic descriptors are given when binding
+  void SetDynamicOffset(uint32_t const set, uint32_t const binding,
+                        uint32_t const offset) {
+    auto& descriptorSet = GetSet(set);
+    descriptorSet.DynamicOffsets[descriptorSet.DynamicSlots.at(binding)] =
+        offset;
   }
 
   void AddUpdate(uint32_t const set, vk::WriteDescriptorSet& writeSet) {
-    assert(descriptorSets_.contains(set));
-    for (uint32_t i = 0; i < descriptorSets_.at(set).DescriptorSets.size();
-         ++i) {
+    for (uint32_t i = 0; i < GetSet(set).DescriptorSets.size(); ++i) {
       AddUpdate(set, i, writeSet);
     }
   }
 
   void SubmitUpdates(DeviceApi const& device) {
-    if (updates_.size()) {
-      device.UpdateDescriptorSet(updates_);
-      updates_.clear();
+    std::vector<vk::WriteDescriptorSet> updates;
+    for (auto& set : descriptorSets_) {
+      for (uint32_t i = 0; i < set.DescriptorSets.size(); ++i) {
+        if (set.Writes[i].empty()) continue;
+
+        if (set.UpdateTemplate &&
+            std::all_of(set.Written[i].begin(), set.Written[i].end(),
+                        [](bool const written) { return written; })) {
+          device.UpdateDescriptorSet(set.DescriptorSets[i].get(),
+                                     set.UpdateTemplate, set.Data[i].data());
+        } else {
+          updates.insert(updates.end(), set.Writes[i].begin(),
+                         set.Writes[i].end());
+        }
+        set.Writes[i].clear();
+      }
+    }
+
+    if (updates.size()) {
+      device.UpdateDescriptorSet(updates);
+    }
+  }
+
+  // The set with the lowest index, or null if there are none
+  vk::DescriptorSet GetFirstSet(ImageIndex const imageIndex) const {
+    if (descriptorSets_.empty()) return {};
+    assert(imageIndex < descriptorSets_.front().DescriptorSets.size());
+    return descriptorSets_.front().DescriptorSets[imageIndex].get();
+  }
+
+  void Bind(ImageIndex const imageIndex, vk::PipelineLayout const& layout,
+            CommandState& state) const {
+    std::vector<DescriptorSetBinding> sets;
+    sets.reserve(descriptorSets_.size());
+    for (auto const& set : descriptorSets_) {
+      assert(imageIndex < set.DescriptorSets.size());
+      sets.push_back({set.Index, set.DescriptorSets[imageIndex].get(),
+                      set.DynamicOffsets});
     }
+    state.BindDescriptorSets(layout, sets);
   }
 
-  void Bind(ImageIndex const imageIndex, vk::CommandBuffer const& cmdBuffer,
-            vk::PipelineLayout const& layout) const {
-    for (auto& [_, set] : descriptorSets_) {
+  // For dispatches, which are not recorded through a CommandState
+  void Bind(ImageIndex const imageIndex, vk::PipelineLayout const& layout,
+            vk::PipelineBindPoint const bindPoint,
+            vk::CommandBuffer const& cmdBuffer) const {
+    for (auto const& set : descriptorSets_) {
       assert(imageIndex < set.DescriptorSets.size());
-      cmdBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, layout, 0,
-                                   {set.DescriptorSets[imageIndex].get()}, {});
+      cmdBuffer.bindDescriptorSets(bindPoint, layout, set.Index,
+                                   set.DescriptorSets[imageIndex].get(),
+                                   set.DynamicOffsets);
     }
   }
 
  private:
   struct DescriptorSet {
-    DescriptorSet(std::vector<vk::DescriptorSetLayoutBinding> const& bindings,
-                  vk::DescriptorSetLayout const& layout,
-                  DeviceApi const& device)
-        : Bindings(bindings),
-          DescriptorSets(device.AllocateDescriptorSet(layout)) {}
+    DescriptorSet(uint32_t const index, DescriptorSetLayout const& layout,
+                  DeviceApi& device)
+        : Index(index),
+          Bindings(layout.Bindings),
+          DescriptorSets(
+              device.AllocateDescriptorSet(layout.Layout, layout.Bindings)),
+          UpdateTemplate(layout.UpdateTemplate),
+          Writes(DescriptorSets.size()) {
+      // Dynamic offsets are given in binding order
+      for (auto const& binding : Bindings) {
+        if (binding.descriptorType ==
+                vk::DescriptorType::eUniformBufferDynamic ||
+            binding.descriptorType ==
+                vk::DescriptorType::eStorageBufferDynamic) {
+          DynamicSlots[binding.binding] = DynamicOffsets.size();
+          DynamicOffsets.resize(DynamicOffsets.size() +
+                                binding.descriptorCount);
+        }
+      }
+
+      if (!UpdateTemplate) return;
 
+      // Matches the offsets of GetUpdateTemplateEntries
+      uint32_t numSlots = 0;
+      for (auto const& binding : Bindings) {
+        BindingSlots[binding.binding] = numSlots;
+        numSlots += binding.descriptorCount;
+      }
+      Data.resize(DescriptorSets.size(), std::vector<DescriptorInfo>(numSlots));
+      Written.resize(DescriptorSets.size(), std::vector<bool>(numSlots));
+    }
+
+    uint32_t Index;
     std::vector<vk::DescriptorSetLayoutBinding> Bindings;
     std::vector<vk::UniqueDescriptorSet> DescriptorSets;
+    std::vector<uint32_t> DynamicOffsets;
+    std::unordered_map<uint32_t, uint32_t> DynamicSlots;
+
+    vk::DescriptorUpdateTemplate UpdateTemplate;
+    // Per swapchain image
+    std::vector<std::vector<vk::WriteDescriptorSet>> Writes;
+    std::vector<std::vector<DescriptorInfo>> Data;
+    std::vector<std::vector<bool>> Written;
+    std::unordered_map<uint32_t, uint32_t> BindingSlots;
   };
 
-  std::unordered_map<uint32_t, DescriptorSet> descriptorSets_;
-  std::vector<vk::WriteDescriptorSet> updates_;
+  DescriptorSet& GetSet(uint32_t const set) {
+    auto it = std::find_if(
+        descriptorSets_.begin(), descriptorSets_.end(),
+        [&](DescriptorSet const& descriptorSet) {
+          return descriptorSet.Index == set;
+        });
+    assert(it != descriptorSets_.end());
+    return *it;
+  }
+
+  // Ordered by set index, as CommandState::BindDescriptorSets expects
+  std::vector<DescriptorSet> descriptorSets_;
 };
 
 class DescriptorSetLayouts {
  public:
-  DescriptorSetLayouts(std::vector<Shader> const& shaders,
-                       DeviceApi const& device) {
+  DescriptorSetLayouts(std::vector<Shader> const& shaders, DeviceApi& device) {
     auto combinedSetBindings = GetCombinedBindingsFromShaders(shaders);
     for (auto& [set, bindings] : combinedSetBindings) {
       setLayouts_.emplace(set, DescriptorSetLayout{bindings, device});
@@ -109,18 +240,17 @@ class DescriptorSetLayouts {
   std::vector<vk::DescriptorSetLayout> GetLayouts() const {
     std::vector<vk::DescriptorSetLayout> layouts;
     for (auto& [_, set] : setLayouts_) {
-      layouts.push_back(set.Layout.get());
+      layouts.push_back(set.Layout);
     }
     return layouts;
   }
 
-  std::unique_ptr<DescriptorSets> CreateDescriptorSets(
-      DeviceApi const& device) {
+  std::unique_ptr<DescriptorSets> CreateDescriptorSets(DeviceApi& device) {
     return std::make_unique<DescriptorSets>(setLayouts_, device);
   }
 
  private:
-  std::unordered_map<uint32_t, DescriptorSetLayout> setLayouts_;
+  std::map<uint32_t, DescriptorSetLayout> setLayouts_;
 };
 
 }  // namespace vulkan_renderer
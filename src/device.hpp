@@ -1,16 +1,23 @@
 #ifndef VULKAN_RENDERER_DEVICE_HPP
 #define VULKAN_RENDERER_DEVICE_HPP
 
+#include <cstring>
 #include <memory>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "buffers/device_buffer.hpp"
+#include "buffers/image_buffer.hpp"
 #include "command.hpp"
 #include "device_api.hpp"
 #include "handle.hpp"
 #include "pipeline.hpp"
 #include "queues.hpp"
+#include "readback_ring.hpp"
 #include "render_pass.hpp"
 #include "semaphores.hpp"
+#include "thread_pool.hpp"
 
 namespace vulkan_renderer {
 
@@ -18,6 +25,8 @@ using RenderPassId = uint32_t;
 using RenderPassHandle = Handle<RenderPassId>;
 using CommandId = uint32_t;
 using CommandHandle = Handle<CommandId>;
+// The index of the resource in the bindless descriptor arrays
+using BindlessHandle = Handle<uint32_t>;
 
 class Device {
  public:
@@ -25,9 +34,10 @@ class Device {
          vk::PhysicalDeviceFeatures const* features,
          QueueFamilies const& queueFamilies, vk::SurfaceKHR const& surface,
          vk::Extent2D extent, vk::SurfaceFormatKHR const& surfaceFormat,
-         std::function<void()> const swapchainRecreateCallback)
+         std::function<void()> const swapchainRecreateCallback,
+         bool const bindless = false)
       : api_(physicalDevice, features, queueFamilies, surface, surfaceFormat,
-             extent),
+             extent, bindless),
         extent_(extent),
         queues_(api_, queueFamilies),
         renderSemaphores_(api_.GetNumSwapchainImages(), api_),
@@ -52,16 +62,16 @@ class Device {
   PipelineHandle CreatePipeline(PipelineSettings const& settings,
                                 RenderPassHandle const& renderPass) {
     assert(renderPasses_.contains(renderPass.Get()));
-    auto pipeline =
-        renderPasses_.at(renderPass.Get()).CreatePipeline(settings, api_);
-
-    // We need to initialise all the commands with the new pipeline
-    for (auto& [_, command] : commands_) {
-      command.UpdateDescriptorSets(
-          renderPasses_.at(renderPass.Get()).GetPipeline(pipeline.Get()), api_);
-    }
+    return renderPasses_.at(renderPass.Get()).CreatePipeline(settings, api_);
+  }
 
-    return pipeline;
+  // Compiles the pipeline on the thread pool. Draws using it only clear the
+  // render pass until it is ready
+  PipelineHandle CreatePipelineAsync(PipelineSettings const& settings,
+                                     RenderPassHandle const& renderPass) {
+    assert(renderPasses_.contains(renderPass.Get()));
+    return renderPasses_.at(renderPass.Get())
+        .CreatePipelineAsync(settings, api_, threadPool_);
   }
 
   CommandHandle AddCommand(Command&& command) {
@@ -69,17 +79,40 @@ class Device {
     auto commandId = currentCommandId++;
 
     command.Allocate(commandPool_.get(), queues_, api_);
-
-    for (auto& [_, renderPass] : renderPasses_) {
-      for (auto pipelineId : renderPass.GetPipelineIds()) {
-        command.UpdateDescriptorSets(renderPass.GetPipeline(pipelineId), api_);
-      }
-    }
-
     commands_.emplace(commandId, std::move(command));
     return {commandId, [&](CommandId const id) { RemoveCommand(id); }};
   }
 
+  // Only for bindless devices. Shaders sample the image through the handle's
+  // index into the bindless image array
+  BindlessHandle AddBindlessImage(std::vector<unsigned char> const& data,
+                                  ImageProperties const& properties) {
+    assert(api_.IsBindless());
+    auto image =
+        std::make_unique<SamplerImageBuffer>(properties, queues_, api_);
+    image->Upload(data, queues_, api_);
+    auto index = api_.RegisterBindless(image->GetImageInfo());
+    bindlessImages_.emplace(index, std::move(image));
+    return {index, [&](uint32_t const id) { RemoveBindlessImage(id); }};
+  }
+
+  // Only for bindless devices. Shaders read the buffer through the handle's
+  // index into the bindless storage buffer array
+  template <typename T>
+  BindlessHandle AddBindlessBuffer(std::vector<T> const& data) {
+    assert(api_.IsBindless());
+    assert(!data.empty());
+    auto buffer = std::make_unique<DeviceBuffer>(
+        static_cast<uint32_t>(sizeof(T) * data.size()),
+        vk::BufferUsageFlagBits::eStorageBuffer |
+            vk::BufferUsageFlagBits::eTransferDst,
+        api_, vk::MemoryPropertyFlagBits::eDeviceLocal);
+    buffer->Upload(data.data(), queues_, api_);
+    auto index = api_.RegisterBindless(buffer->GetBufferInfo());
+    bindlessBuffers_.emplace(index, std::move(buffer));
+    return {index, [&](uint32_t const id) { RemoveBindlessBuffer(id); }};
+  }
+
   void StartRender(RenderPassHandle const& renderPass) {
     assert(renderPasses_.contains(renderPass.Get()));
     currentRenderPass_ = renderPass.Get();
@@ -88,6 +121,12 @@ class Device {
     if (renderSemaphores_.WaitForRenderComplete(api_) == vk::Result::eTimeout) {
       // TODO: figure out how to handle a timeout
     }
+    api_.StartFrame();
+    // Everything uploaded since the last frame goes in a single submission
+    FlushUploads(queues_, api_);
+    uploadStatistics_ = api_.TakeUploadStatistics();
+    recordStatistics_ = std::exchange(frameRecordStatistics_, {});
+    TakeReadyPipelines();
 
     // TODO: might be mixing imageIndex with current frame
     auto const& semaphores = renderSemaphores_.GetSemphores();
@@ -96,6 +135,7 @@ class Device {
           api_.GetNextImageIndex(semaphores.WaitSemaphore.get());
 
       renderSemaphores_.WaitForImageInFlight(api_, currentImageIndex_);
+      api_.ResetFrameDescriptorSets(currentImageIndex_);
       renderPassInitialised_ = true;
     } catch (vk::OutOfDateKHRError const&) {
       if (swapchainRecreateCallback_) {
@@ -109,12 +149,14 @@ class Device {
     if (!renderPassInitialised_) return;
 
     auto& currentCommand = commands_.at(command.Get());
-    if (currentCommand.IsOutdated(currentImageIndex_)) {
-      currentCommand.Record(currentImageIndex_,
-                            renderPasses_.at(currentRenderPass_),
-                            pipeline.Get(), extent_);
+    if (currentCommand.IsOutdated(currentImageIndex_, api_)) {
+      frameRecordStatistics_ += currentCommand.Record(
+          currentImageIndex_, renderPasses_.at(currentRenderPass_),
+          pipeline.Get(), extent_, api_, threadPool_);
     }
 
+    currentCommand.RecordFrame(currentImageIndex_,
+                               renderPasses_.at(currentRenderPass_), api_);
     currentCommand.UploadUniforms(currentImageIndex_, queues_, api_);
     currentCommand.Draw(currentImageIndex_, renderSemaphores_.GetSemphores(),
                         queues_);
@@ -123,6 +165,27 @@ class Device {
   void PresentRender() {
     if (!renderPassInitialised_) return;
 
+    if (api_.IsHeadless()) {
+      // Nothing is presented but the render complete semaphore still has to be
+      // waited on before it can be signalled again. Readback copies are
+      // submitted in the same batch
+      vk::PipelineStageFlags waitStage{vk::PipelineStageFlagBits::eAllCommands};
+      vk::SubmitInfo submitInfo{
+          renderSemaphores_.GetSemphores().CompleteSemaphore.get(), waitStage,
+          {}, {}};
+      ReadbackSubmission readback;
+      if (readbackRing_) {
+        readback = readbackRing_->Submit(
+            api_.GetOffscreenImage(currentImageIndex_), numFramesRendered_);
+        submitInfo.setCommandBuffers(readback.CommandBuffer);
+      }
+      queues_.SubmitToGraphics(submitInfo, readback.Fence);
+
+      ++numFramesRendered_;
+      renderPassInitialised_ = false;
+      return;
+    }
+
     try {
       queues_.SubmitToPresent(
           currentImageIndex_, api_.GetSwapchain(),
@@ -140,6 +203,9 @@ class Device {
     WaitIdle();
     extent_ = extent;
     api_.RecreateSwapchain(surface, extent_, queues_.GetQueueFamilies());
+    if (readbackRing_) {
+      EnableReadback(readbackRing_->GetCallback(), readbackRing_->GetDepth());
+    }
     renderSemaphores_.ResizeImagesInFlightFences(api_.GetNumSwapchainImages());
 
     for (auto& [_, renderPass] : renderPasses_) {
@@ -151,17 +217,104 @@ class Device {
 
   void WaitIdle() const { api_.WaitIdle(); }
 
+  bool IsHeadless() const { return api_.IsHeadless(); }
+
+  // Hands the pixels of every frame presented from now on to the callback on
+  // a worker thread. Up to depth frames can be waiting to be read before
+  // PresentRender blocks. Only supported by headless devices
+  void EnableReadback(ReadbackCallback callback,
+                      uint32_t const depth = defaults::ReadbackDepth) {
+    assert(api_.IsHeadless() && depth > 0);
+    // The previous worker has to finish before its callback is reused
+    readbackRing_.reset();
+    readbackRing_ = std::make_unique<ReadbackRing>(
+        depth, extent_, api_.GetSurfaceFormat(), std::move(callback), api_);
+  }
+
+  // Waits for the callback to be called for every frame already presented
+  void FlushReadback() {
+    if (readbackRing_) readbackRing_->Flush();
+  }
+
+  void DisableReadback() { readbackRing_.reset(); }
+
+  // Copies the last rendered image into host memory and blocks until it is
+  // done. Only headless devices leave rendered images in a layout that can be
+  // copied from. Pixels are four bytes in the format of the render pass
+  std::vector<char> ReadRender() {
+    assert(api_.IsHeadless());
+    vk::DeviceSize const size = extent_.width * extent_.height * 4;
+    auto buffer =
+        api_.CreateBuffer(size, vk::BufferUsageFlagBits::eTransferDst);
+    auto allocation =
+        api_.AllocateMemory(buffer.get(),
+                            vk::MemoryPropertyFlagBits::eHostVisible |
+                                vk::MemoryPropertyFlagBits::eHostCoherent);
+
+    auto cmdBuffer = api_.AllocateCommandBuffer();
+    cmdBuffer->begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+
+    // Rendering was submitted earlier on the same queue
+    vk::MemoryBarrier barrier{vk::AccessFlagBits::eColorAttachmentWrite,
+                              vk::AccessFlagBits::eTransferRead};
+    cmdBuffer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        vk::PipelineStageFlagBits::eTransfer, {}, barrier, nullptr, nullptr);
+
+    vk::BufferImageCopy region{0,
+                               0,
+                               0,
+                               {vk::ImageAspectFlagBits::eColor, 0, 0, 1},
+                               {0, 0, 0},
+                               {extent_.width, extent_.height, 1}};
+    cmdBuffer->copyImageToBuffer(
+        api_.GetOffscreenImage(currentImageIndex_),
+        vk::ImageLayout::eTransferSrcOptimal, buffer.get(), region);
+    cmdBuffer->end();
+
+    auto fence = api_.CreateFence({});
+    queues_.SubmitToGraphics(cmdBuffer.get(), fence.get());
+    api_.WaitForFences({fence.get()});
+
+    std::vector<char> pixels(size);
+    api_.InvalidateMemory(allocation);
+    memcpy(pixels.data(), api_.GetMappedData(allocation), size);
+    return pixels;
+  }
+
+  // Copies, bytes and submissions of uploads during the last frame
+  UploadStatistics GetUploadStatistics() const { return uploadStatistics_; }
+
+  // State changes recorded and skipped while re-recording commands during the
+  // last frame. Commands that were not re-recorded count nothing
+  RecordStatistics GetRecordStatistics() const { return recordStatistics_; }
+
+  DescriptorPoolStatistics GetDescriptorPoolStatistics() const {
+    return api_.GetDescriptorPoolStatistics();
+  }
+
+  vk::DeviceSize GetStagingSize() const { return api_.GetStagingSize(); }
+  vk::DeviceSize GetStagingHighWaterMark() const {
+    return api_.GetStagingHighWaterMark();
+  }
+
  protected:
+  // Commands are re-recorded so that they start drawing with pipelines that
+  // finished compiling
+  void TakeReadyPipelines() {
+    for (auto& [_, renderPass] : renderPasses_) {
+      if (!renderPass.TakeReadyPipelines().empty()) {
+        for (auto& [_, command] : commands_) {
+          command.SetOutdated();
+        }
+      }
+    }
+  }
+
   void ReinitialiseCommands() {
     api_.ResetCommandPool(commandPool_);
     for (auto& [_, command] : commands_) {
       command.Allocate(commandPool_.get(), queues_, api_);
-      for (auto& [_, renderPass] : renderPasses_) {
-        for (auto pipelineId : renderPass.GetPipelineIds()) {
-          command.UpdateDescriptorSets(renderPass.GetPipeline(pipelineId),
-                                       api_);
-        }
-      }
     }
   }
 
@@ -170,6 +323,28 @@ class Device {
     commands_.erase(id);
   }
 
+  // Frames in flight may still read the resource through its index, so both
+  // are released once they have completed
+  void RemoveBindlessImage(uint32_t const index) {
+    auto it = bindlessImages_.find(index);
+    if (it == bindlessImages_.end()) return;
+    api_.Release(0, std::move(it->second));
+    bindlessImages_.erase(it);
+    api_.Defer(0, [this, index] {
+      api_.ReleaseBindless(BindlessType::Image, index);
+    });
+  }
+
+  void RemoveBindlessBuffer(uint32_t const index) {
+    auto it = bindlessBuffers_.find(index);
+    if (it == bindlessBuffers_.end()) return;
+    api_.Release(0, std::move(it->second));
+    bindlessBuffers_.erase(it);
+    api_.Defer(0, [this, index] {
+      api_.ReleaseBindless(BindlessType::Buffer, index);
+    });
+  }
+
   void RemoveRenderPass(RenderPassId const id) {
     WaitIdle();
     ReinitialiseCommands();
@@ -185,11 +360,21 @@ class Device {
   std::unordered_map<RenderPassId, RenderPass> renderPasses_;
   vk::UniqueCommandPool commandPool_;
   std::unordered_map<CommandId, Command> commands_;
+  std::unordered_map<uint32_t, std::unique_ptr<SamplerImageBuffer>>
+      bindlessImages_;
+  std::unordered_map<uint32_t, std::unique_ptr<DeviceBuffer>> bindlessBuffers_;
   std::function<void()> swapchainRecreateCallback_;
 
   bool renderPassInitialised_ = false;
   RenderPassId currentRenderPass_;
   ImageIndex currentImageIndex_;
+  UploadStatistics uploadStatistics_;
+  RecordStatistics recordStatistics_;
+  RecordStatistics frameRecordStatistics_;
+  uint64_t numFramesRendered_ = 0;
+  std::unique_ptr<ReadbackRing> readbackRing_;
+  // Destroyed first so nothing is compiling while the rest is torn down
+  ThreadPool threadPool_;
 };
 
 }  // namespace vulkan_renderer
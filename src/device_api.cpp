@@ -1,6 +1,10 @@
 
 #include "device_api.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <limits>
 
 namespace vulkan_renderer {
@@ -8,14 +12,33 @@ namespace vulkan_renderer {
 void DeviceApi::RecreateSwapchain(vk::SurfaceKHR const& surface,
                                   vk::Extent2D& extent,
                                   QueueFamilies const& queueFamilies) {
+  if (IsHeadless()) {
+    CreateOffscreenImages(extent);
+    return;
+  }
   swapchain_ =
       CreateSwapchain(surface, extent, queueFamilies, swapchain_.get());
 }
 
 uint32_t DeviceApi::GetNumSwapchainImages() const {
+  if (IsHeadless()) {
+    return defaults::framebuffer::NumOffscreenImages;
+  }
   return device_->getSwapchainImagesKHR(swapchain_.get()).size();
 }
 
+std::vector<vk::Image> DeviceApi::GetSwapchainImages() const {
+  if (!IsHeadless()) {
+    return device_->getSwapchainImagesKHR(swapchain_.get());
+  }
+
+  std::vector<vk::Image> images;
+  for (auto const& offscreenImage : offscreenImages_) {
+    images.push_back(offscreenImage.Image.get());
+  }
+  return images;
+}
+
 vk::Format DeviceApi::GetDepthBufferFormat(
     vk::ImageTiling tiling, vk::FormatFeatureFlags features) const {
   std::vector<vk::Format> candidateFormats{vk::Format::eD32Sfloat,
@@ -36,6 +59,15 @@ vk::Format DeviceApi::GetDepthBufferFormat(
 }
 
 ImageIndex DeviceApi::GetNextImageIndex(vk::Semaphore const& semaphore) {
+  if (IsHeadless()) {
+    // Stands in for the acquire by signalling the semaphore that rendering
+    // waits on. The caller waits for the image to be out of flight
+    GetQueue(graphicsFamily_, 0).submit(vk::SubmitInfo{{}, {}, {}, semaphore},
+                                        {});
+    offscreenImageIndex_ = (offscreenImageIndex_ + 1) % offscreenImages_.size();
+    return offscreenImageIndex_;
+  }
+
   uint32_t imageIndex;
   auto result = device_->acquireNextImageKHR(swapchain_.get(), UINT64_MAX,
                                              semaphore, nullptr, &imageIndex);
@@ -106,6 +138,23 @@ vk::UniqueCommandBuffer DeviceApi::AllocateCommandBuffer(
           .front());
 }
 
+UploadCommands DeviceApi::BeginUpload() const {
+  UploadCommands commands;
+  commands.Transfer = std::move(
+      device_
+          ->allocateCommandBuffersUnique(
+              {transferCommandPool_.get(), vk::CommandBufferLevel::ePrimary, 1})
+          .front());
+  commands.Transfer->begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+
+  if (dedicatedTransfer_) {
+    commands.Graphics = AllocateCommandBuffer();
+    commands.Graphics->begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    commands.Released = CreateSemaphore();
+  }
+  return commands;
+}
+
 std::vector<vk::CommandBuffer> DeviceApi::AllocateCommandBuffers(
     vk::CommandBufferLevel const bufferLevel, uint32_t const numBuffers,
     vk::CommandPool const& pool) const {
@@ -120,19 +169,6 @@ vk::UniqueShaderModule DeviceApi::CreateShaderModule(
        reinterpret_cast<const uint32_t*>(shaderFile.data())});
 }
 
-vk::UniqueDescriptorSetLayout DeviceApi::CreateDescriptorSetLayout(
-    vk::DescriptorSetLayoutCreateInfo const& settings) const {
-  if (settings.bindingCount > 0) {
-    return device_->createDescriptorSetLayoutUnique(settings);
-  }
-  return {};
-}
-
-vk::UniquePipelineLayout DeviceApi::CreatePipelineLayout(
-    vk::PipelineLayoutCreateInfo const& settings) const {
-  return device_->createPipelineLayoutUnique(settings);
-}
-
 vk::UniquePipelineCache DeviceApi::CreatePipelineCache(
     vk::PipelineCacheCreateInfo const& settings) const {
   return device_->createPipelineCacheUnique(settings);
@@ -143,31 +179,64 @@ vk::UniqueRenderPass DeviceApi::CreateRenderpass(
   return device_->createRenderPassUnique(settings);
 }
 
+vk::UniquePipelineCache DeviceApi::LoadPipelineCache(
+    std::string const& path) const {
+  std::vector<char> data;
+  std::ifstream file(path, std::ios::ate | std::ios::binary);
+  if (file.is_open()) {
+    data.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(data.data(), data.size());
+  }
+
+  // Drivers should reject data from other devices but not all of them do
+  if (!file ||
+      !IsPipelineCacheCompatible(data, physicalDevice_.getProperties())) {
+    data.clear();
+  }
+  return CreatePipelineCache({{}, data.size(), data.data()});
+}
+
+void DeviceApi::SavePipelineCache() const {
+  if (pipelineCachePath_.empty()) return;
+
+  try {
+    auto data = device_->getPipelineCacheData(pipelineCache_.get());
+
+    // Written to a temporary file first so a partial write never replaces a
+    // good cache
+    auto tempPath = pipelineCachePath_ + ".tmp";
+    {
+      std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+      file.write(reinterpret_cast<char const*>(data.data()), data.size());
+      if (!file) return;
+    }
+    std::filesystem::rename(tempPath, pipelineCachePath_);
+  } catch (std::exception const&) {
+    // Failing to save only costs compile time on the next start
+  }
+}
+
 vk::UniquePipeline DeviceApi::CreatePipeline(
-    vk::UniquePipelineCache const& cache,
     vk::GraphicsPipelineCreateInfo const& settings) const {
-  auto result = device_->createGraphicsPipelineUnique(cache.get(), settings);
+  auto result =
+      device_->createGraphicsPipelineUnique(pipelineCache_.get(), settings);
   // TODO: check result is ok
   return std::move(result.value);
 }
 
-vk::UniqueDescriptorPool DeviceApi::CreateDescriptorPool() const {
-  // TODO: move descriptor pools to pipeline. They should be created once the
-  // shader has been created
-  auto descriptorSizes = std::vector<vk::DescriptorPoolSize>(
-      {{vk::DescriptorType::eUniformBuffer, GetNumSwapchainImages()},
-       {vk::DescriptorType::eCombinedImageSampler, GetNumSwapchainImages()}});
-  // TODO: figure out a how to decide the number
-  return device_->createDescriptorPoolUnique(
-      {vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet, 1000,
-       descriptorSizes});
+vk::UniquePipeline DeviceApi::CreatePipeline(
+    vk::ComputePipelineCreateInfo const& settings) const {
+  auto result =
+      device_->createComputePipelineUnique(pipelineCache_.get(), settings);
+  return std::move(result.value);
 }
 
 std::vector<vk::UniqueImageView> DeviceApi::CreateSwapchainImageViews(
     vk::ComponentMapping const& componentMapping,
     vk::ImageSubresourceRange const& subResourceRange) {
   std::vector<vk::UniqueImageView> imageViews;
-  for (auto& image : device_->getSwapchainImagesKHR(swapchain_.get())) {
+  for (auto& image : GetSwapchainImages()) {
     imageViews.push_back(CreateImageView(image, vk::ImageViewType::e2D,
                                          surfaceFormat_.format,
                                          componentMapping, subResourceRange));
@@ -231,12 +300,8 @@ void DeviceApi::BindBufferMemory(vk::Buffer const& buffer,
   device_->bindBufferMemory(buffer, memory, offset);
 }
 
-void* DeviceApi::MapMemory(Allocation const& allocation) const {
-  return allocator_.MapMemory(allocation, device_.get());
-}
-
-void DeviceApi::UnmapMemory(Allocation const& allocation) const {
-  allocator_.UnmapMemory(allocation, device_.get());
+void* DeviceApi::GetMappedData(Allocation const& allocation) const {
+  return allocator_.GetMappedData(allocation);
 }
 
 uint64_t DeviceApi::GetMemoryOffset(Allocation const& allocation) const {
@@ -244,10 +309,10 @@ uint64_t DeviceApi::GetMemoryOffset(Allocation const& allocation) const {
 }
 
 std::vector<vk::UniqueDescriptorSet> DeviceApi::AllocateDescriptorSet(
-    vk::DescriptorSetLayout const& layout) const {
+    vk::DescriptorSetLayout const& layout,
+    std::vector<vk::DescriptorSetLayoutBinding> const& bindings) {
   std::vector<vk::DescriptorSetLayout> layouts(GetNumSwapchainImages(), layout);
-  return device_->allocateDescriptorSetsUnique(
-      {descriptorPool_.get(), layouts});
+  return descriptorAllocator_.Allocate(layouts, bindings);
 }
 
 void DeviceApi::UpdateDescriptorSet(
@@ -270,8 +335,9 @@ vk::UniqueSwapchainKHR DeviceApi::CreateSwapchain(
       {}, SelectPreTransform(capabilities), SelectCompositeAlpha(capabilities),
       SelectPresentMode(physicalDevice_, surface), true, oldSwapchain);
 
+  // Must outlive the create call as the create info only points at it
+  auto queueIndices = queueFamilies.PresentationIndices();
   if (!queueFamilies.IsUniqueFamilies()) {
-    auto queueIndices = queueFamilies.UniqueIndices();
     swapChainCreateInfo.imageSharingMode = vk::SharingMode::eConcurrent;
     swapChainCreateInfo.setQueueFamilyIndices(queueIndices);
   }
@@ -279,6 +345,27 @@ vk::UniqueSwapchainKHR DeviceApi::CreateSwapchain(
   return device_->createSwapchainKHRUnique(swapChainCreateInfo);
 }
 
+void DeviceApi::CreateOffscreenImages(vk::Extent2D const& extent) {
+  offscreenImages_.clear();
+  for (uint32_t i = 0; i < defaults::framebuffer::NumOffscreenImages; ++i) {
+    auto image = device_->createImageUnique(
+        {{},
+         vk::ImageType::e2D,
+         surfaceFormat_.format,
+         {extent.width, extent.height, 1},
+         1,
+         1,
+         vk::SampleCountFlagBits::e1,
+         vk::ImageTiling::eOptimal,
+         vk::ImageUsageFlagBits::eColorAttachment |
+             vk::ImageUsageFlagBits::eTransferSrc});
+    auto memory = allocator_.Allocate(
+        image.get(), vk::MemoryPropertyFlagBits::eDeviceLocal, device_.get());
+    offscreenImages_.push_back({std::move(memory), std::move(image)});
+  }
+  offscreenImageIndex_ = 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Helper functions
 ////////////////////////////////////////////////////////////////////////////////
@@ -287,15 +374,102 @@ vk::UniqueDevice CreateVulkanDevice(
     vk::PhysicalDevice const& physicalDevice,
     std::vector<uint32_t> const& queueFamilyIndices,
     std::vector<char const*> const& extensions,
-    vk::PhysicalDeviceFeatures const* features) {
+    vk::PhysicalDeviceFeatures const* features, bool const bindless) {
   std::vector<vk::DeviceQueueCreateInfo> deviceQueueCreateInfos;
   float queuePriority = 1.0f;
   for (auto const& queueFamilyIndex : queueFamilyIndices) {
     deviceQueueCreateInfos.push_back({{}, queueFamilyIndex, 1, &queuePriority});
   }
 
-  return physicalDevice.createDeviceUnique(
-      {{}, deviceQueueCreateInfos, {}, extensions, features});
+  auto deviceExtensions = extensions;
+  // Used when available with a fallback otherwise
+  if (IsExtensionSupported(physicalDevice,
+                           VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME)) {
+    deviceExtensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+  }
+  vk::PhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures;
+  if (bindless) {
+    deviceExtensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+    indexingFeatures.shaderSampledImageArrayNonUniformIndexing = true;
+    indexingFeatures.shaderStorageBufferArrayNonUniformIndexing = true;
+    indexingFeatures.descriptorBindingSampledImageUpdateAfterBind = true;
+    indexingFeatures.descriptorBindingStorageBufferUpdateAfterBind = true;
+    indexingFeatures.descriptorBindingUpdateUnusedWhilePending = true;
+    indexingFeatures.descriptorBindingPartiallyBound = true;
+    indexingFeatures.runtimeDescriptorArray = true;
+  }
+
+  vk::DeviceCreateInfo createInfo{
+      {}, deviceQueueCreateInfos, {}, deviceExtensions, features};
+  if (bindless) {
+    createInfo.setPNext(&indexingFeatures);
+  }
+  return physicalDevice.createDeviceUnique(createInfo);
+}
+
+bool IsExtensionSupported(vk::PhysicalDevice const& physicalDevice,
+                          char const* extensionName) {
+  auto extensions = physicalDevice.enumerateDeviceExtensionProperties();
+  return std::any_of(extensions.begin(), extensions.end(),
+                     [&](vk::ExtensionProperties const& extension) {
+                       return strcmp(extension.extensionName, extensionName) ==
+                              0;
+                     });
+}
+
+bool IsBindlessSupported(vk::PhysicalDevice const& physicalDevice) {
+  if (!IsExtensionSupported(physicalDevice,
+                            VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME)) {
+    return false;
+  }
+
+  auto features = physicalDevice.getFeatures2<
+      vk::PhysicalDeviceFeatures2,
+      vk::PhysicalDeviceDescriptorIndexingFeaturesEXT>();
+  auto const& indexing =
+      features.get<vk::PhysicalDeviceDescriptorIndexingFeaturesEXT>();
+  return indexing.shaderSampledImageArrayNonUniformIndexing &&
+         indexing.shaderStorageBufferArrayNonUniformIndexing &&
+         indexing.descriptorBindingSampledImageUpdateAfterBind &&
+         indexing.descriptorBindingStorageBufferUpdateAfterBind &&
+         indexing.descriptorBindingUpdateUnusedWhilePending &&
+         indexing.descriptorBindingPartiallyBound &&
+         indexing.runtimeDescriptorArray;
+}
+
+IndirectDrawSupport QueryIndirectDrawSupport(
+    vk::PhysicalDevice const& physicalDevice,
+    vk::PhysicalDeviceFeatures const* features) {
+  IndirectDrawSupport support;
+  if (features) {
+    support.MultiDraw = features->multiDrawIndirect;
+    support.FirstInstance = features->drawIndirectFirstInstance;
+  }
+  support.DrawCount = IsExtensionSupported(
+      physicalDevice, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+  if (support.MultiDraw) {
+    support.MaxDrawCount =
+        physicalDevice.getProperties().limits.maxDrawIndirectCount;
+  }
+  return support;
+}
+
+bool IsPipelineCacheCompatible(
+    std::vector<char> const& data,
+    vk::PhysicalDeviceProperties const& properties) {
+  // Header size, header version, vendor ID and device ID followed by the
+  // pipeline cache UUID (VkPipelineCacheHeaderVersionOne)
+  uint32_t header[4];
+  if (data.size() < sizeof(header) + VK_UUID_SIZE) return false;
+  memcpy(header, data.data(), sizeof(header));
+
+  return header[0] >= sizeof(header) + VK_UUID_SIZE &&
+         header[1] == static_cast<uint32_t>(
+                          vk::PipelineCacheHeaderVersion::eOne) &&
+         header[2] == properties.vendorID &&
+         header[3] == properties.deviceID &&
+         memcmp(data.data() + sizeof(header),
+                properties.pipelineCacheUUID.data(), VK_UUID_SIZE) == 0;
 }
 
 // TODO: Move to a utils file if needed elsewhere
@@ -1,50 +1,138 @@
 #ifndef VULKAN_RENDERER_DEVICE_API_HPP
 #define VULKAN_RENDERER_DEVICE_API_HPP
 
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+#include "bindless.hpp"
+#include "command_state.hpp"
 #include "defaults.hpp"
+#include "descriptor_allocator.hpp"
 #include "framebuffer.hpp"
+#include "geometry_pool.hpp"
+#include "layout_cache.hpp"
 #include "memory.hpp"
+#include "release_queue.hpp"
+#include "staging_ring.hpp"
+#include "uniform_arena.hpp"
 #include "utils.hpp"
 #include "vulkan/vulkan.hpp"
 
 namespace vulkan_renderer {
 
+// Bindless devices also enable descriptor indexing. See BindlessDescriptors
 vk::UniqueDevice CreateVulkanDevice(
     vk::PhysicalDevice const& physicalDevice,
     std::vector<uint32_t> const& queueFamilyIndices,
     std::vector<char const*> const& extensions,
+    vk::PhysicalDeviceFeatures const* features, bool const bindless);
+
+bool IsExtensionSupported(vk::PhysicalDevice const& physicalDevice,
+                          char const* extensionName);
+
+bool IsBindlessSupported(vk::PhysicalDevice const& physicalDevice);
+
+// Only features that were enabled on the device count as supported
+IndirectDrawSupport QueryIndirectDrawSupport(
+    vk::PhysicalDevice const& physicalDevice,
     vk::PhysicalDeviceFeatures const* features);
 
 inline std::vector<char const*> extensions{VK_KHR_SWAPCHAIN_EXTENSION_NAME};
 
 using ImageIndex = uint32_t;
 
+// Rendered into in place of swapchain images by headless devices
+struct OffscreenImage {
+  Allocation Memory;
+  vk::UniqueImage Image;
+};
+
+// A null surface creates a headless device that renders into offscreen images
+// instead of a swapchain
 class DeviceApi {
  public:
   DeviceApi(vk::PhysicalDevice const& physicalDevice,
             vk::PhysicalDeviceFeatures const* features,
             QueueFamilies const& queueFamilies, vk::SurfaceKHR const& surface,
-            vk::SurfaceFormatKHR const& surfaceFormat, vk::Extent2D& extent)
+            vk::SurfaceFormatKHR const& surfaceFormat, vk::Extent2D& extent,
+            bool const bindless = false)
       : physicalDevice_(physicalDevice),
-        device_(CreateVulkanDevice(physicalDevice_,
-                                   queueFamilies.UniqueIndices(), extensions,
-                                   features)),
+        device_(CreateVulkanDevice(
+            physicalDevice_, queueFamilies.UniqueIndices(),
+            surface ? extensions : std::vector<char const*>{}, features,
+            bindless)),
         surfaceFormat_(surfaceFormat),
-        swapchain_(CreateSwapchain(surface, extent, queueFamilies, {})),
+        swapchain_(surface
+                       ? CreateSwapchain(surface, extent, queueFamilies, {})
+                       : vk::UniqueSwapchainKHR{}),
         commandPool_(CreateCommandPool(
             vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
             queueFamilies.Graphics())),
-        descriptorPool_(CreateDescriptorPool()),
-        allocator_(physicalDevice_) {}
+        transferCommandPool_(CreateCommandPool(
+            vk::CommandPoolCreateFlagBits::eResetCommandBuffer |
+                vk::CommandPoolCreateFlagBits::eTransient,
+            queueFamilies.Transfer())),
+        graphicsFamily_(queueFamilies.Graphics()),
+        transferFamily_(queueFamilies.Transfer()),
+        dedicatedTransfer_(queueFamilies.HasDedicatedTransfer()),
+        indirectSupport_(QueryIndirectDrawSupport(physicalDevice_, features)),
+        descriptorAllocator_(device_.get()),
+        layoutCache_(device_.get(),
+                     physicalDevice_.getProperties().apiVersion >=
+                         VK_API_VERSION_1_1),
+        bindless_(bindless ? std::make_unique<BindlessDescriptors>(
+                                 physicalDevice_, device_.get())
+                           : nullptr),
+        pipelineCachePath_(defaults::pipeline::CacheFile),
+        pipelineCache_(LoadPipelineCache(pipelineCachePath_)),
+        allocator_(physicalDevice_),
+        stagingRing_(defaults::memory::StagingRingSize, allocator_,
+                     device_.get()),
+        uniformArena_(defaults::memory::UniformArenaSize,
+                      physicalDevice_.getProperties()
+                          .limits.minUniformBufferOffsetAlignment,
+                      allocator_, device_.get()) {
+    if (!surface) {
+      CreateOffscreenImages(extent);
+    }
+  }
+
+  // Released resources are only destroyed once the device is idle
+  ~DeviceApi() {
+    WaitIdle();
+    releases_.Clear();
+    SavePipelineCache();
+  }
+
+  DeviceApi(DeviceApi const&) = delete;
+  DeviceApi& operator=(DeviceApi const&) = delete;
 
   void RecreateSwapchain(vk::SurfaceKHR const& surface, vk::Extent2D& extent,
                          QueueFamilies const& queueFamilies);
 
   vk::SwapchainKHR const& GetSwapchain() { return swapchain_.get(); }
 
+  bool IsHeadless() const { return !swapchain_; }
+
+  // The layout that rendered images are left in for presentation, or for
+  // copying out of when headless
+  vk::ImageLayout GetPresentLayout() const {
+    return IsHeadless() ? vk::ImageLayout::eTransferSrcOptimal
+                        : vk::ImageLayout::ePresentSrcKHR;
+  }
+
+  // These are the offscreen images when headless
   uint32_t GetNumSwapchainImages() const;
+  std::vector<vk::Image> GetSwapchainImages() const;
+
+  vk::Image GetOffscreenImage(ImageIndex const imageIndex) const {
+    assert(imageIndex < offscreenImages_.size());
+    return offscreenImages_[imageIndex].Image.get();
+  }
   vk::Format GetSurfaceFormat() const { return surfaceFormat_.format; }
 
   vk::Format GetDepthBufferFormat(
@@ -64,6 +152,13 @@ class DeviceApi {
            vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
   }
 
+  bool IsSampledImageSupported(vk::Format const format) const {
+    auto formatProperties = physicalDevice_.getFormatProperties(format);
+    return (formatProperties.optimalTilingFeatures &
+            vk::FormatFeatureFlagBits::eSampledImage) ==
+           vk::FormatFeatureFlagBits::eSampledImage;
+  }
+
   vk::SampleCountFlagBits GetMaxMultiSamplingCount() const;
 
   //////////////////////////////////////////////////////////////////////////
@@ -109,25 +204,45 @@ class DeviceApi {
   vk::UniqueShaderModule CreateShaderModule(
       std::vector<char> const& shaderFile) const;
 
-  vk::UniqueDescriptorSetLayout CreateDescriptorSetLayout(
-      vk::DescriptorSetLayoutCreateInfo const& settings) const;
+  // Identical bindings share one layout. See LayoutCache
+  vk::DescriptorSetLayout GetDescriptorSetLayout(
+      std::vector<vk::DescriptorSetLayoutBinding> const& bindings) {
+    return layoutCache_.GetDescriptorSetLayout(bindings);
+  }
+
+  // Null when the device does not support update templates
+  vk::DescriptorUpdateTemplate GetDescriptorUpdateTemplate(
+      std::vector<vk::DescriptorSetLayoutBinding> const& bindings) {
+    return layoutCache_.GetDescriptorUpdateTemplate(bindings);
+  }
 
   ////////////////////////////////////////////////////////////////////////
   // Pipeline Creation
   ////////////////////////////////////////////////////////////////////////
-  vk::UniquePipelineLayout CreatePipelineLayout(
-      vk::PipelineLayoutCreateInfo const&) const;
+  vk::PipelineLayout GetPipelineLayout(
+      std::vector<vk::DescriptorSetLayout> const& setLayouts,
+      std::vector<vk::PushConstantRange> const& pushConstants) {
+    return layoutCache_.GetPipelineLayout(setLayouts, pushConstants);
+  }
 
   vk::UniquePipelineCache CreatePipelineCache(
       vk::PipelineCacheCreateInfo const&) const;
 
+  // Seeds a pipeline cache with the file contents if they were written by
+  // this device and driver, otherwise the cache starts empty
+  vk::UniquePipelineCache LoadPipelineCache(std::string const& path) const;
+
+  // Writes the device pipeline cache to the file it was loaded from. This is
+  // done on destruction
+  void SavePipelineCache() const;
+
   vk::UniqueRenderPass CreateRenderpass(vk::RenderPassCreateInfo const&) const;
 
+  // All pipelines share the device pipeline cache
   vk::UniquePipeline CreatePipeline(
-      vk::UniquePipelineCache const& cache,
       vk::GraphicsPipelineCreateInfo const& settings) const;
-
-  vk::UniqueDescriptorPool CreateDescriptorPool() const;
+  vk::UniquePipeline CreatePipeline(
+      vk::ComputePipelineCreateInfo const& settings) const;
 
   std::vector<vk::UniqueImageView> CreateSwapchainImageViews(
       vk::ComponentMapping const& componentMapping =
@@ -170,9 +285,10 @@ class DeviceApi {
   Allocation AllocateMemory(vk::Buffer const& buffer,
                             vk::MemoryPropertyFlags const flags);
 
-  Allocation AllocateMemory(vk::Image const& image,
-                            vk::MemoryPropertyFlags const flags) {
-    return allocator_.Allocate(image, flags, device_.get());
+  Allocation AllocateMemory(
+      vk::Image const& image, vk::MemoryPropertyFlags const flags,
+      vk::ImageTiling const tiling = vk::ImageTiling::eOptimal) {
+    return allocator_.Allocate(image, flags, device_.get(), tiling);
   }
 
   void DeallocateMemory(Allocation const&);
@@ -181,22 +297,251 @@ class DeviceApi {
                         vk::DeviceMemory const& memory,
                         vk::DeviceSize const offset) const;
 
-  void* MapMemory(Allocation const&) const;
+  // Host visible allocations stay mapped for their lifetime
+  void* GetMappedData(Allocation const&) const;
 
-  void UnmapMemory(Allocation const&) const;
+  void FlushMemory(Allocation const& allocation) const {
+    allocator_.FlushMemory(allocation, device_.get());
+  }
+
+  void InvalidateMemory(Allocation const& allocation) const {
+    allocator_.InvalidateMemory(allocation, device_.get());
+  }
+
+  bool IsMemoryTypeSupported(vk::Buffer const& buffer,
+                             vk::MemoryPropertyFlags const flags) const {
+    return allocator_.HasMemoryType(
+        device_->getBufferMemoryRequirements(buffer).memoryTypeBits, flags);
+  }
 
   uint64_t GetMemoryOffset(Allocation const&) const;
 
+  //////////////////////////////////////////////////////////////////////////////
+  // Staging
+  //////////////////////////////////////////////////////////////////////////////
+
+  StagingRegion WriteStagingData(void const* data, vk::DeviceSize const size,
+                                 vk::DeviceSize const alignment = 16) {
+    return stagingRing_.Write(data, size, alignment);
+  }
+
+  bool IsStagingFull(vk::DeviceSize const size,
+                     vk::DeviceSize const alignment = 16) const {
+    return stagingRing_.NeedsSubmit(size, alignment);
+  }
+
+  // Begins the command buffers for copying staging data. See UploadCommands
+  UploadCommands BeginUpload() const;
+
+  // All copies are recorded into one set of upload commands that is
+  // submitted once per frame. Everything recorded completes with the same
+  // token
+  UploadCommands& GetPendingUpload() {
+    if (!pendingUpload_.Transfer) {
+      pendingUpload_ = BeginUpload();
+    }
+    return pendingUpload_;
+  }
+
+  bool HasPendingUpload() const { return bool(pendingUpload_.Transfer); }
+
+  UploadCommands TakePendingUpload() {
+    return std::exchange(pendingUpload_, {});
+  }
+
+  UploadToken GetPendingUploadToken() const {
+    return stagingRing_.GetNextToken();
+  }
+
+  // Returns the fence that the copies from the written staging data must
+  // signal and the token that can be used to check for their completion
+  UploadSubmission SubmitStagingData(UploadCommands&& commands) {
+    ++uploadStatistics_.Submits;
+    return stagingRing_.Submit(std::move(commands));
+  }
+
+  void CountUpload(vk::DeviceSize const bytes) {
+    ++uploadStatistics_.Copies;
+    uploadStatistics_.Bytes += bytes;
+  }
+
+  // Returns the statistics since the last call
+  UploadStatistics TakeUploadStatistics() {
+    return std::exchange(uploadStatistics_, {});
+  }
+
+  bool HasDedicatedTransfer() const { return dedicatedTransfer_; }
+
+  IndirectDrawSupport const& GetIndirectDrawSupport() const {
+    return indirectSupport_;
+  }
+  uint32_t GetGraphicsFamily() const { return graphicsFamily_; }
+  uint32_t GetTransferFamily() const { return transferFamily_; }
+
+  // Called at the start of every frame once the fence of the frame
+  // MaxFramesInFlight frames ago has been waited on
+  void StartFrame() {
+    releases_.StartFrame();
+    ReclaimStagingData();
+  }
+
+  // Also runs the releases whose uploads and frames have completed
+  void ReclaimStagingData() {
+    stagingRing_.Reclaim();
+    releases_.Collect([&](UploadToken const token) {
+      return stagingRing_.IsComplete(token);
+    });
+  }
+
+  // Keeps the resources alive until the frames in flight and the uploads up
+  // to the token have completed, as they may still be reading or writing them
+  template <class... Resources>
+  void Release(UploadToken const token, Resources&&... resources) {
+    auto held = std::make_shared<std::tuple<std::decay_t<Resources>...>>(
+        std::forward<Resources>(resources)...);
+    releases_.Push(token, [held] {});
+  }
+
+  // Runs the callback once the frames in flight and the uploads up to the
+  // token have completed
+  void Defer(UploadToken const token, std::function<void()>&& callback) {
+    releases_.Push(token, std::move(callback));
+  }
+
+  bool IsUploadComplete(UploadToken const token) const {
+    return stagingRing_.IsComplete(token);
+  }
+
+  void WaitForUpload(UploadToken const token) { stagingRing_.Wait(token); }
+
+  vk::DeviceSize GetStagingSize() const { return stagingRing_.GetSize(); }
+  vk::DeviceSize GetStagingHighWaterMark() const {
+    return stagingRing_.GetHighWaterMark();
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Uniforms
+  //////////////////////////////////////////////////////////////////////////////
+
+  // Uniform data has the same offset in every swapchain image's uniform
+  // buffer. See UniformArena
+  Allocation AllocateUniform(vk::DeviceSize const size) {
+    return uniformArena_.Allocate(size);
+  }
+
+  uint32_t GetUniformOffset(Allocation const& allocation) const {
+    return uniformArena_.GetOffset(allocation);
+  }
+
+  // The arena grows in blocks so uniforms may be in different buffers
+  vk::Buffer GetUniformBuffer(ImageIndex const imageIndex,
+                              Allocation const& allocation) {
+    return uniformArena_.GetBuffer(imageIndex, allocation);
+  }
+
+  void* GetUniformData(ImageIndex const imageIndex,
+                       Allocation const& allocation) {
+    return uniformArena_.GetData(imageIndex, allocation);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Geometry
+  //////////////////////////////////////////////////////////////////////////////
+
+  // Meshes with the same vertex stride share a vertex pool and every mesh
+  // shares the index pool. Pools are created the first time they are used and
+  // grow by a block when full
+  GeometryPool& GetVertexPool(uint32_t const stride) {
+    auto& pool = vertexPools_[stride];
+    if (!pool) {
+      pool = std::make_unique<GeometryPool>(
+          stride, defaults::memory::PoolVertices,
+          vk::BufferUsageFlagBits::eVertexBuffer, allocator_, releases_,
+          device_.get());
+    }
+    return *pool;
+  }
+
+  GeometryPool& GetIndexPool() {
+    if (!indexPool_) {
+      indexPool_ = std::make_unique<GeometryPool>(
+          sizeof(uint32_t), defaults::memory::PoolIndices,
+          vk::BufferUsageFlagBits::eIndexBuffer, allocator_, releases_,
+          device_.get());
+    }
+    return *indexPool_;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Bindless
+  //////////////////////////////////////////////////////////////////////////////
+
+  bool IsBindless() const { return bool(bindless_); }
+
+  vk::DescriptorSetLayout GetBindlessLayout() const {
+    assert(bindless_);
+    return bindless_->GetLayout();
+  }
+
+  vk::DescriptorSet GetBindlessSet() const {
+    assert(bindless_);
+    return bindless_->GetSet();
+  }
+
+  bool IsBindlessBinding(vk::DescriptorSetLayoutBinding const& binding) const {
+    assert(bindless_);
+    return bindless_->IsCompatible(binding);
+  }
+
+  // Returns the index of the resource in its bindless array
+  template <class Info>
+  uint32_t RegisterBindless(Info const& info) {
+    assert(bindless_);
+    return bindless_->Register(info);
+  }
+
+  void ReleaseBindless(BindlessType const type, uint32_t const index) {
+    assert(bindless_);
+    bindless_->Release(type, index);
+  }
+
   //////////////////////////////////////////////////////////////////////////////
   // Shader Data
   //////////////////////////////////////////////////////////////////////////////
 
+  // Allocates a set for every swapchain image
   std::vector<vk::UniqueDescriptorSet> AllocateDescriptorSet(
-      vk::DescriptorSetLayout const& layout) const;
+      vk::DescriptorSetLayout const& layout,
+      std::vector<vk::DescriptorSetLayoutBinding> const& bindings);
+
+  // The set is only valid for the current frame of the image, such as the
+  // sets CullingPass builds the depth pyramid with. See DescriptorAllocator
+  vk::DescriptorSet AllocateFrameDescriptorSet(
+      ImageIndex const imageIndex, vk::DescriptorSetLayout const& layout,
+      std::vector<vk::DescriptorSetLayoutBinding> const& bindings) {
+    return descriptorAllocator_.AllocateFrame(imageIndex, {layout}, bindings)
+        .front();
+  }
+
+  // Must only be called once the image is no longer in flight
+  void ResetFrameDescriptorSets(ImageIndex const imageIndex) {
+    descriptorAllocator_.ResetFrame(imageIndex);
+  }
+
+  DescriptorPoolStatistics GetDescriptorPoolStatistics() const {
+    return descriptorAllocator_.GetStatistics();
+  }
 
   void UpdateDescriptorSet(
       std::vector<vk::WriteDescriptorSet> const& writeSet) const;
 
+  // The data is laid out as DescriptorInfo slots. See GetUpdateTemplateEntries
+  void UpdateDescriptorSet(vk::DescriptorSet const& set,
+                           vk::DescriptorUpdateTemplate const& updateTemplate,
+                           void const* data) const {
+    device_->updateDescriptorSetWithTemplate(set, updateTemplate, data);
+  }
+
   vk::UniqueSampler CreateSampler(vk::SamplerCreateInfo const& createInfo) {
     // TODO: tidy this up
     auto createInfo2 = createInfo;
@@ -214,18 +559,42 @@ class DeviceApi {
   vk::SurfaceFormatKHR surfaceFormat_;
   vk::UniqueSwapchainKHR swapchain_;
   vk::UniqueCommandPool commandPool_;
-  vk::UniqueDescriptorPool descriptorPool_;
+  vk::UniqueCommandPool transferCommandPool_;
+  uint32_t graphicsFamily_;
+  uint32_t transferFamily_;
+  bool dedicatedTransfer_;
+  IndirectDrawSupport indirectSupport_;
+  DescriptorAllocator descriptorAllocator_;
+  LayoutCache layoutCache_;
+  std::unique_ptr<BindlessDescriptors> bindless_;
+  std::string pipelineCachePath_;
+  vk::UniquePipelineCache pipelineCache_;
   MemoryAllocator allocator_;
+  StagingRing stagingRing_;
+  UniformArena uniformArena_;
+  std::map<uint32_t, std::unique_ptr<GeometryPool>> vertexPools_;
+  std::unique_ptr<GeometryPool> indexPool_;
+  UploadCommands pendingUpload_;
+  UploadStatistics uploadStatistics_;
+  std::vector<OffscreenImage> offscreenImages_;
+  ImageIndex offscreenImageIndex_ = 0;
+  // Last so that released resources go before what they were allocated from
+  ReleaseQueue releases_;
 
   vk::UniqueSwapchainKHR CreateSwapchain(
       vk::SurfaceKHR const& surface, vk::Extent2D& extent,
       QueueFamilies const& queueFamilies,
       vk::SwapchainKHR const& oldSwapchain) const;
+
+  void CreateOffscreenImages(vk::Extent2D const& extent);
 };
 
 vk::Extent2D SetExtent(vk::Extent2D const& windowExtent,
                        vk::SurfaceCapabilitiesKHR const& capabilities);
 
+bool IsPipelineCacheCompatible(std::vector<char> const& data,
+                               vk::PhysicalDeviceProperties const& properties);
+
 uint32_t SelectImageCount(vk::SurfaceCapabilitiesKHR const& capabilities);
 
 vk::SurfaceTransformFlagBitsKHR SelectPreTransform(
@@ -0,0 +1,119 @@
+#ifndef VULKAN_RENDERER_DRAW_LIST_HPP
+#define VULKAN_RENDERER_DRAW_LIST_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <unordered_map>
+#include <vector>
+
+namespace vulkan_renderer {
+
+// Sort keys have the fields below from the most to the least significant, so
+// that sorted draws change the most expensive state least often. Draws with
+// the same state are ordered by depth, front to back, so early depth tests
+// reject more fragments. Ids that do not fit in their field are clamped
+namespace draw_key {
+static inline uint32_t const PassBits = 4;
+static inline uint32_t const PipelineBits = 12;
+static inline uint32_t const DescriptorSetBits = 16;
+static inline uint32_t const VertexBufferBits = 16;
+static inline uint32_t const DepthBits = 16;
+
+inline uint64_t Field(uint32_t const value, uint32_t const bits) {
+  return std::min<uint64_t>(value, (uint64_t(1) << bits) - 1);
+}
+
+// The bits of non-negative floats sort in the same order as the floats, so
+// the top bits are a coarse but monotonic depth
+inline uint64_t Depth(float const depth) {
+  return std::bit_cast<uint32_t>(std::max(depth, 0.0f)) >> (32 - DepthBits);
+}
+
+inline uint64_t Create(uint32_t const pass, uint32_t const pipeline,
+                       uint32_t const descriptorSet,
+                       uint32_t const vertexBuffer, float const depth) {
+  uint64_t key = Field(pass, PassBits);
+  key = key << PipelineBits | Field(pipeline, PipelineBits);
+  key = key << DescriptorSetBits | Field(descriptorSet, DescriptorSetBits);
+  key = key << VertexBufferBits | Field(vertexBuffer, VertexBufferBits);
+  return key << DepthBits | Depth(depth);
+}
+}  // namespace draw_key
+
+// Gives each distinct value a small id in the order they are first seen so
+// that handles fit in a key field
+template <class T>
+class KeyIds {
+ public:
+  uint32_t Get(T const& value) {
+    return ids_.try_emplace(value, ids_.size()).first->second;
+  }
+
+ private:
+  std::unordered_map<T, uint32_t> ids_;
+};
+
+template <class T>
+class DrawList {
+ public:
+  void Add(uint64_t const key, T const& draw) {
+    entries_.push_back({key, draw});
+  }
+
+  void Clear() { entries_.clear(); }
+
+  // Least significant digit radix sort on bytes of the key. Bytes that are
+  // the same in every key are skipped. The sort is stable, so draws with
+  // equal keys keep the order they were added in
+  void Sort() {
+    if (entries_.empty()) return;
+
+    uint64_t differing = 0;
+    for (auto const& entry : entries_) {
+      differing |= entry.Key ^ entries_.front().Key;
+    }
+
+    scratch_.resize(entries_.size());
+    for (uint32_t shift = 0; shift < 64; shift += 8) {
+      if (((differing >> shift) & 0xff) == 0) continue;
+
+      std::array<size_t, 256> offsets{};
+      for (auto const& entry : entries_) {
+        ++offsets[(entry.Key >> shift) & 0xff];
+      }
+      size_t total = 0;
+      for (auto& offset : offsets) {
+        auto count = offset;
+        offset = total;
+        total += count;
+      }
+      for (auto const& entry : entries_) {
+        scratch_[offsets[(entry.Key >> shift) & 0xff]++] = entry;
+      }
+      entries_.swap(scratch_);
+    }
+  }
+
+  std::vector<T> GetDraws() const {
+    std::vector<T> draws;
+    draws.reserve(entries_.size());
+    for (auto const& entry : entries_) {
+      draws.push_back(entry.Draw);
+    }
+    return draws;
+  }
+
+ private:
+  struct Entry {
+    uint64_t Key;
+    T Draw;
+  };
+
+  std::vector<Entry> entries_;
+  std::vector<Entry> scratch_;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
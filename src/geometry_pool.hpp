@@ -0,0 +1,191 @@
+#ifndef VULKAN_RENDERER_GEOMETRY_POOL_HPP
+#define VULKAN_RENDERER_GEOMETRY_POOL_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "memory.hpp"
+#include "release_queue.hpp"
+#include "staging_ring.hpp"
+#include "vulkan/vulkan.hpp"
+
+namespace vulkan_renderer {
+
+// Device local buffers that meshes are sub-allocated from, counted in
+// elements of a fixed size. Meshes with the same vertex stride share a pool,
+// so draws of any of them bind the same buffer and give their place in it
+// with firstIndex and vertexOffset. Consecutive draws in a pool can then be
+// merged into one indirect draw.
+//
+// Ranges are rounded up to a power of two and freed ranges are kept in a list
+// per size, so allocating and freeing are constant time. The pool is made of
+// blocks with one buffer each. A new block is added whenever the existing ones
+// are full, and ranges larger than the block size get a block of their own.
+// Freed ranges only go back on their list once the last upload into them and
+// the frames that may still be drawing from them have completed, see
+// ReleaseQueue
+class GeometryPool {
+ public:
+  GeometryPool(uint32_t const elementSize, uint32_t const blockSize,
+               vk::BufferUsageFlags const usage, MemoryAllocator& allocator,
+               ReleaseQueue& releases, vk::Device const& device)
+      : allocator_(allocator),
+        releases_(releases),
+        device_(device),
+        elementSize_(elementSize),
+        blockSize_(blockSize),
+        usage_(usage | vk::BufferUsageFlagBits::eTransferDst) {}
+
+  GeometryPool(GeometryPool const&) = delete;
+  GeometryPool& operator=(GeometryPool const&) = delete;
+
+  Allocation Allocate(uint32_t const count) {
+    assert(count > 0);
+    // The range holds 1 << sizeClass elements
+    auto const sizeClass = static_cast<uint32_t>(std::bit_width(count - 1));
+    uint64_t const size = uint64_t(1) << sizeClass;
+
+    Range range{0, 0, sizeClass, 0};
+    auto found = std::find_if(
+        blocks_.begin(), blocks_.end(), [&](std::unique_ptr<Block>& block) {
+          return TakeRange(*block, sizeClass, range.Offset);
+        });
+    if (found != blocks_.end()) {
+      range.BlockIndex = found - blocks_.begin();
+    } else {
+      if (size > std::numeric_limits<uint32_t>::max()) {
+        throw std::length_error("Geometry range is too large");
+      }
+      AddBlock(std::max<uint32_t>(blockSize_, size));
+      range.BlockIndex = blocks_.size() - 1;
+      [[maybe_unused]] bool const taken =
+          TakeRange(*blocks_.back(), sizeClass, range.Offset);
+      assert(taken);
+    }
+
+    used_ += size;
+    auto allocationId = currentId_++;
+    allocations_.insert({allocationId, range});
+    return {allocationId, [&](uint32_t const id) { Deallocate(id); }};
+  }
+
+  // The range is only reused once the copy has completed. Called after each
+  // upload into the allocation
+  void SetUploadToken(Allocation const& allocation, UploadToken const token) {
+    GetRange(allocation).Token = token;
+  }
+
+  // In elements from the start of the allocation's buffer
+  uint32_t GetOffset(Allocation const& allocation) const {
+    return GetRange(allocation).Offset;
+  }
+
+  vk::Buffer GetBuffer(Allocation const& allocation) const {
+    return blocks_[GetRange(allocation).BlockIndex]->Buffer.get();
+  }
+
+  uint32_t GetElementSize() const { return elementSize_; }
+  uint64_t GetCapacity() const {
+    uint64_t capacity = 0;
+    for (auto const& block : blocks_) {
+      capacity += block->Capacity;
+    }
+    return capacity;
+  }
+  uint64_t GetUsed() const { return used_; }
+  uint32_t GetNumBlocks() const { return blocks_.size(); }
+
+ protected:
+  void Deallocate(uint32_t const id) {
+    auto it = allocations_.find(id);
+    if (it == allocations_.end()) return;
+    auto const& range = it->second;
+    used_ -= uint64_t(1) << range.SizeClass;
+    releases_.Push(range.Token, [this, range] {
+      blocks_[range.BlockIndex]->FreeOffsets[range.SizeClass].push_back(
+          range.Offset);
+    });
+    allocations_.erase(it);
+  }
+
+ private:
+  struct Range {
+    uint32_t BlockIndex;
+    uint32_t Offset;
+    uint32_t SizeClass;
+    // Of the last upload into the range
+    UploadToken Token;
+  };
+
+  struct Block {
+    Block(uint32_t const capacity, vk::UniqueBuffer&& buffer,
+          Allocation&& memory)
+        : Capacity(capacity),
+          Buffer(std::move(buffer)),
+          Memory(std::move(memory)) {}
+
+    uint32_t Capacity;
+    vk::UniqueBuffer Buffer;
+    Allocation Memory;
+    uint32_t Head = 0;
+    // Offsets of freed ranges for each size class
+    std::array<std::vector<uint32_t>, 33> FreeOffsets;
+  };
+
+  Range& GetRange(Allocation const& allocation) {
+    assert(allocations_.contains(allocation.Get()));
+    return allocations_.at(allocation.Get());
+  }
+  Range const& GetRange(Allocation const& allocation) const {
+    assert(allocations_.contains(allocation.Get()));
+    return allocations_.at(allocation.Get());
+  }
+
+  static bool TakeRange(Block& block, uint32_t const sizeClass,
+                        uint32_t& offset) {
+    auto& freeOffsets = block.FreeOffsets[sizeClass];
+    if (!freeOffsets.empty()) {
+      offset = freeOffsets.back();
+      freeOffsets.pop_back();
+      return true;
+    }
+    if (uint64_t(block.Head) + (uint64_t(1) << sizeClass) <= block.Capacity) {
+      offset = block.Head;
+      block.Head += uint32_t(1) << sizeClass;
+      return true;
+    }
+    return false;
+  }
+
+  void AddBlock(uint32_t const capacity) {
+    auto buffer = device_.createBufferUnique(
+        {{}, vk::DeviceSize(elementSize_) * capacity, usage_});
+    auto memory = allocator_.Allocate(
+        buffer.get(), vk::MemoryPropertyFlagBits::eDeviceLocal, device_);
+    blocks_.push_back(std::make_unique<Block>(capacity, std::move(buffer),
+                                              std::move(memory)));
+  }
+
+  MemoryAllocator& allocator_;
+  ReleaseQueue& releases_;
+  vk::Device device_;
+  uint32_t elementSize_;
+  uint32_t blockSize_;
+  vk::BufferUsageFlags usage_;
+  uint64_t used_ = 0;
+
+  // Blocks are never freed so an allocation's block index stays valid
+  std::vector<std::unique_ptr<Block>> blocks_;
+  std::unordered_map<uint32_t, Range> allocations_;
+  uint32_t currentId_ = 0;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
@@ -7,6 +7,14 @@ VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
 
 namespace vulkan_renderer {
 
+Instance::Instance(vk::Extent2D const extent, DebugMessenger&& debugMessenger,
+                   std::vector<char const*> layers,
+                   std::vector<char const*> extensions)
+    : debugMessenger_(std::move(debugMessenger)), extent_(extent) {
+  instance_ = CreateInstance(layers, extensions, debugMessenger_);
+  debugMessenger_.Initialise(instance_.get());
+}
+
 std::vector<DeviceSpec> Instance::GetSuitableDevices(
     DeviceFeatures const requiredFeatures) const {
   std::vector<DeviceSpec> devices;
@@ -80,13 +88,31 @@ vk::UniqueInstance CreateInstance(std::vector<char const*>& layers,
 
 vk::SurfaceFormatKHR GetSurfaceFormat(vk::PhysicalDevice const& device,
                                       vk::SurfaceKHR const& surface) {
-  auto formats = device.getSurfaceFormatsKHR(surface);
-
   std::vector<vk::Format> requestedFormats = {
       vk::Format::eB8G8R8A8Unorm, vk::Format::eR8G8B8A8Unorm,
       vk::Format::eB8G8R8Unorm, vk::Format::eR8G8B8Unorm};
   vk::ColorSpaceKHR requestedColorSpace = vk::ColorSpaceKHR::eSrgbNonlinear;
 
+  if (!surface) {
+    // Offscreen images only need to be rendered to and copied from. Readback
+    // expects four bytes per pixel so three channel formats are not used. An
+    // undefined format marks the device as unsuitable
+    vk::FormatFeatureFlags requiredFeatures =
+        vk::FormatFeatureFlagBits::eColorAttachment |
+        vk::FormatFeatureFlagBits::eTransferSrc;
+    for (auto const& requestedFormat :
+         {vk::Format::eB8G8R8A8Unorm, vk::Format::eR8G8B8A8Unorm}) {
+      auto properties = device.getFormatProperties(requestedFormat);
+      if ((properties.optimalTilingFeatures & requiredFeatures) ==
+          requiredFeatures) {
+        return {requestedFormat, requestedColorSpace};
+      }
+    }
+    return {vk::Format::eUndefined, requestedColorSpace};
+  }
+
+  auto formats = device.getSurfaceFormatsKHR(surface);
+
   for (auto const& requestedFormat : requestedFormats) {
     auto it = std::find_if(formats.begin(), formats.end(),
                            [&](vk::SurfaceFormatKHR const& f) {
@@ -164,6 +190,10 @@ DeviceFeatures DeviceSpec::GetAvailableFeatures() const {
     features |= DeviceFeatures::SampleShading;
   }
 
+  if (IsBindlessSupported(device_)) {
+    features |= DeviceFeatures::Bindless;
+  }
+
   return features;
 }
 
@@ -174,6 +204,12 @@ vk::PhysicalDeviceFeatures DeviceSpec::GetFeatures() const {
     features.sampleRateShading = true;
   }
 
+  // Indirect draws fall back to separate or direct draws without these
+  auto availableFeatures = device_.getFeatures();
+  features.multiDrawIndirect = availableFeatures.multiDrawIndirect;
+  features.drawIndirectFirstInstance =
+      availableFeatures.drawIndirectFirstInstance;
+
   return features;
 }
 
@@ -181,9 +217,11 @@ std::shared_ptr<Device> DeviceSpec::CreateDevice(
     vk::SurfaceKHR const& surface, vk::Extent2D& extent,
     std::function<void()> const swapchainRecreateCallback) const {
   auto features = GetFeatures();
+  bool const bindless = DeviceFeatures::Bindless ==
+                        (requiredFeatures_ & DeviceFeatures::Bindless);
   return std::make_shared<Device>(device_, &features, queueFamilies_, surface,
                                   extent, surfaceFormat_,
-                                  swapchainRecreateCallback);
+                                  swapchainRecreateCallback, bindless);
 }
 
 DeviceFeatures operator|(DeviceFeatures lhs, DeviceFeatures rhs) {
@@ -22,12 +22,15 @@ enum class DeviceFeatures : int {
   PresentQueue = 1 << 1,
   Anisotropy = 1 << 2,
   SampleShading = 1 << 3,
+  // Descriptor indexing for BindlessDescriptors
+  Bindless = 1 << 4,
 };
 
 DeviceFeatures operator|(DeviceFeatures lhs, DeviceFeatures rhs);
 DeviceFeatures operator|=(DeviceFeatures& lhs, DeviceFeatures rhs);
 DeviceFeatures operator&(DeviceFeatures lhs, DeviceFeatures rhs);
 
+// A null surface selects devices for headless rendering
 class DeviceSpec {
  public:
   DeviceSpec(vk::PhysicalDevice const& device, vk::SurfaceKHR const& surface,
@@ -102,6 +105,15 @@ class Instance {
     debugMessenger_.Initialise(instance_.get());
   }
 
+  // Headless instance without a window or surface. Its devices render into
+  // offscreen images of the given extent instead of a swapchain
+  explicit Instance(vk::Extent2D const extent,
+                    DebugMessenger&& debugMessenger = {},
+                    std::vector<char const*> layers = {},
+                    std::vector<char const*> extensions = {});
+
+  bool IsHeadless() const { return !surface_; }
+
   std::vector<DeviceSpec> GetSuitableDevices(
       DeviceFeatures const requiredFeatures = DeviceFeatures::NoFeatures) const;
 
@@ -0,0 +1,184 @@
+#ifndef VULKAN_RENDERER_LAYOUT_CACHE_HPP
+#define VULKAN_RENDERER_LAYOUT_CACHE_HPP
+
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "vulkan/vulkan.hpp"
+
+namespace vulkan_renderer {
+
+inline void HashCombine(size_t& seed, size_t const value) {
+  seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+// A slot in the data given to a descriptor update template. Every descriptor
+// of every binding gets one slot, in binding order
+union DescriptorInfo {
+  VkDescriptorImageInfo Image;
+  VkDescriptorBufferInfo Buffer;
+  VkBufferView TexelBufferView;
+};
+
+inline std::vector<vk::DescriptorUpdateTemplateEntry> GetUpdateTemplateEntries(
+    std::vector<vk::DescriptorSetLayoutBinding> const& bindings) {
+  std::vector<vk::DescriptorUpdateTemplateEntry> entries;
+  size_t slot = 0;
+  for (auto const& binding : bindings) {
+    entries.push_back({binding.binding, 0, binding.descriptorCount,
+                       binding.descriptorType, slot * sizeof(DescriptorInfo),
+                       sizeof(DescriptorInfo)});
+    slot += binding.descriptorCount;
+  }
+  return entries;
+}
+
+struct DescriptorSetLayoutKey {
+  std::vector<vk::DescriptorSetLayoutBinding> Bindings;
+
+  bool operator==(DescriptorSetLayoutKey const&) const = default;
+};
+
+struct PipelineLayoutKey {
+  std::vector<vk::DescriptorSetLayout> SetLayouts;
+  std::vector<vk::PushConstantRange> PushConstants;
+
+  bool operator==(PipelineLayoutKey const&) const = default;
+};
+
+struct DescriptorSetLayoutKeyHash {
+  size_t operator()(DescriptorSetLayoutKey const& key) const {
+    size_t seed = key.Bindings.size();
+    for (auto const& binding : key.Bindings) {
+      HashCombine(seed, binding.binding);
+      HashCombine(seed, static_cast<size_t>(binding.descriptorType));
+      HashCombine(seed, binding.descriptorCount);
+      HashCombine(seed, static_cast<VkShaderStageFlags>(binding.stageFlags));
+      HashCombine(seed, std::hash<vk::Sampler const*>{}(
+                            binding.pImmutableSamplers));
+    }
+    return seed;
+  }
+};
+
+struct PipelineLayoutKeyHash {
+  size_t operator()(PipelineLayoutKey const& key) const {
+    size_t seed = key.SetLayouts.size();
+    for (auto const& layout : key.SetLayouts) {
+      HashCombine(seed, std::hash<VkDescriptorSetLayout>{}(
+                            static_cast<VkDescriptorSetLayout>(layout)));
+    }
+    for (auto const& range : key.PushConstants) {
+      HashCombine(seed, static_cast<VkShaderStageFlags>(range.stageFlags));
+      HashCombine(seed, range.offset);
+      HashCombine(seed, range.size);
+    }
+    return seed;
+  }
+};
+
+// Descriptor set layouts and pipeline layouts shared by every pipeline on the
+// device. Pipelines with identical bindings and push constants get the same
+// Vulkan objects, which makes their descriptor sets interchangeable. Layouts
+// live as long as the cache.
+//
+// Each set layout can also have a descriptor update template that writes the
+// whole set from DescriptorInfo slots. See GetUpdateTemplateEntries
+class LayoutCache {
+ public:
+  LayoutCache(vk::Device const& device, bool const useUpdateTemplates)
+      : device_(device), useUpdateTemplates_(useUpdateTemplates) {}
+
+  LayoutCache(LayoutCache const&) = delete;
+  LayoutCache& operator=(LayoutCache const&) = delete;
+
+  vk::DescriptorSetLayout GetDescriptorSetLayout(
+      std::vector<vk::DescriptorSetLayoutBinding> const& bindings) {
+    std::scoped_lock lock(mutex_);
+    return GetSetLayout(bindings).Layout.get();
+  }
+
+  // Null when update templates are not used, in which case sets are written
+  // with vkUpdateDescriptorSets
+  vk::DescriptorUpdateTemplate GetDescriptorUpdateTemplate(
+      std::vector<vk::DescriptorSetLayoutBinding> const& bindings) {
+    if (!useUpdateTemplates_) return {};
+
+    std::scoped_lock lock(mutex_);
+    auto& setLayout = GetSetLayout(bindings);
+    if (!setLayout.UpdateTemplate) {
+      auto entries = GetUpdateTemplateEntries(bindings);
+      setLayout.UpdateTemplate = device_.createDescriptorUpdateTemplateUnique(
+          {{},
+           entries,
+           vk::DescriptorUpdateTemplateType::eDescriptorSet,
+           setLayout.Layout.get()});
+    }
+    return setLayout.UpdateTemplate.get();
+  }
+
+  vk::PipelineLayout GetPipelineLayout(
+      std::vector<vk::DescriptorSetLayout> const& setLayouts,
+      std::vector<vk::PushConstantRange> const& pushConstants) {
+    PipelineLayoutKey key{setLayouts, pushConstants};
+
+    std::scoped_lock lock(mutex_);
+    auto it = pipelineLayouts_.find(key);
+    if (it == pipelineLayouts_.end()) {
+      it = pipelineLayouts_
+               .emplace(std::move(key), device_.createPipelineLayoutUnique(
+                                            {{}, setLayouts, pushConstants}))
+               .first;
+    }
+    return it->second.get();
+  }
+
+  uint32_t GetNumDescriptorSetLayouts() const {
+    std::scoped_lock lock(mutex_);
+    return setLayouts_.size();
+  }
+
+  uint32_t GetNumPipelineLayouts() const {
+    std::scoped_lock lock(mutex_);
+    return pipelineLayouts_.size();
+  }
+
+ protected:
+  struct SetLayout {
+    vk::UniqueDescriptorSetLayout Layout;
+    vk::UniqueDescriptorUpdateTemplate UpdateTemplate;
+  };
+
+  // The cache must be locked
+  SetLayout& GetSetLayout(
+      std::vector<vk::DescriptorSetLayoutBinding> const& bindings) {
+    DescriptorSetLayoutKey key{bindings};
+    auto it = setLayouts_.find(key);
+    if (it == setLayouts_.end()) {
+      it = setLayouts_
+               .emplace(std::move(key),
+                        SetLayout{device_.createDescriptorSetLayoutUnique(
+                                      {{}, bindings}),
+                                  {}})
+               .first;
+    }
+    return it->second;
+  }
+
+ private:
+  vk::Device device_;
+  bool useUpdateTemplates_;
+  std::unordered_map<DescriptorSetLayoutKey, SetLayout,
+                     DescriptorSetLayoutKeyHash>
+      setLayouts_;
+  std::unordered_map<PipelineLayoutKey, vk::UniquePipelineLayout,
+                     PipelineLayoutKeyHash>
+      pipelineLayouts_;
+  mutable std::mutex mutex_;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
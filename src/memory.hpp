@@ -1,19 +1,41 @@
 #ifndef VULKAN_RENDERER_MEMORY_HPP
 #define VULKAN_RENDERER_MEMORY_HPP
 
+#include <algorithm>
 #include <atomic>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
+#include "defaults.hpp"
 #include "vulkan/vulkan.hpp"
 
 namespace vulkan_renderer {
 
-struct MemoryMetaData {
+// Linear and optimal resources are kept in separate blocks so that
+// neighbouring sub-allocations never violate bufferImageGranularity
+enum class ResourceTiling { Linear, Optimal };
+
+struct MemoryBlock {
   vk::UniqueDeviceMemory Memory;
-  uint32_t Offset;
   uint64_t Size;
+  bool Dedicated;
+  // Free ranges keyed by offset with their size as the value
+  std::map<uint64_t, uint64_t> FreeRanges;
+  // Host visible blocks are mapped when they are created and stay mapped until
+  // they are freed
+  void* Mapped = nullptr;
+  bool Coherent = true;
+};
+
+struct MemoryMetaData {
+  MemoryBlock* Block;
+  uint64_t Offset;
+  uint64_t Size;
+  uint32_t BlockKey;
 };
 
 class Allocation {
@@ -37,103 +59,283 @@ class Allocation {
   std::function<void(uint32_t)> deallocator_;
 };
 
-// TODO: move this to get memory from an allocator
-// (https://github.com/GPUOpen-LibrariesAndSDKs/VulkanMemoryAllocator)
+inline uint64_t AlignUp(uint64_t const value, uint64_t const alignment) {
+  return alignment > 1 ? (value + alignment - 1) / alignment * alignment
+                       : value;
+}
+
+// Takes the first free range that fits, splitting off what is left over
+inline bool TakeRange(std::map<uint64_t, uint64_t>& freeRanges,
+                      uint64_t const size, uint64_t const alignment,
+                      uint64_t& offset) {
+  for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it) {
+    auto [rangeOffset, rangeSize] = *it;
+    auto alignedOffset = AlignUp(rangeOffset, alignment);
+    if (alignedOffset + size > rangeOffset + rangeSize) continue;
+
+    freeRanges.erase(it);
+    if (alignedOffset > rangeOffset) {
+      freeRanges.insert({rangeOffset, alignedOffset - rangeOffset});
+    }
+    auto end = alignedOffset + size;
+    if (end < rangeOffset + rangeSize) {
+      freeRanges.insert({end, rangeOffset + rangeSize - end});
+    }
+
+    offset = alignedOffset;
+    return true;
+  }
+  return false;
+}
+
+// Merges the range with its free neighbours
+inline void ReleaseRange(std::map<uint64_t, uint64_t>& freeRanges,
+                         uint64_t offset, uint64_t size) {
+  auto next = freeRanges.lower_bound(offset);
+  // Merge with the following free range
+  if (next != freeRanges.end() && offset + size == next->first) {
+    size += next->second;
+    next = freeRanges.erase(next);
+  }
+  // Merge with the preceding free range
+  if (next != freeRanges.begin()) {
+    auto previous = std::prev(next);
+    if (previous->first + previous->second == offset) {
+      previous->second += size;
+      return;
+    }
+  }
+  freeRanges.insert({offset, size});
+}
+
+// Carves large per memory type blocks into sub-allocations so that each
+// buffer/image does not cost a vkAllocateMemory
 class MemoryAllocator {
  public:
   // TODO: this should take device to create memory
   MemoryAllocator(vk::PhysicalDevice const& device)
-      : memoryProperties_(device.getMemoryProperties()) {}
+      : memoryProperties_(device.getMemoryProperties()),
+        nonCoherentAtomSize_(
+            device.getProperties().limits.nonCoherentAtomSize) {}
 
   Allocation Allocate(vk::Buffer const& buffer,
                       vk::MemoryPropertyFlags const flags,
                       vk::Device const& device) {
     auto memoryRequirements = device.getBufferMemoryRequirements(buffer);
-    auto allocation = Allocate(memoryRequirements, flags, device);
+    auto allocation =
+        Allocate(memoryRequirements, flags, ResourceTiling::Linear, device);
 
-    // TODO: add offset to this
-    device.bindBufferMemory(buffer,
-                            allocations_.at(allocation.Get()).Memory.get(), 0);
+    std::scoped_lock lock(mutex_);
+    auto& mmd = allocations_.at(allocation.Get());
+    device.bindBufferMemory(buffer, mmd.Block->Memory.get(), mmd.Offset);
     return allocation;
   }
 
-  Allocation Allocate(vk::Image const& image,
-                      vk::MemoryPropertyFlags const flags,
-                      vk::Device const& device) {
+  Allocation Allocate(
+      vk::Image const& image, vk::MemoryPropertyFlags const flags,
+      vk::Device const& device,
+      vk::ImageTiling const tiling = vk::ImageTiling::eOptimal) {
     auto memoryRequirements = device.getImageMemoryRequirements(image);
-    auto allocation = Allocate(memoryRequirements, flags, device);
+    auto allocation = Allocate(memoryRequirements, flags,
+                               tiling == vk::ImageTiling::eLinear
+                                   ? ResourceTiling::Linear
+                                   : ResourceTiling::Optimal,
+                               device);
 
-    // TODO: add offset to this
-    device.bindImageMemory(image,
-                           allocations_.at(allocation.Get()).Memory.get(), 0);
+    std::scoped_lock lock(mutex_);
+    auto& mmd = allocations_.at(allocation.Get());
+    device.bindImageMemory(image, mmd.Block->Memory.get(), mmd.Offset);
     return allocation;
   }
 
-  // TODO: probably should make this thread safe
   void Deallocate(Allocation const& allocation) {
     Deallocate(allocation.Get());
   }
 
-  void* MapMemory(Allocation const& allocation,
-                  vk::Device const& device) const {
-    // TODO: assert id exists
+  // Host visible memory is persistently mapped so this only offsets into the
+  // block's mapping. The pointer is valid for the lifetime of the allocation
+  void* GetMappedData(Allocation const& allocation) const {
+    std::scoped_lock lock(mutex_);
+    assert(allocations_.contains(allocation.Get()));
     auto& mmd = allocations_.at(allocation.Get());
-    return device.mapMemory(mmd.Memory.get(), mmd.Offset, mmd.Size);
+    assert(mmd.Block->Mapped);
+    return static_cast<char*>(mmd.Block->Mapped) + mmd.Offset;
   }
 
-  void UnmapMemory(Allocation const& allocation,
+  // Makes host writes visible to the device. Does nothing for coherent memory
+  void FlushMemory(Allocation const& allocation,
                    vk::Device const& device) const {
-    // TODO: assert id exists
+    std::scoped_lock lock(mutex_);
+    assert(allocations_.contains(allocation.Get()));
     auto& mmd = allocations_.at(allocation.Get());
-    device.unmapMemory(mmd.Memory.get());
+    assert(mmd.Block->Mapped);
+    if (!mmd.Block->Coherent) {
+      device.flushMappedMemoryRanges(GetMappedRange(mmd));
+    }
   }
 
-  uint64_t GetOffset(Allocation const& allocation) const {
+  // Makes device writes visible to the host. Does nothing for coherent memory
+  void InvalidateMemory(Allocation const& allocation,
+                        vk::Device const& device) const {
+    std::scoped_lock lock(mutex_);
+    assert(allocations_.contains(allocation.Get()));
     auto& mmd = allocations_.at(allocation.Get());
-    // Get offset from table
-    return mmd.Offset;
+    assert(mmd.Block->Mapped);
+    if (!mmd.Block->Coherent) {
+      device.invalidateMappedMemoryRanges(GetMappedRange(mmd));
+    }
   }
 
- protected:
-  Allocation Allocate(vk::MemoryRequirements const& memoryRequirements,
-                      vk::MemoryPropertyFlags const flags,
-                      vk::Device const& device) {
-    auto typeBits = memoryRequirements.memoryTypeBits;
+  bool IsCoherent(Allocation const& allocation) const {
+    std::scoped_lock lock(mutex_);
+    assert(allocations_.contains(allocation.Get()));
+    return allocations_.at(allocation.Get()).Block->Coherent;
+  }
 
-    uint32_t typeIndex = uint32_t(~0);
+  bool HasMemoryType(uint32_t typeBits,
+                     vk::MemoryPropertyFlags const flags) const {
     for (uint32_t i = 0; i < memoryProperties_.memoryTypeCount; i++) {
       if ((typeBits & 1) &&
           ((memoryProperties_.memoryTypes[i].propertyFlags & flags) == flags)) {
-        typeIndex = i;
-        break;
+        return true;
       }
       typeBits >>= 1;
     }
-    assert(typeIndex != uint32_t(~0));
+    return false;
+  }
 
-    auto memory =
-        device.allocateMemoryUnique({memoryRequirements.size, typeIndex});
+  uint64_t GetOffset(Allocation const& allocation) const {
+    std::scoped_lock lock(mutex_);
+    return allocations_.at(allocation.Get()).Offset;
+  }
+
+  uint32_t GetNumBlocks() const {
+    std::scoped_lock lock(mutex_);
+    uint32_t numBlocks = 0;
+    for (auto const& [_, blocks] : blocks_) {
+      numBlocks += blocks.size();
+    }
+    return numBlocks;
+  }
+
+ protected:
+  Allocation Allocate(vk::MemoryRequirements const& memoryRequirements,
+                      vk::MemoryPropertyFlags const flags,
+                      ResourceTiling const tiling, vk::Device const& device) {
+    auto typeIndex = FindMemoryType(memoryRequirements.memoryTypeBits, flags);
+    uint32_t blockKey = typeIndex * 2 + static_cast<uint32_t>(tiling);
+    auto alignment = memoryRequirements.alignment;
+
+    std::scoped_lock lock(mutex_);
+    auto& blocks = blocks_[blockKey];
+
+    MemoryBlock* block = nullptr;
+    uint64_t offset = 0;
+    for (auto& candidate : blocks) {
+      if (!candidate->Dedicated &&
+          TakeRange(candidate->FreeRanges, memoryRequirements.size, alignment,
+                    offset)) {
+        block = candidate.get();
+        break;
+      }
+    }
+
+    if (!block) {
+      auto blockSize = GetBlockSize(typeIndex);
+      bool dedicated = memoryRequirements.size > blockSize / 2;
+      if (dedicated) {
+        blockSize = memoryRequirements.size;
+      }
+
+      auto newBlock = std::make_unique<MemoryBlock>(MemoryBlock{
+          device.allocateMemoryUnique({blockSize, typeIndex}), blockSize,
+          dedicated, {{0, blockSize}}});
+      // Freeing the memory implicitly unmaps it
+      auto typeFlags = memoryProperties_.memoryTypes[typeIndex].propertyFlags;
+      if (typeFlags & vk::MemoryPropertyFlagBits::eHostVisible) {
+        newBlock->Mapped =
+            device.mapMemory(newBlock->Memory.get(), 0, VK_WHOLE_SIZE);
+        newBlock->Coherent = static_cast<bool>(
+            typeFlags & vk::MemoryPropertyFlagBits::eHostCoherent);
+      }
+      block = newBlock.get();
+      blocks.push_back(std::move(newBlock));
+
+      [[maybe_unused]] bool const taken =
+          TakeRange(block->FreeRanges, memoryRequirements.size, alignment,
+                    offset);
+      assert(taken);
+    }
 
     static std::atomic<uint32_t> currentId = 0;
     Allocation allocation{currentId++,
                           [&](uint32_t const id) { Deallocate(id); }};
-    auto a = MemoryMetaData{std::move(memory), 0, memoryRequirements.size};
-    // TODO: probably should make this thread safe
-    allocations_.insert({allocation.Get(), std::move(a)});
+    allocations_.insert(
+        {allocation.Get(),
+         MemoryMetaData{block, offset, memoryRequirements.size, blockKey}});
 
     return allocation;
   }
 
-  // TODO: probably should make this thread safe
   void Deallocate(uint32_t const allocationId) {
-    allocations_.erase(allocationId);
+    std::scoped_lock lock(mutex_);
+    auto it = allocations_.find(allocationId);
+    if (it == allocations_.end()) return;
+
+    auto& mmd = it->second;
+    ReleaseRange(mmd.Block->FreeRanges, mmd.Offset, mmd.Size);
+
+    // Regular blocks are kept around for reuse but dedicated blocks are only
+    // ever used by one allocation
+    if (mmd.Block->Dedicated) {
+      auto& blocks = blocks_.at(mmd.BlockKey);
+      std::erase_if(blocks, [&](std::unique_ptr<MemoryBlock> const& block) {
+        return block.get() == mmd.Block;
+      });
+    }
+
+    allocations_.erase(it);
+  }
+
+  uint32_t FindMemoryType(uint32_t typeBits,
+                          vk::MemoryPropertyFlags const flags) const {
+    for (uint32_t i = 0; i < memoryProperties_.memoryTypeCount; i++) {
+      if ((typeBits & 1) &&
+          ((memoryProperties_.memoryTypes[i].propertyFlags & flags) == flags)) {
+        return i;
+      }
+      typeBits >>= 1;
+    }
+    assert(false);
+    return uint32_t(~0);
+  }
+
+  uint64_t GetBlockSize(uint32_t const typeIndex) const {
+    auto heapIndex = memoryProperties_.memoryTypes[typeIndex].heapIndex;
+    auto heapSize = memoryProperties_.memoryHeaps[heapIndex].size;
+    // Small heaps (e.g. host visible device local) should not be swallowed by
+    // a single block
+    return std::min(defaults::memory::BlockSize, heapSize / 8);
+  }
+
+  // Mapped ranges must be aligned to nonCoherentAtomSize unless they reach the
+  // end of the memory
+  vk::MappedMemoryRange GetMappedRange(MemoryMetaData const& mmd) const {
+    auto offset = mmd.Offset / nonCoherentAtomSize_ * nonCoherentAtomSize_;
+    auto end = std::min(AlignUp(mmd.Offset + mmd.Size, nonCoherentAtomSize_),
+                        mmd.Block->Size);
+    return {mmd.Block->Memory.get(), offset, end - offset};
   }
 
  private:
   vk::PhysicalDeviceMemoryProperties memoryProperties_;
+  uint64_t nonCoherentAtomSize_;
   std::map<uint32_t, MemoryMetaData> allocations_;
+  std::unordered_map<uint32_t, std::vector<std::unique_ptr<MemoryBlock>>>
+      blocks_;
+  mutable std::mutex mutex_;
 };
 
 }  // namespace vulkan_renderer
 
-#endif
\ No newline at end of file
+#endif
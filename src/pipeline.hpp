@@ -2,6 +2,7 @@
 #define VULKAN_RENDERER_PIPELINE_HPP
 
 #include "buffers/uniform_buffer.hpp"
+#include "command_state.hpp"
 #include "descriptor_sets.hpp"
 #include "device_api.hpp"
 #include "handle.hpp"
@@ -22,63 +23,122 @@ class Pipeline {
         settings_(settings),
         shaders_(settings_.CreateShaders(device)),
         descriptorSetLayouts_(CreateDescriptorSetLayouts(shaders_, device)),
-        layout_(
-            device.CreatePipelineLayout(settings_.GetPipelineLayoutCreateInfo(
-                GetLayouts(), GetPushConstants()))),
-        cache_(device.CreatePipelineCache({})),
-        pipeline_(device.CreatePipeline(
-            cache_, settings_.GetPipelineCreateInfo(
-                        GetShaderStages(), layout_.get(), renderPass))) {}
+        bindlessSet_(UsesBindless(shaders_, device) ? device.GetBindlessSet()
+                                                    : vk::DescriptorSet{}),
+        layout_(device.GetPipelineLayout(GetLayouts(device),
+                                         GetPushConstants())),
+        pipeline_(device.CreatePipeline(settings_.GetPipelineCreateInfo(
+            GetShaderStages(), layout_, renderPass))) {}
 
   PipelineId GetId() const { return id_; }
 
-  DescriptorSets CreateDescriptorSets(DeviceApi const& device) const {
+  // Shared by pipelines with identical descriptor set layouts and push
+  // constants, whose descriptor sets are then interchangeable
+  vk::PipelineLayout GetLayout() const { return layout_; }
+
+  DescriptorSets CreateDescriptorSets(DeviceApi& device) const {
     return {descriptorSetLayouts_, device};
   }
 
   void UploadPushConstants(std::shared_ptr<PushConstant> const& pushConstant,
-                           vk::CommandBuffer const& cmdBuffer) const {
-    pushConstant->Upload(layout_.get(), cmdBuffer);
+                           CommandState& state) const {
+    pushConstant->Upload(layout_, state);
   }
 
-  void Bind(vk::CommandBuffer const& cmdBuffer) const {
-    cmdBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline_.get());
+  // The bindless set is bound along with the pipeline as it is the same for
+  // every draw
+  void Bind(CommandState& state) const {
+    state.BindPipeline(pipeline_.get());
+    if (bindlessSet_) {
+      DescriptorSetBinding bindless{defaults::descriptor::BindlessSet,
+                                    bindlessSet_, {}};
+      state.BindDescriptorSets(layout_, {&bindless, 1});
+    }
   }
 
   void BindDescriptorSet(ImageIndex const imageIndex,
                          DescriptorSets const& descriptorSets,
-                         vk::CommandBuffer const& cmdBuffer) const {
-    descriptorSets.Bind(imageIndex, cmdBuffer, layout_.get());
+                         CommandState& state) const {
+    descriptorSets.Bind(imageIndex, layout_, state);
   }
 
   void Recreate(vk::RenderPass const& renderPass, DeviceApi const& device) {
-    pipeline_ = device.CreatePipeline(
-        cache_, settings_.GetPipelineCreateInfo(GetShaderStages(),
-                                                layout_.get(), renderPass));
+    pipeline_ = device.CreatePipeline(settings_.GetPipelineCreateInfo(
+        GetShaderStages(), layout_, renderPass));
   }
 
  protected:
-  // TODO: move outside class
-  std::vector<vk::DescriptorSetLayout> GetLayouts() const {
+  // Sets that the shaders skip get empty layouts so that the layouts are
+  // at their set index
+  std::vector<vk::DescriptorSetLayout> GetLayouts(DeviceApi& device) const {
+    uint32_t numSets = descriptorSetLayouts_.empty()
+                           ? 0
+                           : descriptorSetLayouts_.rbegin()->first + 1;
+    if (bindlessSet_) {
+      numSets = std::max(numSets, defaults::descriptor::BindlessSet + 1);
+    }
+
     std::vector<vk::DescriptorSetLayout> layouts;
-    for (auto& [_, set] : descriptorSetLayouts_) {
-      layouts.push_back(set.Layout.get());
+    for (uint32_t set = 0; set < numSets; ++set) {
+      if (descriptorSetLayouts_.contains(set)) {
+        layouts.push_back(descriptorSetLayouts_.at(set).Layout);
+      } else if (bindlessSet_ && set == defaults::descriptor::BindlessSet) {
+        layouts.push_back(device.GetBindlessLayout());
+      } else {
+        layouts.push_back(device.GetDescriptorSetLayout({}));
+      }
     }
     return layouts;
   }
 
   // TODO: move outside class
-  std::unordered_map<uint32_t, DescriptorSetLayout> CreateDescriptorSetLayouts(
-      std::vector<Shader> const& shaders, DeviceApi const& device) {
+  // The bindless set belongs to the device so it has no layout here
+  std::map<uint32_t, DescriptorSetLayout> CreateDescriptorSetLayouts(
+      std::vector<Shader> const& shaders, DeviceApi& device) {
     auto combinedSetBindings = GetCombinedBindingsFromShaders(shaders);
+    auto const usesBindless = UsesBindless(shaders, device);
 
-    std::unordered_map<uint32_t, DescriptorSetLayout> setLayouts;
+    std::map<uint32_t, DescriptorSetLayout> setLayouts;
     for (auto& [set, bindings] : combinedSetBindings) {
+      if (usesBindless && set == defaults::descriptor::BindlessSet) {
+        continue;
+      }
       setLayouts.emplace(set, DescriptorSetLayout{bindings, device});
     }
     return setLayouts;
   }
 
+  // Shaders whose bindless set bindings differ from the bindless arrays keep
+  // their reflected layout for the set, as on devices without bindless
+  static bool UsesBindless(std::vector<Shader> const& shaders,
+                           DeviceApi const& device) {
+    if (!device.IsBindless()) {
+      return false;
+    }
+
+    bool usesSet = false;
+    for (auto const& shader : shaders) {
+      auto const& setBindings = shader.GetBindings();
+      auto it = setBindings.find(defaults::descriptor::BindlessSet);
+      if (it == setBindings.end()) {
+        continue;
+      }
+      usesSet = true;
+      for (auto const& binding : it->second) {
+        if (device.IsBindlessBinding(binding)) {
+          continue;
+        }
+        // A runtime array has no size to give a reflected layout
+        if (binding.descriptorCount == 0) {
+          throw std::runtime_error(
+              "Shader runtime array does not match the bindless layout");
+        }
+        return false;
+      }
+    }
+    return usesSet;
+  }
+
   // TODO: move outside class
   std::vector<vk::PipelineShaderStageCreateInfo> GetShaderStages() {
     std::vector<vk::PipelineShaderStageCreateInfo> shaderStages;
@@ -103,9 +163,10 @@ class Pipeline {
   PipelineId id_;
   PipelineSettings settings_;
   std::vector<Shader> shaders_;
-  std::unordered_map<uint32_t, DescriptorSetLayout> descriptorSetLayouts_;
-  vk::UniquePipelineLayout layout_;
-  vk::UniquePipelineCache cache_;
+  std::map<uint32_t, DescriptorSetLayout> descriptorSetLayouts_;
+  vk::DescriptorSet bindlessSet_;
+  // Owned by the device layout cache
+  vk::PipelineLayout layout_;
   vk::UniquePipeline pipeline_;
 };
 
@@ -9,23 +9,60 @@
 
 namespace vulkan_renderer {
 
-// TODO: do we want to add a transfer queue?
 class Queues {
  public:
   Queues(DeviceApi const& device, QueueFamilies const& families)
       : families_(families),
         graphicsQueue_(device.GetQueue(families.Graphics(), 0)),
-        presentQueue_(device.GetQueue(families.Present(), 0)) {}
+        presentQueue_(device.GetQueue(families.Present(), 0)),
+        transferQueue_(device.GetQueue(families.Transfer(), 0)),
+        computeQueue_(device.GetQueue(families.Compute(), 0)) {}
 
   void SubmitToGraphics(vk::SubmitInfo const& submitInfo,
                         vk::Fence const& completeFence) const {
     graphicsQueue_.submit(submitInfo, completeFence);
   }
 
-  void SubmitToGraphics(vk::CommandBuffer const& buffer) const {
+  void SubmitToGraphics(vk::CommandBuffer const& buffer,
+                        vk::Fence const& completeFence = {}) const {
     vk::SubmitInfo submitInfo({}, {}, buffer, {});
 
-    graphicsQueue_.submit(submitInfo, {});
+    graphicsQueue_.submit(submitInfo, completeFence);
+  }
+
+  void SubmitToTransfer(vk::SubmitInfo const& submitInfo,
+                        vk::Fence const& completeFence) const {
+    transferQueue_.submit(submitInfo, completeFence);
+  }
+
+  void SubmitToCompute(vk::SubmitInfo const& submitInfo,
+                       vk::Fence const& completeFence) const {
+    computeQueue_.submit(submitInfo, completeFence);
+  }
+
+  // Copies are recorded on the transfer queue. When that is a separate family
+  // the graphics commands acquiring ownership wait for the transfer to release
+  // it and then signal the fence (see UploadCommands)
+  void SubmitUpload(vk::CommandBuffer const& transfer,
+                    vk::CommandBuffer const& graphics,
+                    vk::Semaphore const& released,
+                    vk::Fence const& completeFence) const {
+    if (!graphics) {
+      SubmitToGraphics(transfer, completeFence);
+      return;
+    }
+
+    transferQueue_.submit(vk::SubmitInfo{{}, {}, transfer, released}, {});
+
+    // The acquire barriers in CopyToBuffer and CopyToImage have no source
+    // stage, so the wait covers their destination stages instead
+    vk::PipelineStageFlags const waitStages =
+        vk::PipelineStageFlagBits::eVertexInput |
+        vk::PipelineStageFlagBits::eVertexShader |
+        vk::PipelineStageFlagBits::eFragmentShader |
+        vk::PipelineStageFlagBits::eTransfer;
+    graphicsQueue_.submit(vk::SubmitInfo{released, waitStages, graphics, {}},
+                          completeFence);
   }
 
   void SubmitToPresent(uint32_t const imageIndex,
@@ -44,6 +81,7 @@ class Queues {
 
   void PresentWaitIdle() const { presentQueue_.waitIdle(); }
   void GraphicsWaitIdle() const { graphicsQueue_.waitIdle(); }
+  void TransferWaitIdle() const { transferQueue_.waitIdle(); }
 
   QueueFamilies GetQueueFamilies() const { return families_; }
 
@@ -51,6 +89,8 @@ class Queues {
   QueueFamilies families_;
   vk::Queue graphicsQueue_;
   vk::Queue presentQueue_;
+  vk::Queue transferQueue_;
+  vk::Queue computeQueue_;
 };
 
 }  // namespace vulkan_renderer
@@ -0,0 +1,182 @@
+#ifndef VULKAN_RENDERER_READBACK_RING_HPP
+#define VULKAN_RENDERER_READBACK_RING_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "device_api.hpp"
+#include "vulkan/vulkan.hpp"
+
+namespace vulkan_renderer {
+
+// Pixels of a rendered frame. Data is only valid during the callback and rows
+// are tightly packed with four bytes per pixel
+struct ReadbackFrame {
+  uint64_t FrameIndex;
+  vk::Extent2D Extent;
+  vk::Format Format;
+  void const* Data;
+  vk::DeviceSize Size;
+};
+
+using ReadbackCallback = std::function<void(ReadbackFrame const&)>;
+
+struct ReadbackSubmission {
+  vk::CommandBuffer CommandBuffer;
+  vk::Fence Fence;
+};
+
+// A ring of persistently mapped host buffers that rendered images are copied
+// into. A worker thread waits for each copy and hands the pixels to the
+// callback so that rendering continues while earlier frames are read. Submit
+// only blocks once every buffer is waiting on the worker
+class ReadbackRing {
+ public:
+  ReadbackRing(uint32_t const depth, vk::Extent2D const& extent,
+               vk::Format const format, ReadbackCallback callback,
+               DeviceApi& device)
+      : device_(device),
+        extent_(extent),
+        format_(format),
+        callback_(std::move(callback)) {
+    vk::DeviceSize const size = extent_.width * extent_.height * 4;
+    for (uint32_t i = 0; i < depth; ++i) {
+      auto buffer =
+          device_.CreateBuffer(size, vk::BufferUsageFlagBits::eTransferDst);
+
+      // Cached memory is much faster to read from the host but may not be
+      // coherent. See InvalidateMemory
+      vk::MemoryPropertyFlags flags = vk::MemoryPropertyFlagBits::eHostVisible |
+                                      vk::MemoryPropertyFlagBits::eHostCached;
+      if (!device_.IsMemoryTypeSupported(buffer.get(), flags)) {
+        flags = vk::MemoryPropertyFlagBits::eHostVisible |
+                vk::MemoryPropertyFlagBits::eHostCoherent;
+      }
+      auto allocation = device_.AllocateMemory(buffer.get(), flags);
+      auto data = device_.GetMappedData(allocation);
+
+      slots_.push_back({std::move(allocation), std::move(buffer), data, size,
+                        device_.AllocateCommandBuffer(),
+                        device_.CreateFence({})});
+      freeSlots_.push_back(i);
+    }
+
+    worker_ = std::thread([&]() { Run(); });
+  }
+
+  ~ReadbackRing() {
+    {
+      std::scoped_lock lock(mutex_);
+      stopping_ = true;
+    }
+    condition_.notify_all();
+    worker_.join();
+  }
+
+  ReadbackRing(ReadbackRing const&) = delete;
+  ReadbackRing& operator=(ReadbackRing const&) = delete;
+
+  // Records the copy of the image into the next free buffer. The returned
+  // command buffer must be submitted after rendering to the image and signal
+  // the fence
+  ReadbackSubmission Submit(vk::Image const& image, uint64_t const frameIndex) {
+    std::unique_lock lock(mutex_);
+    condition_.wait(lock, [&]() { return !freeSlots_.empty(); });
+    auto slotIndex = freeSlots_.front();
+    freeSlots_.pop_front();
+    lock.unlock();
+
+    auto& slot = slots_[slotIndex];
+    device_.ResetFences({slot.Fence.get()});
+
+    slot.CommandBuffer->reset();
+    slot.CommandBuffer->begin(
+        {vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    vk::BufferImageCopy region{0,
+                               0,
+                               0,
+                               {vk::ImageAspectFlagBits::eColor, 0, 0, 1},
+                               {0, 0, 0},
+                               {extent_.width, extent_.height, 1}};
+    slot.CommandBuffer->copyImageToBuffer(
+        image, vk::ImageLayout::eTransferSrcOptimal, slot.Buffer.get(), region);
+    slot.CommandBuffer->end();
+
+    lock.lock();
+    pendingSlots_.push_back({slotIndex, frameIndex});
+    lock.unlock();
+    condition_.notify_all();
+
+    return {slot.CommandBuffer.get(), slot.Fence.get()};
+  }
+
+  // Blocks until the callback has been called for every submitted frame
+  void Flush() {
+    std::unique_lock lock(mutex_);
+    condition_.wait(lock, [&]() { return pendingSlots_.empty(); });
+  }
+
+  uint32_t GetDepth() const { return slots_.size(); }
+  ReadbackCallback const& GetCallback() const { return callback_; }
+
+ protected:
+  void Run() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+      condition_.wait(lock,
+                      [&]() { return stopping_ || !pendingSlots_.empty(); });
+      // Everything submitted is read before stopping
+      if (pendingSlots_.empty()) return;
+
+      auto [slotIndex, frameIndex] = pendingSlots_.front();
+      lock.unlock();
+
+      auto& slot = slots_[slotIndex];
+      device_.WaitForFences({slot.Fence.get()});
+      device_.InvalidateMemory(slot.Memory);
+      callback_({frameIndex, extent_, format_, slot.Data, slot.Size});
+
+      lock.lock();
+      pendingSlots_.pop_front();
+      freeSlots_.push_back(slotIndex);
+      condition_.notify_all();
+    }
+  }
+
+ private:
+  struct Slot {
+    Allocation Memory;
+    vk::UniqueBuffer Buffer;
+    void* Data;
+    vk::DeviceSize Size;
+    vk::UniqueCommandBuffer CommandBuffer;
+    vk::UniqueFence Fence;
+  };
+
+  struct PendingSlot {
+    uint32_t SlotIndex;
+    uint64_t FrameIndex;
+  };
+
+  DeviceApi& device_;
+  vk::Extent2D extent_;
+  vk::Format format_;
+  ReadbackCallback callback_;
+
+  std::vector<Slot> slots_;
+  std::deque<uint32_t> freeSlots_;
+  std::deque<PendingSlot> pendingSlots_;
+  bool stopping_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::thread worker_;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
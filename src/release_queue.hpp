@@ -0,0 +1,72 @@
+#ifndef VULKAN_RENDERER_RELEASE_QUEUE_HPP
+#define VULKAN_RENDERER_RELEASE_QUEUE_HPP
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "defaults.hpp"
+#include "staging_ring.hpp"
+
+namespace vulkan_renderer {
+
+// Releases of resources that the device may still be using. Each release waits
+// for an upload token and for every frame that was in flight when it was
+// pushed to complete. Releases still queued when the queue is destroyed are
+// dropped without being run, which destroys whatever they captured
+class ReleaseQueue {
+ public:
+  void Push(UploadToken const token, std::function<void()>&& release) {
+    releases_.push_back({token, frame_, std::move(release)});
+  }
+
+  // Must be called once the fence of the frame MaxFramesInFlight frames ago
+  // has been waited on, see RenderSemaphores
+  void StartFrame() { ++frame_; }
+
+  // Runs the releases whose uploads and frames have completed, oldest first
+  template <class IsComplete>
+  void Collect(IsComplete const& isComplete) {
+    // Releases can push new ones when they run or when what they captured is
+    // destroyed, so the queue is taken first
+    auto releases = std::exchange(releases_, {});
+    std::vector<Release> pending;
+    for (auto& release : releases) {
+      if (release.Frame + defaults::MaxFramesInFlight <= frame_ &&
+          isComplete(release.Token)) {
+        release.Run();
+        release.Run = nullptr;
+      } else {
+        pending.push_back(std::move(release));
+      }
+    }
+    // Anything pushed above is newer than the pending releases
+    std::move(releases_.begin(), releases_.end(), std::back_inserter(pending));
+    releases_ = std::move(pending);
+  }
+
+  // Destroying a release can push another, which is dropped as well
+  void Clear() {
+    while (!releases_.empty()) {
+      auto releases = std::exchange(releases_, {});
+    }
+  }
+
+  uint32_t GetSize() const { return releases_.size(); }
+
+ private:
+  struct Release {
+    UploadToken Token;
+    uint64_t Frame;
+    std::function<void()> Run;
+  };
+
+  std::vector<Release> releases_;
+  uint64_t frame_ = 0;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
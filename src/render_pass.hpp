@@ -1,13 +1,17 @@
 #ifndef VULKAN_RENDERER_RENDER_PASS_HPP
 #define VULKAN_RENDERER_RENDER_PASS_HPP
 
+#include <chrono>
+#include <future>
 #include <unordered_map>
+#include <vector>
 
 #include "defaults.hpp"
 #include "device_api.hpp"
 #include "pipeline.hpp"
 #include "queues.hpp"
 #include "render_settings.hpp"
+#include "thread_pool.hpp"
 #include "vulkan/vulkan.hpp"
 
 namespace vulkan_renderer {
@@ -25,22 +29,88 @@ class RenderPass {
             device.CreateSwapchainImageViews(), GetAttachmentImageViews(),
             renderPass_, extent)) {}
 
+  // Pipelines still compiling use the render pass
+  ~RenderPass() { WaitForPipelines(); }
+
+  RenderPass(RenderPass const&) = delete;
+  RenderPass& operator=(RenderPass const&) = delete;
+  RenderPass(RenderPass&&) = default;
+  RenderPass& operator=(RenderPass&&) = default;
+
   PipelineHandle CreatePipeline(PipelineSettings settings, DeviceApi& device) {
     settings.Multisampling.rasterizationSamples =
         settings_.GetMultisampleCount();
 
-    static std::atomic<uint32_t> currentPipelineId = 0;
-    auto pipelineId = currentPipelineId++;
-
-    auto imageViews = device.CreateSwapchainImageViews();
+    auto pipelineId = GetNextPipelineId();
     pipelines_.emplace(
         pipelineId, Pipeline{pipelineId, settings, renderPass_.get(), device});
 
     return {pipelineId, [&](PipelineId const id) { RemovePipeline(id); }};
   }
 
+  // Compiles the pipeline on the thread pool. It can't be used until it has
+  // been collected by TakeReadyPipelines
+  PipelineHandle CreatePipelineAsync(PipelineSettings settings,
+                                     DeviceApi& device,
+                                     ThreadPool& threadPool) {
+    settings.Multisampling.rasterizationSamples =
+        settings_.GetMultisampleCount();
+
+    auto pipelineId = GetNextPipelineId();
+    pendingPipelines_.emplace(
+        pipelineId,
+        threadPool.Submit([pipelineId, settings, renderPass = renderPass_.get(),
+                           &device]() {
+          return Pipeline{pipelineId, settings, renderPass, device};
+        }));
+
+    return {pipelineId, [&](PipelineId const id) { RemovePipeline(id); }};
+  }
+
+  // Moves pipelines that have finished compiling into the render pass and
+  // returns their ids
+  std::vector<PipelineId> TakeReadyPipelines() {
+    std::vector<PipelineId> readyPipelines;
+    for (auto it = pendingPipelines_.begin(); it != pendingPipelines_.end();) {
+      if (it->second.wait_for(std::chrono::seconds(0)) ==
+          std::future_status::ready) {
+        pipelines_.emplace(it->first, it->second.get());
+        readyPipelines.push_back(it->first);
+        it = pendingPipelines_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    // Discarded compiles that have finished no longer need waiting on
+    std::erase_if(discardedPipelines_,
+                  [](std::future<Pipeline> const& pipeline) {
+                    return pipeline.wait_for(std::chrono::seconds(0)) ==
+                           std::future_status::ready;
+                  });
+    return readyPipelines;
+  }
+
   // TOOD: probably need locks for this and emplace above
-  void RemovePipeline(PipelineId const id) { pipelines_.erase(id); }
+  void RemovePipeline(PipelineId const id) {
+    pipelines_.erase(id);
+    // The compile finishes in the background and is thrown away, but it still
+    // uses the render pass so it is waited on along with the pending ones
+    auto it = pendingPipelines_.find(id);
+    if (it != pendingPipelines_.end()) {
+      discardedPipelines_.push_back(std::move(it->second));
+      pendingPipelines_.erase(it);
+    }
+  }
+
+  // The depth attachment is shared by every framebuffer. Null without depth
+  ImageBuffer const* GetDepthAttachment() const {
+    return settings_.HasDepth() ? &frameBufferAttachments_.front() : nullptr;
+  }
+
+  bool HasPipeline(PipelineId const pipeline) const {
+    return pipelines_.contains(pipeline);
+  }
 
   Pipeline const& GetPipeline(PipelineId pipeline) const {
     assert(pipelines_.contains(pipeline));
@@ -55,20 +125,41 @@ class RenderPass {
     return pipelines;
   }
 
-  void Bind(ImageIndex const imageIndex, vk::Extent2D const& extent,
-            PipelineId const& pipeline,
-            vk::CommandBuffer const& cmdBuffer) const {
-    assert(imageIndex < framebuffers_.size() && pipelines_.contains(pipeline));
+  void Begin(
+      ImageIndex const imageIndex, vk::Extent2D const& extent,
+      vk::CommandBuffer const& cmdBuffer,
+      vk::SubpassContents const contents = vk::SubpassContents::eInline) const {
+    assert(imageIndex < framebuffers_.size());
 
     cmdBuffer.beginRenderPass(
         {renderPass_.get(), framebuffers_[imageIndex].GetFramebuffer(),
          vk::Rect2D(vk::Offset2D(0, 0), extent), settings_.GetClearValues()},
-        vk::SubpassContents::eInline);
-    pipelines_.at(pipeline).Bind(cmdBuffer);
+        contents);
+  }
+
+  void Bind(ImageIndex const imageIndex, vk::Extent2D const& extent,
+            PipelineId const& pipeline, CommandState& state) const {
+    Begin(imageIndex, extent, state.GetCommandBuffer());
+    // The render pass is still cleared while the pipeline is compiling
+    if (HasPipeline(pipeline)) {
+      pipelines_.at(pipeline).Bind(state);
+    }
+  }
+
+  // Secondary command buffers continue the only subpass
+  vk::CommandBufferInheritanceInfo GetInheritanceInfo(
+      ImageIndex const imageIndex) const {
+    assert(imageIndex < framebuffers_.size());
+    return {renderPass_.get(), 0, framebuffers_[imageIndex].GetFramebuffer()};
   }
 
+  // Pipelines being compiled for the old render pass have to finish before
+  // it is replaced so they can be recreated with the others
   void Recreate(vk::Extent2D const& extent, Queues const& queues,
                 DeviceApi& device) {
+    WaitForPipelines();
+    TakeReadyPipelines();
+
     frameBufferAttachments_ =
         settings_.CreateAttachmentBuffers(extent, queues, device);
     renderPass_ = device.CreateRenderpass(settings_.GetRenderPassCreateInfo());
@@ -82,6 +173,21 @@ class RenderPass {
   }
 
  protected:
+  static PipelineId GetNextPipelineId() {
+    static std::atomic<uint32_t> currentPipelineId = 0;
+    return currentPipelineId++;
+  }
+
+  void WaitForPipelines() {
+    for (auto& [_, pendingPipeline] : pendingPipelines_) {
+      if (pendingPipeline.valid()) pendingPipeline.wait();
+    }
+    for (auto& discardedPipeline : discardedPipelines_) {
+      if (discardedPipeline.valid()) discardedPipeline.wait();
+    }
+    discardedPipelines_.clear();
+  }
+
   std::vector<vk::ImageView> GetAttachmentImageViews() {
     std::vector<vk::ImageView> imageViews;
     for (auto const& buffer : frameBufferAttachments_) {
@@ -96,6 +202,8 @@ class RenderPass {
   vk::UniqueRenderPass renderPass_;
   std::vector<Framebuffer> framebuffers_;
   std::unordered_map<PipelineId, Pipeline> pipelines_;
+  std::unordered_map<PipelineId, std::future<Pipeline>> pendingPipelines_;
+  std::vector<std::future<Pipeline>> discardedPipelines_;
 };
 
 }  // namespace vulkan_renderer
@@ -1,6 +1,7 @@
 #ifndef VULKAN_RENDERER_PIPELINE_SETTINGS_HPP
 #define VULKAN_RENDERER_PIPELINE_SETTINGS_HPP
 
+#include <algorithm>
 #include <unordered_map>
 
 #include "defaults.hpp"
@@ -32,11 +33,10 @@ class RenderPassSettings {
 
   void SetMultisampleCount(vk::SampleCountFlagBits const samples) {
     samples_ = samples;
-    for (auto& attachment : attachments_) {
-      // The present attachment should only ever have one sample
-      if (attachment.finalLayout != vk::ImageLayout::ePresentSrcKHR) {
-        attachment.samples = samples_;
-      }
+    // The present attachment is always first and should only ever have one
+    // sample
+    for (auto it = attachments_.begin() + 1; it < attachments_.end(); ++it) {
+      it->samples = samples_;
     }
 
     if (samples_ == vk::SampleCountFlagBits::e1) {
@@ -64,6 +64,8 @@ class RenderPassSettings {
         attachment.samples = samples_;
       }
     }
+
+    attachments_.front().finalLayout = device.GetPresentLayout();
   }
 
   std::vector<ImageBuffer> CreateAttachmentBuffers(vk::Extent2D const& extent,
@@ -110,6 +112,7 @@ class RenderPassSettings {
   }
 
   vk::SampleCountFlagBits GetMultisampleCount() const { return samples_; }
+  bool HasDepth() const { return enableDepth_; }
 
  protected:
   void SetDepthAttachment() {
@@ -186,13 +189,25 @@ struct PipelineSettings {
   std::vector<vk::VertexInputAttributeDescription> attributeDescriptions_ = {};
   std::vector<vk::VertexInputBindingDescription> bindingDescriptons_ = {};
 
+  // Each layout gets the next binding and its attribute locations follow on
+  // from the previous layouts', so every struct numbers its locations from 0.
+  // Per instance data, such as for MeshInstance, is added after the vertex
+  // layout with an instance input rate
   template <class VertexStruct>
-  void AddVertexLayout() {
-    uint32_t binding = attributeDescriptions_.size();
+  void AddVertexLayout(
+      vk::VertexInputRate const inputRate = vk::VertexInputRate::eVertex) {
+    uint32_t binding = bindingDescriptons_.size();
+    uint32_t firstLocation = 0;
+    for (auto const& attribute : attributeDescriptions_) {
+      firstLocation = std::max(firstLocation, attribute.location + 1);
+    }
     auto attrDesc = VertexStruct::GetAttributeDetails(binding);
+    for (auto& attribute : attrDesc) {
+      attribute.location += firstLocation;
+    }
     attributeDescriptions_.insert(attributeDescriptions_.end(),
                                   attrDesc.begin(), attrDesc.end());
-    bindingDescriptons_.push_back({binding, sizeof(VertexStruct)});
+    bindingDescriptons_.push_back({binding, sizeof(VertexStruct), inputRate});
   }
 
   vk::PipelineLayoutCreateInfo GetPipelineLayoutCreateInfo(
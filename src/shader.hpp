@@ -85,10 +85,14 @@ inline SetBindingsMap GetBindingsFromShader(
     std::vector<vk::DescriptorSetLayoutBinding> bindings;
     for (uint32_t j = 0; j < set->binding_count; j++) {
       auto& binding = set->bindings[j];
+      auto descriptorType =
+          static_cast<vk::DescriptorType>(binding->descriptor_type);
+      // Uniform buffers live in the uniform arena and are bound with offsets
+      if (descriptorType == vk::DescriptorType::eUniformBuffer) {
+        descriptorType = vk::DescriptorType::eUniformBufferDynamic;
+      }
       bindings.push_back(
-          {binding->binding,
-           static_cast<vk::DescriptorType>(binding->descriptor_type),
-           binding->count, type, nullptr});
+          {binding->binding, descriptorType, binding->count, type, nullptr});
     }
     if (bindings.size()) {
       setBindings.insert({set->set, bindings});
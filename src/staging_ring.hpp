@@ -0,0 +1,220 @@
+#ifndef VULKAN_RENDERER_STAGING_RING_HPP
+#define VULKAN_RENDERER_STAGING_RING_HPP
+
+#include <bit>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "memory.hpp"
+#include "vulkan/vulkan.hpp"
+
+namespace vulkan_renderer {
+
+// Identifies a submission of uploads. Tokens increase with every submission
+// and zero is always complete
+using UploadToken = uint64_t;
+
+struct StagingRegion {
+  vk::Buffer Buffer;
+  vk::DeviceSize Offset;
+  vk::DeviceSize Size;
+};
+
+// The command buffers recording an upload. Graphics and the Released
+// semaphore are only used when copies run on a dedicated transfer family and
+// ownership has to be acquired by the graphics family
+struct UploadCommands {
+  vk::UniqueCommandBuffer Transfer;
+  vk::UniqueCommandBuffer Graphics;
+  vk::UniqueSemaphore Released;
+};
+
+struct UploadSubmission {
+  vk::Fence Fence;
+  UploadToken Token;
+};
+
+struct UploadStatistics {
+  uint32_t Copies = 0;
+  vk::DeviceSize Bytes = 0;
+  uint32_t Submits = 0;
+};
+
+// A persistently mapped host visible buffer that uploads are written into at
+// increasing offsets. Everything written between two calls to Submit is
+// guarded by a single fence and is reclaimed once that fence has signalled,
+// along with the commands that were recording the copies
+class StagingRing {
+ public:
+  StagingRing(vk::DeviceSize const size, MemoryAllocator& allocator,
+              vk::Device const& device)
+      : allocator_(allocator), device_(device) {
+    Create(size);
+  }
+
+  ~StagingRing() { Destroy(); }
+
+  StagingRing(StagingRing const&) = delete;
+  StagingRing& operator=(StagingRing const&) = delete;
+
+  StagingRegion Write(void const* data, vk::DeviceSize const size,
+                      vk::DeviceSize const alignment) {
+    auto offset = GetWriteOffset(size, alignment);
+    auto consumed = (offset >= head_ ? offset - head_ : size_ - head_) + size;
+
+    while (used_ + consumed > size_) {
+      if (!regions_.empty()) {
+        RetireOldest();
+      } else if (used_ == 0) {
+        // Only reachable when a single upload is larger than the ring
+        Destroy();
+        Create(std::bit_ceil(size));
+        return Write(data, size, alignment);
+      } else {
+        throw std::runtime_error(
+            "Staging ring is full of data that has not been submitted");
+      }
+    }
+
+    memcpy(static_cast<char*>(data_) + offset, data, size);
+    head_ = (offset + size) % size_;
+    used_ += consumed;
+    pendingBytes_ += consumed;
+    highWaterMark_ = std::max(highWaterMark_, used_);
+
+    return {buffer_.get(), offset, size};
+  }
+
+  // Closes everything written since the last submit into a region and returns
+  // the fence that the copies reading from it must signal. The commands are
+  // kept alive until then
+  UploadSubmission Submit(UploadCommands&& commands = {}) {
+    vk::UniqueFence fence;
+    if (freeFences_.empty()) {
+      fence = device_.createFenceUnique({});
+    } else {
+      fence = std::move(freeFences_.back());
+      freeFences_.pop_back();
+    }
+
+    regions_.push_back({std::move(fence), pendingBytes_, ++lastToken_,
+                        std::move(commands)});
+    pendingBytes_ = 0;
+    return {regions_.back().Fence.get(), lastToken_};
+  }
+
+  // Releases the space of every region whose copies have finished
+  void Reclaim() {
+    while (!regions_.empty() &&
+           device_.getFenceStatus(regions_.front().Fence.get()) ==
+               vk::Result::eSuccess) {
+      Release();
+    }
+  }
+
+  // Whether the write can only succeed once the data written since the last
+  // submit has been submitted and retired
+  bool NeedsSubmit(vk::DeviceSize const size,
+                   vk::DeviceSize const alignment) const {
+    auto offset = GetWriteOffset(size, alignment);
+    auto consumed = (offset >= head_ ? offset - head_ : size_ - head_) + size;
+    return pendingBytes_ > 0 && pendingBytes_ + consumed > size_;
+  }
+
+  // The token that the next submit will be given
+  UploadToken GetNextToken() const { return lastToken_ + 1; }
+
+  bool IsComplete(UploadToken const token) const {
+    return token <= completedToken_;
+  }
+
+  void Wait(UploadToken const token) {
+    while (!IsComplete(token) && !regions_.empty()) {
+      RetireOldest();
+    }
+  }
+
+  vk::DeviceSize GetSize() const { return size_; }
+  vk::DeviceSize GetUsed() const { return used_; }
+  vk::DeviceSize GetHighWaterMark() const { return highWaterMark_; }
+
+ protected:
+  vk::DeviceSize GetWriteOffset(vk::DeviceSize const size,
+                                vk::DeviceSize const alignment) const {
+    auto offset = AlignUp(head_, alignment);
+    // Doesn't fit before the end so skip the remainder and wrap around
+    return offset + size > size_ ? 0 : offset;
+  }
+
+  void Create(vk::DeviceSize const size) {
+    size_ = size;
+    buffer_ = device_.createBufferUnique(
+        {{}, size_, vk::BufferUsageFlagBits::eTransferSrc});
+    allocation_ = std::make_unique<Allocation>(allocator_.Allocate(
+        buffer_.get(),
+        vk::MemoryPropertyFlagBits::eHostVisible |
+            vk::MemoryPropertyFlagBits::eHostCoherent,
+        device_));
+    data_ = allocator_.GetMappedData(*allocation_);
+    head_ = 0;
+    used_ = 0;
+  }
+
+  void Destroy() {
+    while (!regions_.empty()) {
+      RetireOldest();
+    }
+    allocation_.reset();
+    buffer_.reset();
+  }
+
+  void RetireOldest() {
+    [[maybe_unused]] auto result = device_.waitForFences(
+        regions_.front().Fence.get(), true, UINT64_MAX);
+    assert(result == vk::Result::eSuccess);
+    Release();
+  }
+
+  void Release() {
+    auto& region = regions_.front();
+    used_ -= region.Bytes;
+    completedToken_ = region.Token;
+    device_.resetFences(region.Fence.get());
+    freeFences_.push_back(std::move(region.Fence));
+    regions_.pop_front();
+  }
+
+ private:
+  struct Region {
+    vk::UniqueFence Fence;
+    vk::DeviceSize Bytes;
+    UploadToken Token;
+    UploadCommands Commands;
+  };
+
+  MemoryAllocator& allocator_;
+  vk::Device device_;
+
+  vk::UniqueBuffer buffer_;
+  std::unique_ptr<Allocation> allocation_;
+  void* data_ = nullptr;
+
+  vk::DeviceSize size_ = 0;
+  vk::DeviceSize head_ = 0;
+  vk::DeviceSize used_ = 0;
+  vk::DeviceSize pendingBytes_ = 0;
+  vk::DeviceSize highWaterMark_ = 0;
+
+  UploadToken lastToken_ = 0;
+  UploadToken completedToken_ = 0;
+
+  std::deque<Region> regions_;
+  std::vector<vk::UniqueFence> freeFences_;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
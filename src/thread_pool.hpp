@@ -0,0 +1,88 @@
+#ifndef VULKAN_RENDERER_THREAD_POOL_HPP
+#define VULKAN_RENDERER_THREAD_POOL_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace vulkan_renderer {
+
+// Runs tasks on a fixed number of worker threads. Tasks that have not started
+// when the pool is destroyed are dropped and their futures report a broken
+// promise
+class ThreadPool {
+ public:
+  explicit ThreadPool(uint32_t const numThreads =
+                          std::max(1u, std::thread::hardware_concurrency())) {
+    for (uint32_t i = 0; i < numThreads; ++i) {
+      threads_.emplace_back([&]() { Run(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::scoped_lock lock(mutex_);
+      stopping_ = true;
+      tasks_.clear();
+    }
+    condition_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  ThreadPool(ThreadPool const&) = delete;
+  ThreadPool& operator=(ThreadPool const&) = delete;
+
+  template <class Task>
+  std::future<std::invoke_result_t<Task>> Submit(Task&& task) {
+    // std::function needs to be copyable so the task is shared
+    auto packagedTask =
+        std::make_shared<std::packaged_task<std::invoke_result_t<Task>()>>(
+            std::forward<Task>(task));
+    auto future = packagedTask->get_future();
+    {
+      std::scoped_lock lock(mutex_);
+      tasks_.push_back([packagedTask]() { (*packagedTask)(); });
+    }
+    condition_.notify_one();
+    return future;
+  }
+
+  uint32_t GetNumThreads() const { return threads_.size(); }
+
+ protected:
+  void Run() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock lock(mutex_);
+        condition_.wait(lock, [&]() { return stopping_ || !tasks_.empty(); });
+        if (stopping_) return;
+
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+ private:
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> tasks_;
+  bool stopping_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
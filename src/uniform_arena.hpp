@@ -0,0 +1,155 @@
+#ifndef VULKAN_RENDERER_UNIFORM_ARENA_HPP
+#define VULKAN_RENDERER_UNIFORM_ARENA_HPP
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "memory.hpp"
+#include "vulkan/vulkan.hpp"
+
+namespace vulkan_renderer {
+
+// Persistently mapped uniform buffers that every uniform buffer is
+// sub-allocated from. A uniform has the same offset in each swapchain image's
+// buffer so descriptors are written once and the offset is given when binding
+// (see eUniformBufferDynamic).
+//
+// The arena is made of blocks with one buffer per image. A new block is added
+// whenever the existing ones are full, and uniforms larger than the block size
+// get a block of their own. Freed ranges are merged with their neighbours
+class UniformArena {
+ public:
+  UniformArena(vk::DeviceSize const blockSize, vk::DeviceSize const alignment,
+               MemoryAllocator& allocator, vk::Device const& device)
+      : allocator_(allocator),
+        device_(device),
+        blockSize_(blockSize),
+        alignment_(alignment) {}
+
+  UniformArena(UniformArena const&) = delete;
+  UniformArena& operator=(UniformArena const&) = delete;
+
+  Allocation Allocate(vk::DeviceSize size) {
+    size = AlignUp(size, alignment_);
+
+    uint32_t blockIndex = 0;
+    uint64_t offset = 0;
+    while (blockIndex < blocks_.size() &&
+           !TakeRange(blocks_[blockIndex]->FreeRanges, size, alignment_,
+                      offset)) {
+      ++blockIndex;
+    }
+
+    if (blockIndex == blocks_.size()) {
+      auto blockSize = std::max(blockSize_, size);
+      blocks_.push_back(std::make_unique<Block>(
+          Block{blockSize, {{0, blockSize}}, {}}));
+      [[maybe_unused]] bool const taken =
+          TakeRange(blocks_.back()->FreeRanges, size, alignment_, offset);
+      assert(taken);
+    }
+
+    used_ += size;
+    auto allocationId = currentId_++;
+    allocations_.insert({allocationId, {blockIndex, offset, size}});
+    return {allocationId, [&](uint32_t const id) { Deallocate(id); }};
+  }
+
+  // From the start of the allocation's buffer, see GetBuffer
+  vk::DeviceSize GetOffset(Allocation const& allocation) const {
+    return GetRange(allocation).Offset;
+  }
+
+  // Buffers are created the first time an image uses them
+  vk::Buffer GetBuffer(uint32_t const imageIndex,
+                       Allocation const& allocation) {
+    return GetFrame(GetRange(allocation).BlockIndex, imageIndex).Buffer.get();
+  }
+
+  void* GetData(uint32_t const imageIndex, Allocation const& allocation) {
+    auto const& range = GetRange(allocation);
+    return static_cast<char*>(GetFrame(range.BlockIndex, imageIndex).Data) +
+           range.Offset;
+  }
+
+  vk::DeviceSize GetSize() const {
+    vk::DeviceSize size = 0;
+    for (auto const& block : blocks_) {
+      size += block->Size;
+    }
+    return size;
+  }
+  vk::DeviceSize GetUsed() const { return used_; }
+  uint32_t GetNumBlocks() const { return blocks_.size(); }
+
+ protected:
+  void Deallocate(uint32_t const id) {
+    auto it = allocations_.find(id);
+    if (it == allocations_.end()) return;
+    auto const& range = it->second;
+    ReleaseRange(blocks_[range.BlockIndex]->FreeRanges, range.Offset,
+                 range.Size);
+    used_ -= range.Size;
+    allocations_.erase(it);
+  }
+
+ private:
+  struct Frame {
+    std::unique_ptr<Allocation> Memory;
+    vk::UniqueBuffer Buffer;
+    void* Data;
+  };
+
+  struct Block {
+    vk::DeviceSize Size;
+    // Free ranges keyed by offset with their size as the value
+    std::map<uint64_t, uint64_t> FreeRanges;
+    // One per swapchain image
+    std::vector<Frame> Frames;
+  };
+
+  struct Range {
+    uint32_t BlockIndex;
+    vk::DeviceSize Offset;
+    vk::DeviceSize Size;
+  };
+
+  Range const& GetRange(Allocation const& allocation) const {
+    assert(allocations_.contains(allocation.Get()));
+    return allocations_.at(allocation.Get());
+  }
+
+  Frame& GetFrame(uint32_t const blockIndex, uint32_t const imageIndex) {
+    auto& block = *blocks_[blockIndex];
+    while (block.Frames.size() <= imageIndex) {
+      auto buffer = device_.createBufferUnique(
+          {{}, block.Size, vk::BufferUsageFlagBits::eUniformBuffer});
+      auto memory = std::make_unique<Allocation>(allocator_.Allocate(
+          buffer.get(),
+          vk::MemoryPropertyFlagBits::eHostVisible |
+              vk::MemoryPropertyFlagBits::eHostCoherent,
+          device_));
+      auto data = allocator_.GetMappedData(*memory);
+      block.Frames.push_back({std::move(memory), std::move(buffer), data});
+    }
+    return block.Frames[imageIndex];
+  }
+
+  MemoryAllocator& allocator_;
+  vk::Device device_;
+  vk::DeviceSize blockSize_;
+  vk::DeviceSize alignment_;
+  vk::DeviceSize used_ = 0;
+
+  // Blocks are never freed so an allocation's block index stays valid
+  std::vector<std::unique_ptr<Block>> blocks_;
+  std::unordered_map<uint32_t, Range> allocations_;
+  uint32_t currentId_ = 0;
+};
+
+}  // namespace vulkan_renderer
+
+#endif
@@ -19,23 +19,54 @@ class QueueFamilies {
         graphics_ = familyIndex;
       }
 
-      if (present_ == -1 && device.getSurfaceSupportKHR(familyIndex, surface)) {
+      if (present_ == -1 && surface &&
+          device.getSurfaceSupportKHR(familyIndex, surface)) {
         present_ = familyIndex;
       }
 
+      // Families without graphics run alongside rendering so prefer those
+      // that do nothing but transfer for copies
+      if (!(family.queueFlags & vk::QueueFlagBits::eGraphics)) {
+        if (family.queueFlags & vk::QueueFlagBits::eCompute) {
+          if (compute_ == -1) compute_ = familyIndex;
+        } else if (transfer_ == -1 &&
+                   (family.queueFlags & vk::QueueFlagBits::eTransfer)) {
+          transfer_ = familyIndex;
+        }
+      }
+
       ++familyIndex;
-      if (graphics_ != -1 && present_ != -1) return;
     }
+
+    // Headless devices never present so graphics stands in for present
+    if (!surface) present_ = graphics_;
+
+    // Fallback to async compute for transfers and then to graphics which
+    // always supports both
+    if (transfer_ == -1) transfer_ = compute_ != -1 ? compute_ : graphics_;
+    if (compute_ == -1) compute_ = graphics_;
   }
 
   uint32_t Graphics() const { return graphics_; }
   uint32_t Present() const { return present_; }
+  uint32_t Transfer() const { return transfer_; }
+  uint32_t Compute() const { return compute_; }
 
   bool Complete() const { return graphics_ != -1 && present_ != -1; }
   bool IsUniqueFamilies() const { return graphics_ == present_; }
+  bool HasDedicatedTransfer() const { return transfer_ != graphics_; }
+  bool HasAsyncCompute() const { return compute_ != graphics_; }
 
+  // All the families that the device creates a queue for
   std::vector<uint32_t> UniqueIndices() const {
     // Removes duplicate indices
+    std::set<uint32_t> uniqueSet{
+        static_cast<uint32_t>(graphics_), static_cast<uint32_t>(present_),
+        static_cast<uint32_t>(transfer_), static_cast<uint32_t>(compute_)};
+    return {uniqueSet.begin(), uniqueSet.end()};
+  }
+
+  std::vector<uint32_t> PresentationIndices() const {
     std::set<uint32_t> uniqueSet{static_cast<uint32_t>(graphics_),
                                  static_cast<uint32_t>(present_)};
     return {uniqueSet.begin(), uniqueSet.end()};
@@ -44,6 +75,8 @@ class QueueFamilies {
  private:
   int graphics_ = -1;
   int present_ = -1;
+  int transfer_ = -1;
+  int compute_ = -1;
 };
 
 }  // namespace vulkan_renderer
@@ -0,0 +1,6 @@
+#version 450
+
+// Reads no vertex attributes, so meshes of any stride can be drawn with it
+void main() {
+    gl_Position = vec4(0.0, 0.0, 0.0, 1.0);
+}
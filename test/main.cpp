@@ -93,10 +93,13 @@ int main() {
       },
       1);
 
-  auto uniform = std::make_shared<vulkan_renderer::PushConstantData<MVP>>(
-      MVP{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1},
-      vk::ShaderStageFlagBits::eVertex, 0);
-  mesh->AddPushConstant(uniform);
+  // The transform is read from a storage buffer so updating it every frame
+  // does not re-record the command
+  auto drawData = std::make_shared<vulkan_renderer::DrawDataBuffer<MVP>>(1, 0);
+  auto drawIndex =
+      drawData->AddDraw(MVP{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1});
+  mesh->SetDrawIndex(drawIndex);
+  mesh->AddUniform(drawData);
 
   // auto uniform = std::make_shared<vulkan_renderer::UniformBuffer<MVP>>(
   //     MVP{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1}, 0);
@@ -125,7 +128,7 @@ int main() {
                              glm::vec3(0.0f, 0.0f, 1.0f));
 
     auto mvp = proj * view * model;
-    uniform->Update(*reinterpret_cast<MVP*>(&mvp));
+    drawData->Update(drawIndex, *reinterpret_cast<MVP*>(&mvp));
 
     device->Draw(commandHandle, pipeline);
 
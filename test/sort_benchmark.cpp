@@ -0,0 +1,98 @@
+#include <iostream>
+
+#include "containers.hpp"
+#include "instance.hpp"
+#include "vulkan/vulkan.hpp"
+
+// Records the same scene with draws sorted by their key and in the order they
+// were added, and prints the state changes recorded each way.
+//
+// Every buffer has its own descriptor sets, so the scene has none and its
+// meshes only differ in the geometry pool they come from. Meshes of the two
+// vertex types are added alternately, so unsorted draws change the bound
+// vertex buffer on every draw
+
+namespace {
+
+uint32_t const NumMeshes = 1000;
+// Uploads complete over the first frames
+uint32_t const MaxFrames = 100;
+
+template <class T>
+std::shared_ptr<vulkan_renderer::Buffer> CreateMesh(uint32_t const i) {
+  std::vector<T> vertices(3);
+  std::vector<uint32_t> indices{0, 1, 2};
+  auto mesh =
+      std::make_shared<vulkan_renderer::IndexBuffer<T>>(vertices, indices);
+  mesh->SetDepth(static_cast<float>((i * 7919) % NumMeshes));
+  return mesh;
+}
+
+// Renders until a frame has recorded every draw and returns its statistics.
+// Statistics are those of the previous frame, so they are read after the next
+// one has started
+vulkan_renderer::RecordStatistics Record(
+    vulkan_renderer::Device& device,
+    vulkan_renderer::RenderPassHandle const& renderPass,
+    vulkan_renderer::CommandHandle const& command,
+    vulkan_renderer::PipelineHandle const& pipeline) {
+  vulkan_renderer::RecordStatistics statistics;
+  for (uint32_t frame = 0; frame < MaxFrames; ++frame) {
+    device.StartRender(renderPass);
+    if (frame > 0) {
+      statistics = device.GetRecordStatistics();
+    }
+    device.Draw(command, pipeline);
+    device.PresentRender();
+    if (statistics.Draws == NumMeshes) break;
+  }
+  device.WaitIdle();
+  return statistics;
+}
+
+void Print(char const* name,
+           vulkan_renderer::RecordStatistics const& statistics) {
+  auto const& recorded = statistics.Recorded;
+  std::cout << name << ":\n"
+            << "  draws:           " << statistics.Draws << "\n"
+            << "  draw calls:      " << statistics.DrawCalls << "\n"
+            << "  pipelines:       " << recorded.Pipelines << "\n"
+            << "  vertex buffers:  " << recorded.VertexBuffers << "\n"
+            << "  index buffers:   " << recorded.IndexBuffers << "\n"
+            << "  descriptor sets: " << recorded.DescriptorSets << "\n"
+            << "  push constants:  " << recorded.PushConstants << "\n"
+            << "  dynamic states:  " << recorded.DynamicStates << "\n"
+            << "  recorded:        " << recorded.Total() << "\n"
+            << "  skipped:         " << statistics.Skipped.Total() << "\n";
+}
+
+}  // namespace
+
+int main() {
+  vulkan_renderer::Instance instance(vk::Extent2D{800, 500});
+  auto device = instance.GetDevice();
+
+  auto renderPass = device->CreateRenderPass({true});
+
+  std::unordered_map<vk::ShaderStageFlagBits, std::vector<char>> shaders{
+      {vk::ShaderStageFlagBits::eVertex,
+       {vulkan_renderer::LoadShader("../../test/bench_vert.spv")}},
+      {vk::ShaderStageFlagBits::eFragment,
+       {vulkan_renderer::LoadShader("../../test/bench_frag.spv")}}};
+  auto pipeline = device->CreatePipeline({.Shaders = shaders}, renderPass);
+
+  vulkan_renderer::Command sorted;
+  vulkan_renderer::Command unsorted;
+  unsorted.SetDrawSorting(false);
+  for (uint32_t i = 0; i < NumMeshes; ++i) {
+    auto mesh = i % 2 == 0 ? CreateMesh<ColouredVertex2D>(i)
+                           : CreateMesh<UVVertex2D>(i);
+    sorted.AddVertexBuffer(mesh);
+    unsorted.AddVertexBuffer(mesh);
+  }
+  auto sortedHandle = device->AddCommand(std::move(sorted));
+  auto unsortedHandle = device->AddCommand(std::move(unsorted));
+
+  Print("Unsorted", Record(*device, renderPass, unsortedHandle, pipeline));
+  Print("Sorted", Record(*device, renderPass, sortedHandle, pipeline));
+}
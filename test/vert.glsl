@@ -4,9 +4,10 @@
 //    mat4 mvp;
 // } ubo;
 
-layout (push_constant) uniform constants {
-    mat4 mvp;
-} pc;
+// Indexed by the draw index that DrawDataBuffer::AddDraw returned
+layout(std430, binding = 0) readonly buffer DrawData {
+    mat4 mvp[];
+} drawData;
 
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColour;
@@ -16,7 +17,7 @@ layout(location = 0) out vec3 fragColour;
 layout(location = 1) out vec2 fragTexCoord;
 
 void main() {
-    gl_Position = pc.mvp * vec4(inPosition, 1.0);
+    gl_Position = drawData.mvp[gl_InstanceIndex] * vec4(inPosition, 1.0);
     fragColour = inColour;
     fragTexCoord = inUV;
 }